@@ -317,7 +317,7 @@ void commit_paste(int swap, int *update)
 		/* Remove new mask if it's all 255 */
 		if (is_filled(ti.img[CHN_SEL], 255, fw * fh))
 		{
-			free(ti.img[CHN_SEL]);
+			mem_chan_free(ti.img[CHN_SEL]);
 			ti.img[CHN_SEL] = NULL;
 		}
 		mem_clip_new(fw, fh, MEM_BPP, 0, NULL);
@@ -1193,6 +1193,13 @@ void update_stuff(int flags)
 		(!mem_clipboard || (mem_clip_bpp > MEM_BPP)))
 		pressed_select(FALSE);
 
+	/* Redrawing both windows means image contents may have changed */
+	if ((flags & UPD_ALLV) == UPD_ALLV)
+	{
+		mip_drop(NULL);
+		main_update_layers(0, 0, -1, -1);
+	}
+
 	if (flags & CF_CAB)
 		flags |= mem_channel == CHN_IMAGE ? UPD_AB : UPD_GRAD;
 	if (flags & CF_GEOM)
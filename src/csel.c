@@ -43,10 +43,7 @@ int csel_preview = 0x00FF00, csel_preview_a = 128, csel_overlay;
 
 double gamma256[256], gamma64[64];
 double midgamma256[256];
-
-#ifndef NATIVE_DOUBLES
-float Fgamma256[256];
-#endif
+float gamma256f[256];
 
 static float CIE[CIENUM + 2];
 static float EXP[EXPNUM];
@@ -367,13 +364,11 @@ void init_cols(void)
 	make_CIE();
 	make_EXP();
 	make_rgb_xyz();
-#ifndef NATIVE_DOUBLES
 	/* Fill reduced-precision gamma table */
 	{
 		int i;
-		for (i = 0; i < 256; i++) Fgamma256[i] = gamma256[i];
+		for (i = 0; i < 256; i++) gamma256f[i] = gamma256[i];
 	}
-#endif
 }
 
 /* Get L*X*N* triple */
@@ -401,6 +396,62 @@ static double get_vect(int col)
 	return ((c2 + c2 + c1) * 255 + midc * 255 / (double)maxc);
 }
 
+/* The cache in *info gets filled on demand, by any number of threads at once,
+ * without locking: a map field only ever changes from 0 (not mapped) to its
+ * value, which is the same whichever thread computes it, so the fields are
+ * ORed into place. Without atomic OR, a concurrent update may get lost - which
+ * only means that field will be computed anew next time */
+#ifdef HAVE__SFA
+#define CSEL_OR(A,V) __sync_fetch_and_or(&(A), (V))
+#define CSEL_BARRIER() __sync_synchronize()
+#else
+#define CSEL_OR(A,V) ((A) |= (V))
+#define CSEL_BARRIER()
+#endif
+
+/* Palette cache slots can change their value, so need a lock for that */
+static void csel_pcache(csel_info *info, int j, int k)
+{
+	double dist = 0.0, lxn[3];
+	int l, jj;
+	DEF_MUTEX(csel_lock); // To prevent concurrent writes to palette cache
+
+	LOCK_MUTEX(csel_lock);
+	if (info->pcache[j] != k)
+	{
+		if (info->mode == 0) /* Sphere mode */
+		{
+			get_lxn(lxn, k);
+			dist = (lxn[0] - info->clxn[0]) *
+				(lxn[0] - info->clxn[0]) +
+				(lxn[1] - info->clxn[1]) *
+				(lxn[1] - info->clxn[1]) +
+				(lxn[2] - info->clxn[2]) *
+				(lxn[2] - info->clxn[2]);
+		}
+		else if (info->mode == 1) /* Angle mode */
+		{
+			dist = fabs(get_vect(k) - info->cvec);
+			if (dist > 765.0) dist = 1530.0 - dist;
+		}
+		else if (info->mode == 2) /* Cube mode */
+		{
+			l = abs(INT_2_R(info->center) - INT_2_R(k));
+			jj = abs(INT_2_G(info->center) - INT_2_G(k));
+			if (l < jj) l = jj;
+			jj = abs(INT_2_B(info->center) - INT_2_B(k));
+			dist = l > jj ? l : jj;
+		}
+		if (dist <= info->range2)
+			info->pmap[j >> 5] |= 1U << (j & 31);
+		else info->pmap[j >> 5] &= ~(1U << (j & 31));
+		/* Map bit must be there before the slot gets validated */
+		CSEL_BARRIER();
+		info->pcache[j] = k;
+	}
+	UNLOCK_MUTEX(csel_lock);
+}
+
 /* Answer which pixels are masked through selectivity */
 int csel_scan(int start, int step, int cnt, unsigned char *mask,
 	unsigned char *img, csel_info *info)
@@ -408,10 +459,8 @@ int csel_scan(int start, int step, int cnt, unsigned char *mask,
 	unsigned char res = 0;
 	double d, dist = 0.0, lxn[3];
 	int i, j, k, l, jj, st3 = step * 3;
-	DEF_MUTEX(csel_lock); // To prevent concurrent writes to *info
 
 
-	LOCK_MUTEX(csel_lock);
 	cnt = start + step * (cnt - 1) + 1;
 	if (!mask)
 	{
@@ -424,35 +473,7 @@ int csel_scan(int start, int step, int cnt, unsigned char *mask,
 		{
 			j = img[i];
 			k = PNG_2_INT(mem_pal[j]);
-			if (info->pcache[j] != k)
-			{
-				info->pcache[j] = k;
-				if (info->mode == 0) /* Sphere mode */
-				{
-					get_lxn(lxn, k);
-					dist = (lxn[0] - info->clxn[0]) *
-						(lxn[0] - info->clxn[0]) +
-						(lxn[1] - info->clxn[1]) *
-						(lxn[1] - info->clxn[1]) +
-						(lxn[2] - info->clxn[2]) *
-						(lxn[2] - info->clxn[2]);
-				}
-				else if (info->mode == 1) /* Angle mode */
-				{
-					dist = fabs(get_vect(k) - info->cvec);
-					if (dist > 765.0) dist = 1530.0 - dist;
-				}
-				else if (info->mode == 2) /* Cube mode */
-				{
-					l = abs(INT_2_R(info->center) - INT_2_R(k));
-					jj = abs(INT_2_G(info->center) - INT_2_G(k));
-					if (l < jj) l = jj;
-					jj = abs(INT_2_B(info->center) - INT_2_B(k));
-					dist = l > jj ? l : jj;
-				}
-				if (dist <= info->range2)
-					info->pmap[j >> 5] |= 1 << (j & 31);
-			}
+			if (info->pcache[j] != k) csel_pcache(info, j, k);
 			if (((info->pmap[j >> 5] >> (j & 31)) ^ info->invert) & 1)
 				mask[i] |= 255;
 		}
@@ -489,7 +510,7 @@ int csel_scan(int start, int step, int cnt, unsigned char *mask,
 					(lxn[2] - info->clxn[2]) *
 					(lxn[2] - info->clxn[2]);
 				l = dist <= info->range2 ? 3 : 2;
-				info->colormap[j] |= l << k;
+				CSEL_OR(info->colormap[j], l << k);
 			}
 			if ((l ^ info->invert) & 1) mask[i] |= 255;
 		}
@@ -517,7 +538,8 @@ int csel_scan(int start, int step, int cnt, unsigned char *mask,
 					if (dist > 765.0) dist = 1530.0 - dist;
 					if (dist <= info->range2) l += jj;
 				}
-				info->colormap[j >> 3] |= (l + 8) << ((j & 7) << 2);
+				CSEL_OR(info->colormap[j >> 3],
+					(l + 8) << ((j & 7) << 2));
 			}
 			if (((l >> k) ^ info->invert) & 1) mask[i] |= 255;
 		}
@@ -537,7 +559,6 @@ int csel_scan(int start, int step, int cnt, unsigned char *mask,
 				mask[i] |= 255;
 		}
 	}
-	UNLOCK_MUTEX(csel_lock);
 	return (res);
 }
 
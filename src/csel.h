@@ -40,11 +40,14 @@ double midgamma256[256];
 int kgamma256;
 extern unsigned char ungamma256[];
 
+/* Reduced-precision gamma table, for SIMD code */
+float gamma256f[256];
+
 /* This gamma table is for when we need numeric stability */
 #ifdef NATIVE_DOUBLES
 #define Fgamma256 gamma256
 #else
-float Fgamma256[256];
+#define Fgamma256 gamma256f
 #endif
 
 static inline int UNGAMMA256(double x)
@@ -32,6 +32,7 @@
 #include "canvas.h"
 #include "inifile.h"
 #include "font.h"
+#include "thread.h"
 
 #include <iconv.h>
 #include <ft2build.h>
@@ -188,6 +189,215 @@ static void ft_draw_bitmap(
 	}
 }
 
+/* Opened faces are kept for reuse, least recently used one getting replaced;
+ * rendered glyphs are kept for the face & transform used last. Glyphs get
+ * rendered at the pen's subpixel offset only, and moved into place by whole
+ * pixels, so that each needs rendering only once */
+
+#define FT_FACES 8		/* Number of faces kept open */
+#define FT_GLYPH_HASH 256	/* Power of 2 */
+#define FT_GLYPH_MAX (4 * 1024 * 1024) /* Max bytes in glyph cache */
+
+typedef struct {
+	FT_Face face;
+	char *filename;
+	int face_index, size, dpi;
+	int scalable, Y1, Y2;	// Scalable flag & line metrics
+	unsigned int used;	// LRU stamp
+} ftface;
+
+typedef struct ftglyph ftglyph;
+struct ftglyph {
+	ftglyph *next;
+	FT_UInt index;
+	int fx, fy;		// Pen's subpixel offset
+	int ok;			// Loaded successfully
+	int left, top;		// Bitmap position
+	FT_Bitmap bitmap;
+	FT_Vector advance;
+	FT_Glyph_Metrics metrics;
+};
+
+static FT_Library ft_lib;
+static int ft_lib_ok;
+static ftface ft_faces[FT_FACES];
+static unsigned int ft_stamp;
+
+static wjmem *glyph_mem;
+static ftglyph *glyph_hash[FT_GLYPH_HASH];
+static size_t glyph_bytes;
+static FT_Face glyph_face;
+static FT_Int32 glyph_flags;
+static FT_Matrix glyph_matrix;
+
+static void ft_glyphs_clear()
+{
+	wjmemfree(glyph_mem);
+	glyph_mem = NULL;
+	memset(glyph_hash, 0, sizeof(glyph_hash));
+	glyph_bytes = 0;
+	glyph_face = NULL;
+}
+
+/* Get face with size set, opening it if not yet open */
+static ftface *ft_get_face(char *filename, int face_index, int size, int dpi)
+{
+	ftface *fp, *fl = ft_faces;
+	FT_Face face;
+	int i, fix_w, fix_h, error;
+
+	if (!ft_lib_ok && FT_Init_FreeType(&ft_lib)) return (NULL);
+	ft_lib_ok = TRUE;
+
+	/* Look for the face, and for the slot to replace */
+	for (i = 0; i < FT_FACES; i++)
+	{
+		fp = ft_faces + i;
+		if (!fp->face)
+		{
+			if (fl->face) fl = fp;
+			continue;
+		}
+		if ((fp->face_index == face_index) && (fp->size == size) &&
+			(fp->dpi == dpi) && !strcmp(fp->filename, filename))
+		{
+			fp->used = ++ft_stamp;
+			return (fp);
+		}
+		if (fl->face && (fp->used < fl->used)) fl = fp;
+	}
+
+	/* Close the least recently used face */
+	if (fl->face)
+	{
+		if (glyph_face == fl->face) ft_glyphs_clear();
+		FT_Done_Face(fl->face);
+		free(fl->filename);
+		memset(fl, 0, sizeof(ftface));
+	}
+
+	if (FT_New_Face(ft_lib, filename, face_index, &face)) return (NULL);
+	fp = fl;
+	if ((fp->scalable = FT_IS_SCALABLE(face)))
+	{
+		error = FT_Set_Char_Size(face, size, 0, dpi, 0);
+		fp->Y1 = FT_MulFix(face->ascender, face->size->metrics.y_scale);
+		fp->Y2 = FT_MulFix(face->descender, face->size->metrics.y_scale);
+	}
+	else
+	{
+/* !!! Linux .pcf fonts require requested height to match ppem rounded up;
+ * Windows .fon fonts, conversely, require width & height. So we try both - WJ */
+		fix_w = face->available_sizes[0].width;
+		fix_h = face->available_sizes[0].height;
+		error = FT_Set_Pixel_Sizes(face, fix_w, fix_h);
+		if (error)
+		{
+			fix_w = (face->available_sizes[0].x_ppem + 32) >> 6;
+			fix_h = (face->available_sizes[0].y_ppem + 32) >> 6;
+			error = FT_Set_Pixel_Sizes(face, fix_w, fix_h);
+		}
+// !!! FNT fonts have special support in FreeType - maybe use it?
+		fp->Y1 = face->size->metrics.ascender;
+		fp->Y2 = face->size->metrics.descender;
+	}
+	if (error || !(fp->filename = strdup(filename)))
+	{
+		FT_Done_Face(face);
+		return (NULL);
+	}
+
+	/* !!! To handle non-Unicode fonts properly, is just too costly;
+	 * instead we map 'em to ISO 8859-1 and hope for the best - WJ */
+	if (FT_Select_Charmap(face, FT_ENCODING_UNICODE))
+		FT_Set_Charmap(face, face->charmaps[0]); // Fallback
+
+	fp->face = face;
+	fp->face_index = face_index;
+	fp->size = size;
+	fp->dpi = dpi;
+	fp->used = ++ft_stamp;
+	return (fp);
+}
+
+/* Get rendered glyph for the pen position, from cache if possible */
+static ftglyph *ft_get_glyph(ftface *fp, FT_UInt index, FT_Vector *pen,
+	FT_Matrix *matrix, FT_Int32 load_flags)
+{
+	static ftglyph tmp;
+	ftglyph *g;
+	FT_GlyphSlot slot;
+	FT_Vector delta;
+	int h, l, fx = 0, fy = 0;
+
+	/* Glyphs for another face or transform are of no use */
+	if ((glyph_face != fp->face) || (glyph_flags != load_flags) ||
+		memcmp(&glyph_matrix, matrix, sizeof(FT_Matrix)) ||
+		(glyph_bytes > FT_GLYPH_MAX))
+	{
+		ft_glyphs_clear();
+		glyph_face = fp->face;
+		glyph_flags = load_flags;
+		glyph_matrix = *matrix;
+	}
+
+	if (fp->scalable) fx = pen->x & 63 , fy = pen->y & 63;
+	h = (index * 4099 + fx * 64 + fy) & (FT_GLYPH_HASH - 1);
+	for (g = glyph_hash[h]; g; g = g->next)
+	{
+		if ((g->index == index) && (g->fx == fx) && (g->fy == fy))
+			return (g->ok ? g : NULL);
+	}
+
+	if (fp->scalable)	// Cannot rotate fixed fonts
+	{
+		delta.x = fx;
+		delta.y = fy;
+		FT_Set_Transform(fp->face, matrix, &delta);
+	}
+	l = FT_Load_Glyph(fp->face, index, load_flags);
+	slot = fp->face->glyph;
+
+	/* Add new node, or use a temporary one if no memory */
+	g = &tmp;
+	if (!glyph_mem) glyph_mem = wjmemnew(0, 0);
+	if (glyph_mem && (g = wjmalloc(glyph_mem, sizeof(ftglyph),
+		ALIGNOF(ftglyph))))
+	{
+		g->next = glyph_hash[h];
+		glyph_hash[h] = g;
+		glyph_bytes += sizeof(ftglyph);
+	}
+	else g = &tmp;
+	g->index = index;
+	g->fx = fx;
+	g->fy = fy;
+	if (!(g->ok = !l)) return (NULL);
+
+	g->left = slot->bitmap_left;
+	g->top = slot->bitmap_top;
+	g->bitmap = slot->bitmap;
+	g->advance = slot->advance;
+	g->metrics = slot->metrics;
+	l = g->bitmap.rows * abs(g->bitmap.pitch);
+	if (l && (g != &tmp))
+	{
+		unsigned char *buf = wjmalloc(glyph_mem, l, 1);
+		if (buf)
+		{
+			g->bitmap.buffer = memcpy(buf, g->bitmap.buffer, l);
+			glyph_bytes += l;
+		}
+		else /* Use it from the slot this once, and forget */
+		{
+			glyph_hash[h] = g->next;
+			tmp = *g;
+			g = &tmp;
+		}
+	}
+	return (g);
+}
+
 static inline void extend(int *rxy, int x0, int y0, int x1, int y1)
 {
 	if (x0 < rxy[0]) rxy[0] = x0;
@@ -222,18 +432,17 @@ static unsigned char *mt_text_render(
 #endif
 	char		*txtp2;
 	double		ca, sa, angle_r = angle / 180 * M_PI;
-	int		bx, by, bw, bh, bits, ppb, fix_w, fix_h, scalable;
+	int		bx, by, bw, bh, bits, ppb, scalable;
 	int		Y1, Y2, X1, X2, ll, line, xflag;
 	int		pass, lines = 0, *lw = NULL;
 	int		dpi = ft_setdpi ? font_dpi : sys_dpi;
 	int		minxy[4] = { MAX_WIDTH, MAX_HEIGHT, -MAX_WIDTH, -MAX_HEIGHT };
 	size_t		s, ssize1 = characters, ssize2 = characters * 4 + 5;
 	iconv_t		cd;
-	FT_Library	library;
-	FT_Face		face;
+	ftface		*fp;
+	ftglyph		*glyph, *last, lastg;
 	FT_Matrix	matrix;
 	FT_Vector	pen, uninit_(pen0);
-	FT_Error	error;
 	FT_UInt		glyph_index;
 	FT_Int32	unichar, *txt2, *tmp2;
 	FT_Int32	load_flags = FT_LOAD_RENDER | FT_LOAD_FORCE_AUTOHINT;
@@ -244,34 +453,18 @@ static unsigned char *mt_text_render(
 
 	if (characters < 1) return NULL;
 
-	error = FT_Init_FreeType( &library );
-	if (error) return NULL;
+	fp = ft_get_face(filename, face_index, size * 64, dpi);
+	if (!fp) return NULL;
 
-	error = FT_New_Face( library, filename, face_index, &face );
-	if (error) goto fail2;
-
-	scalable = FT_IS_SCALABLE(face);
+	scalable = fp->scalable;
+	Y1 = fp->Y1;
+	Y2 = fp->Y2;
 
 	if (!scalable)
 	{
 		ca = 1.0; sa = 0.0; // Transform, if any, is for later
-
-/* !!! Linux .pcf fonts require requested height to match ppem rounded up;
- * Windows .fon fonts, conversely, require width & height. So we try both - WJ */
-		fix_w = face->available_sizes[0].width;
-		fix_h = face->available_sizes[0].height;
-		error = FT_Set_Pixel_Sizes(face, fix_w, fix_h);
-		if (error)
-		{
-			fix_w = (face->available_sizes[0].x_ppem + 32) >> 6;
-			fix_h = (face->available_sizes[0].y_ppem + 32) >> 6;
-			error = FT_Set_Pixel_Sizes(face, fix_w, fix_h);
-		}
-		if (error) goto fail1;
-
-// !!! FNT fonts have special support in FreeType - maybe use it?
-		Y1 = face->size->metrics.ascender;
-		Y2 = face->size->metrics.descender;
+		matrix.yy = matrix.xx = 0x10000L;
+		matrix.xy = matrix.yx = 0;
 	}
 	else
 	{
@@ -287,25 +480,14 @@ static unsigned char *mt_text_render(
 			matrix.yy = (FT_Fixed)((0.25 * sa + ca) * 0x10000L);
 			load_flags |= FT_LOAD_NO_BITMAP;
 		}
-
-		error = FT_Set_Char_Size(face, size * 64, 0, dpi, 0);
-		if (error) goto fail1;
-
-		Y1 = FT_MulFix(face->ascender, face->size->metrics.y_scale);
-		Y2 = FT_MulFix(face->descender, face->size->metrics.y_scale);
 	}
 
 	txt2 = calloc(1, ssize2 + 4);
-	if (!txt2) goto fail1;
+	if (!txt2) return NULL;
 
 	txtp1 = text;
 	txtp2 = (char *)txt2;
 
-	/* !!! To handle non-Unicode fonts properly, is just too costly;
-	 * instead we map 'em to ISO 8859-1 and hope for the best - WJ */
-	if (FT_Select_Charmap(face, FT_ENCODING_UNICODE))
-		FT_Set_Charmap(face, face->charmaps[0]); // Fallback
-
 	/* Convert input string to UTF-32, using native byte order */
 #if G_BYTE_ORDER == G_LITTLE_ENDIAN
 	cd = iconv_open("UTF-32LE", encoding);
@@ -335,6 +517,7 @@ static unsigned char *mt_text_render(
 		pen.x = pen.y = 0;
 		ll = 0;
 		line = -1;
+		last = NULL;
 
 		for (tmp2 = txt2 , unichar = 0x0A; unichar; unichar = *tmp2++)
 		{
@@ -343,12 +526,12 @@ static unsigned char *mt_text_render(
 				line++;
 				if (pass < 0) continue;
 				// Remember right boundary
-				if (ll && face->glyph)
+				if (ll && last)
 				{
-					int tx = pen.x - pen0.x - face->glyph->advance.x;
-					int ty = pen.y - pen0.y - face->glyph->advance.y;
-					int tdx = face->glyph->metrics.horiBearingX +
-						face->glyph->metrics.width - 64;
+					int tx = pen.x - pen0.x - last->advance.x;
+					int ty = pen.y - pen0.y - last->advance.y;
+					int tdx = last->metrics.horiBearingX +
+						last->metrics.width - 64;
 					/* Project pen offset onto rotated X axis */
 					tdx += tx * ca + ty * sa;
 					if (tdx > X2) X2 = tdx;
@@ -365,31 +548,33 @@ static unsigned char *mt_text_render(
 				continue;
 			}
 
-			glyph_index = FT_Get_Char_Index(face, unichar);
+			glyph_index = FT_Get_Char_Index(fp->face, unichar);
 
-			if (scalable)	// Cannot rotate fixed fonts
-				FT_Set_Transform(face, &matrix, &pen);
-
-			error = FT_Load_Glyph( face, glyph_index, load_flags );
-			if ( error ) continue;
+			glyph = ft_get_glyph(fp, glyph_index, &pen, &matrix,
+				load_flags);
+			if (!glyph) continue;
+			/* Keep a copy, as the cache can get cleared, and the
+			 * temporary glyph reused, before the line ends */
+			lastg = *glyph;
+			last = &lastg;
 
 			if (pass < 0) // Calculating line widths
 			{
-				lw[line] += face->glyph->metrics.horiAdvance;
+				lw[line] += glyph->metrics.horiAdvance;
 				continue;
 			}
 
 			// Remember left boundary
 			if (!ll++)
 			{
-				int tx = face->glyph->metrics.horiBearingX;
+				int tx = glyph->metrics.horiBearingX;
 				if (lw) tx += lw[line];
 				if (!xflag++) X1 = X2 = tx; // First glyph
 				if (tx < X1) X1 = tx;
 				pen0 = pen;
 			}
 
-			switch (face->glyph->bitmap.pixel_mode)
+			switch (glyph->bitmap.pixel_mode)
 			{
 				case FT_PIXEL_MODE_GRAY:	ppb = 1; break;
 				case FT_PIXEL_MODE_GRAY2:	ppb = 2; break;
@@ -398,27 +583,23 @@ static unsigned char *mt_text_render(
 				default: continue; // Unsupported mode
 			}
 
-			bx = face->glyph->bitmap_left;
-			by = -face->glyph->bitmap_top;
-			bw = face->glyph->bitmap.width;
-			bh = face->glyph->bitmap.rows;
+			/* Glyph got rendered at subpixel offset - add the rest;
+			 * bitmap glyphs don't get offset by FreeType at all */
+			bx = glyph->left + (pen.x >> 6);
+			by = -glyph->top - (pen.y >> 6);
+			bw = glyph->bitmap.width;
+			bh = glyph->bitmap.rows;
 			bits = bw && bh;
 
-			// Bitmap glyphs don't get offset by FreeType
-			if (!scalable || (bits && !face->glyph->outline.n_points))
-			{
-				bx += pen.x >> 6;
-				by -= pen.y >> 6;
-			}
-			pen.x += face->glyph->advance.x;
-			pen.y += face->glyph->advance.y;
+			pen.x += glyph->advance.x;
+			pen.y += glyph->advance.y;
 
 			// Remember bitmap bounds
 			if (!mem && bits)
 				extend(minxy, bx, by, bx + bw - 1, by + bh - 1);
 
 			// Draw bitmap onto clipboard memory in pass 1
-			if (mem) ft_draw_bitmap(mem, *width, &face->glyph->bitmap,
+			if (mem) ft_draw_bitmap(mem, *width, &glyph->bitmap,
 				bx - minxy[0], by - minxy[1], ppb);
 		}
 
@@ -518,13 +699,18 @@ static unsigned char *mt_text_render(
 			{
 //printf("old = %i,%i  new = %i,%i\n", ow, oh, nw, nh);
 
-				mem_rotate_free_real(old_img, new_img, ow, oh,
-					nw, nh, 1, -angle, smooth, FALSE, FALSE, TRUE);
-
-				mem = new_img[ch];
-				*width = nw;
-				*height = nh;
-				free( old_img[ch] );
+				if ( !mem_rotate_free_real(old_img, new_img, ow, oh,
+					nw, nh, 1, -angle, smooth, FALSE, FALSE, TRUE) )
+				{
+					mem = new_img[ch];
+					*width = nw;
+					*height = nh;
+					free( old_img[ch] );	// Rotation succeeded
+				}
+				else
+				{
+					free( new_img[ch] );	// Rotation failed
+				}
 			}
 		}
 	}
@@ -532,10 +718,6 @@ static unsigned char *mt_text_render(
 
 fail0:
 	free(txt2);
-fail1:
-	FT_Done_Face(face);
-fail2:
-	FT_Done_FreeType(library);
 
 	return mem;
 }
@@ -574,99 +756,394 @@ struct statchain {
 	struct stat buf;
 };
 
-static void font_dir_search(FT_Library *ft_lib, int dirnum, FILE *fp, char *dir,
-	statchain *cc)
-{	// Search given directory for font files - recursively traverse directories
-	statchain	sc = { cc };
-	FT_Face		face;
-	DIR		*dp;
-	struct dirent	*ep;
-	char		full_name[PATHBUF], tmp[2][MAXLEN];
-	int		face_index;
+/* After the font records, the index lists all directories it was built from,
+ * in lines which start with an empty field, so that the loader stops there:
+ *	\tD\t<mtime>\t<path>		Directory
+ *	\tF\t<mtime>:<size>\t<path>	File in the directory
+ *	\tS\t\t<path>			Subdirectory of the directory
+ * On rebuild, a directory whose mtime is unchanged isn't read again, and a file
+ * whose mtime and size are unchanged keeps its records without being opened */
+
+typedef struct fontface fontface;
+struct fontface {
+	fontface *next;
+	char *family, *style;
+	int size;
+};
+
+typedef struct {
+	char *name;		// Full path
+	char *sig;		// Modification time (and size)
+	fontface *faces;	// Fonts found in file
+	int type;		// 'D', 'F' or 'S'
+	int dirnum;		// Which of the top directories it is in
+	int probe;		// 1 = needs opening, 2 = failed to open
+	int next;		// Hash chain
+} fontrec;
+
+#define FREC_HASH 16384	/* Power of 2 */
+
+typedef struct {
+	wjmem *mem;
+	char *text;		// Old index
+	fontrec *recs, *old;	// New and old listings
+	int nrecs, maxrecs, nold;
+	int fail;		// Listing is incomplete
+	int hash[FREC_HASH];	// Old listing's hash
+} fontscan;
+
+typedef struct {
+	fontrec *recs;
+	int *idx;		// Files to open
+	wjmem *mem;
+	FT_Library lib;
+	int lib_ok;
+} fontprobe;
+
+static char *fmem_strdup(wjmem *mem, char *s)
+{
+	int l = strlen(s) + 1;
+	char *res = wjmalloc(mem, l, 1);
 
+	if (res) memcpy(res, s, l);
+	return (res);
+}
 
-	dp = opendir(dir);
-	if (!dp) return;
+/* "One at a time" hash function */
+static int font_rec_hash(char *name)
+{
+	guint32 seed = 0x811C9DC5;
 
-	while ( (ep = readdir(dp)) )
+	for (; *name; name++)
 	{
-		file_in_dir(full_name, dir, ep->d_name, PATHBUF);
+		seed += (unsigned char)*name;
+		seed += seed << 10;
+		seed ^= seed >> 6;
+	}
+	seed += seed << 3;
+	seed ^= seed >> 11;
+	seed += seed << 15;
+	return (seed & (FREC_HASH - 1));
+}
 
-		if (stat(full_name, &sc.buf) < 0) continue;	// Get file details
+static int font_rec_find(fontscan *fs, char *name, int type)
+{
+	fontrec *rec;
+	int i;
+
+	for (i = fs->hash[font_rec_hash(name)]; i >= 0; i = rec->next)
+	{
+		rec = fs->old + i;
+		if ((rec->type == type) && !strcmp(rec->name, name)) break;
+	}
+	return (i);
+}
+
+static int font_rec_add(fontscan *fs, int type, char *name, char *sig,
+	int dirnum)
+{
+	fontrec *rec;
+	int n = fs->nrecs;
 
+	if (n >= fs->maxrecs)
+	{
+		int m = fs->maxrecs ? fs->maxrecs * 2 : 1024;
+
+		rec = realloc(fs->recs, m * sizeof(fontrec));
+		if (!rec) goto fail;
+		fs->recs = rec;
+		fs->maxrecs = m;
+	}
+	rec = fs->recs + n;
+	memset(rec, 0, sizeof(fontrec));
+	rec->type = type;
+	rec->dirnum = dirnum;
+	if (!(rec->name = fmem_strdup(fs->mem, name)) ||
+		!(rec->sig = fmem_strdup(fs->mem, sig))) goto fail;
+	return (fs->nrecs++);
+fail:	fs->fail = TRUE;
+	return (-1);
+}
+
+static void font_sig(char *buf, struct stat *st, int file)
+{
 #ifdef WIN32
-		if (S_ISDIR(sc.buf.st_mode))
+	snprintf(buf, 64, file ? "%I64u:%I64u" : "%I64u",
 #else
-		if ((ep->d_type == DT_DIR) || S_ISDIR(sc.buf.st_mode))
+	snprintf(buf, 64, file ? "%llu:%llu" : "%llu",
 #endif
-		{	// Subdirectory so recurse
+		(unsigned long long)st->st_mtime, (unsigned long long)st->st_size);
+}
+
+static char *index_line(char *buf, char **slots, int n)
+{
+	char *tmp = buf + strcspn(buf, "\r\n");
+	int i;
+
+	if (*tmp) *tmp++ = 0;
+	for (i = 0; i < n; i++)
+	{
+		slots[i] = buf;
+		buf += strcspn(buf, "\t");
+		if (*buf) *buf++ = 0;
+	}
+	return (tmp + strspn(tmp, "\r\n"));
+}
+
+static void font_index_old(fontscan *fs, char *filename)
+{
+	char *buf, *tmp, *list, *slots[SLOT_TOT];
+	fontrec *rec;
+	fontface *ff, **tail;
+	int i, n;
+
+
+	memset(fs->hash, -1, sizeof(fs->hash));
+	if (!(fs->text = slurp_file(filename, 1))) return;
+
+	/* Find the listing */
+	list = NULL;
+	for (n = 0 , buf = fs->text + 1; *buf; buf = tmp)
+	{
+		tmp = buf + strcspn(buf, "\n");
+		tmp += !!*tmp;
+		if (*buf != '\t') continue;
+		if (!list) list = buf;
+		n++;
+	}
+	if (!n || !(fs->old = calloc(n, sizeof(fontrec)))) return;
+
+	/* Hash the listing */
+	for (buf = list; *buf && (fs->nold < n); )
+	{
+		buf = index_line(buf, slots, 4);
+		rec = fs->old + fs->nold;
+		rec->type = slots[1][0];
+		rec->sig = slots[2];
+		rec->name = slots[3];
+		i = font_rec_hash(rec->name);
+		rec->next = fs->hash[i];
+		fs->hash[i] = fs->nold++;
+	}
+
+	/* Attach font records to files */
+	list[-1] = 0; // Cut off the listing
+	for (buf = fs->text + 1; *buf; )
+	{
+		buf = index_line(buf, slots, SLOT_TOT);
+		i = font_rec_find(fs, slots[SLOT_FILENAME], 'F');
+		if (i < 0) continue;
+		/* Same file may be listed under several top directories */
+		rec = fs->old + i;
+		n = strtol(slots[SLOT_DIR], NULL, 10);
+		if (!rec->faces) rec->dirnum = n;
+		else if (rec->dirnum != n) continue;
+		ff = wjmalloc(fs->mem, sizeof(fontface), ALIGNOF(fontface));
+		if (!ff) break;
+		ff->family = slots[SLOT_FONT];
+		ff->style = slots[SLOT_STYLE];
+		ff->size = strtol(slots[SLOT_SIZE], NULL, 10);
+		for (tail = &rec->faces; *tail; tail = &(*tail)->next);
+		*tail = ff;
+	}
+}
+
+static void font_file_add(fontscan *fs, int type, char *name, int dirnum)
+{
+	struct stat buf;
+	char sig[64];
+	int i, j;
+
+	if (type != 'S')
+	{
+		if (stat(name, &buf) < 0) return;	// Get file details
+		if (S_ISDIR(buf.st_mode)) type = 'S';
+	}
+	if (type == 'S')
+	{
+		font_rec_add(fs, 'S', name, "", dirnum);
+		return;
+	}
+	font_sig(sig, &buf, TRUE);
+	if ((i = font_rec_add(fs, 'F', name, sig, dirnum)) < 0) return;
+	j = font_rec_find(fs, name, 'F');
+	if ((j >= 0) && !strcmp(fs->old[j].sig, sig))
+		fs->recs[i].faces = fs->old[j].faces;
+	else fs->recs[i].probe = 1;
+}
+
+static void font_dir_scan(fontscan *fs, int dirnum, char *dir, statchain *cc)
+{	// List given directory, then recursively traverse subdirectories
+	statchain	sc = { cc };
+	DIR		*dp;
+	struct dirent	*ep;
+	char		full_name[PATHBUF], sig[64];
+	int		i, n, d;
+
+
+	if (stat(dir, &sc.buf) < 0) return;
+	/* If no inode number, assume it's Windows and just hope
+	 * for the best: symlink loops do exist in Windows 7+, but
+	 * I know of no simple approach for avoiding them - WJ */
+	if (sc.buf.st_ino)
+	{
+		for (; cc; cc = cc->p)
+		if ((sc.buf.st_dev == cc->buf.st_dev) &&
+			(sc.buf.st_ino == cc->buf.st_ino)) return; // Directory loop
+	}
+
+	font_sig(sig, &sc.buf, FALSE);
+	if ((d = font_rec_add(fs, 'D', dir, sig, dirnum)) < 0) return;
+	i = font_rec_find(fs, dir, 'D');
+	if ((i >= 0) && !strcmp(fs->old[i].sig, sig))
+	{	// Unchanged directory - reuse its list
+		while ((++i < fs->nold) && (fs->old[i].type != 'D'))
+			font_file_add(fs, fs->old[i].type, fs->old[i].name, dirnum);
+	}
+	else if ((dp = opendir(dir)))
+	{
+		while ((ep = readdir(dp)))
+		{
 			if (!strcmp(ep->d_name, ".") || !strcmp(ep->d_name, ".."))
 				continue;
-			/* If no inode number, assume it's Windows and just hope
-			 * for the best: symlink loops do exist in Windows 7+, but
-			 * I know of no simple approach for avoiding them - WJ */
-			if (sc.buf.st_ino)
-			{
-				for (cc = sc.p; cc; cc = cc->p)
-				if ((sc.buf.st_dev == cc->buf.st_dev) &&
-					(sc.buf.st_ino == cc->buf.st_ino)) break;
-				if (cc) continue; // Directory loop
-			}
-			font_dir_search( ft_lib, dirnum, fp, full_name, &sc );
-			continue;
+			file_in_dir(full_name, dir, ep->d_name, PATHBUF);
+#ifdef WIN32
+			font_file_add(fs, 0, full_name, dirnum);
+#else
+			font_file_add(fs, ep->d_type == DT_DIR ? 'S' : 0,
+				full_name, dirnum);
+#endif
 		}
-		// File so see if its a font
-		for (	face_index = 0;
-			!FT_New_Face( *ft_lib, full_name, face_index, &face );
-			face_index++ )
-		{
-			int size_type = 0;
+		closedir(dp);
+	}
+	else fs->fail = TRUE;
+
+	/* Subdirectories go after the list, to keep it in one piece */
+	for (i = d + 1 , n = fs->nrecs; i < n; i++)
+	{
+		if (fs->recs[i].type == 'S')
+			font_dir_scan(fs, dirnum, fs->recs[i].name, &sc);
+	}
+}
+
+static int font_probe(FT_Library lib, wjmem *mem, fontrec *rec)
+{	// See if file is a font, and list the faces in it
+	FT_Face		face;
+	fontface	*ff, **tail = &rec->faces;
+	char		tmp[2][MAXLEN];
+	int		face_index, n;
+
+
+	for (	face_index = 0;
+		!FT_New_Face( lib, rec->name, face_index, &face );
+		face_index++ )
+	{
+		int size_type = 0;
 
-			if (!FT_IS_SCALABLE(face)) size_type =
-				face->available_sizes[0].height +
-				(face->available_sizes[0].width << SIZE_SHIFT) +
-				(face_index << (SIZE_SHIFT * 2));
+		if (!FT_IS_SCALABLE(face)) size_type =
+			face->available_sizes[0].height +
+			(face->available_sizes[0].width << SIZE_SHIFT) +
+			(face_index << (SIZE_SHIFT * 2));
 
 // I use a tab character as a field delimeter, so replace any in the strings with a space
 
-			trim_tab( tmp[0], face->family_name );
-			trim_tab( tmp[1], face->style_name );
+		trim_tab( tmp[0], face->family_name );
+		trim_tab( tmp[1], face->style_name );
+		n = face->num_faces;
+		FT_Done_Face(face);
 
-			fprintf(fp, "%s\t%i\t%s\t%i\t%s\n",
-				tmp[0], dirnum, tmp[1], size_type, full_name);
+		ff = wjmalloc(mem, sizeof(fontface), ALIGNOF(fontface));
+		if (!ff || !(ff->family = fmem_strdup(mem, tmp[0])) ||
+			!(ff->style = fmem_strdup(mem, tmp[1]))) return (FALSE);
+		ff->size = size_type;
+		*tail = ff;
+		tail = &ff->next;
 
-			if ( (face_index+1) >= face->num_faces )
-			{
-				FT_Done_Face(face);
-				break;
-			}
-			FT_Done_Face(face);
-		}
+		if ( (face_index+1) >= n ) break;
+	}
+	return (TRUE);
+}
+
+static void do_font_probe(tcb *thread)
+{
+	fontprobe *fp = thread->data;
+	fontrec *rec;
+	int i, n = thread->step0 + thread->nsteps;
+
+	/* Each thread needs its own library instance */
+	if (!fp->lib_ok) fp->lib_ok = FT_Init_FreeType(&fp->lib) ? -1 : 1;
+	if (!fp->mem) fp->mem = wjmemnew(0, 0);
+	for (i = thread->step0; i < n; i++)
+	{
+		rec = fp->recs + fp->idx[i];
+		rec->probe = (fp->lib_ok > 0) && fp->mem &&
+			font_probe(fp->lib, fp->mem, rec) ? 0 : 2;
 	}
-	closedir(dp);
 }
 
 static void font_index_create(char *filename, char **dir_in)
 {	// dir_in points to NULL terminated sequence of directories to search for fonts
-	statchain	sc = { NULL };
-	FT_Library	library;
-	int		i;
-	FILE		*fp;
-
-
-	if (FT_Init_FreeType(&library)) return;
+	fontscan	fs;
+	fontprobe	fp, *tp;
+	threaddata	*tdata = NULL;
+	fontrec		*rec;
+	fontface	*ff;
+	FILE		*f;
+	int		i, n;
+
+
+	memset(&fs, 0, sizeof(fs));
+	if (!(fs.mem = wjmemnew(0, 0))) return;
+	font_index_old(&fs, filename);
+	for (i = 0; dir_in[i]; i++) font_dir_scan(&fs, i, dir_in[i], NULL);
+
+	/* Open new and changed files in parallel */
+	memset(&fp, 0, sizeof(fp));
+	for (i = n = 0; i < fs.nrecs; i++) n += fs.recs[i].probe;
+	if (n && (fp.idx = malloc(n * sizeof(int))))
+	{
+		for (i = n = 0; i < fs.nrecs; i++)
+			if (fs.recs[i].probe) fp.idx[n++] = i;
+		fp.recs = fs.recs;
+		if ((tdata = talloc(0, n, &fp, sizeof(fp), NULL, NULL)))
+		{
+			/* Some files take far longer to open than others */
+			tdata->chunks = THREAD_STEAL;
+			launch_threads(do_font_probe, tdata, NULL, n);
+		}
+	}
 
-	if ((fp = fopen(filename, "w")))
+	if ((f = fopen(filename, "w")))
 	{
-		for (i = 0; dir_in[i]; i++)
+		for (i = n = 0; i < fs.nrecs; i++)
+		{
+			rec = fs.recs + i;
+			n |= rec->probe;
+			for (ff = rec->faces; ff; ff = ff->next)
+				fprintf(f, "%s\t%i\t%s\t%i\t%s\n", ff->family,
+					rec->dirnum, ff->style, ff->size, rec->name);
+		}
+		/* Incomplete list would make next rebuild miss things */
+		if (!n && !fs.fail) for (i = 0; i < fs.nrecs; i++)
 		{
-			if (stat(dir_in[i], &sc.buf) < 0) continue;
-			font_dir_search(&library, i, fp, dir_in[i], &sc);
+			rec = fs.recs + i;
+			fprintf(f, "\t%c\t%s\t%s\n", rec->type, rec->sig, rec->name);
 		}
-		fclose(fp);
+		fclose(f);
 	}
 
-	FT_Done_FreeType(library);
+	for (i = 0; tdata && (i < tdata->count); i++)
+	{
+		tp = tdata->threads[i]->data;
+		if (tp->lib_ok > 0) FT_Done_FreeType(tp->lib);
+		wjmemfree(tp->mem);
+	}
+	free(tdata);
+	free(fp.idx);
+	free(fs.recs);
+	free(fs.old);
+	free(fs.text);
+	wjmemfree(fs.mem);
 }
 
 
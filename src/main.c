@@ -33,6 +33,7 @@
 #include "prefs.h"
 #include "csel.h"
 #include "spawn.h"
+#include "thread.h"
 
 #ifndef WIN32
 #include <glob.h>
@@ -250,11 +251,123 @@ mfail:		globfree(pglob);
 
 #endif
 
+/* Substitute per-file fields into a batch script argument:
+ * %f - full name, %d - directory ("." if none), %n - name w/o extension,
+ * %e - extension, %i - file number, %% - literal "%" */
+static char *batch_expand(char *arg, char *fname, int idx)
+{
+	char *s, *d, *b, *x, *sub, *res, buf[32];
+	int l, ls;
+
+	if (!strchr(arg, '%')) return (arg);
+	b = strrchr(fname, DIR_SEP);
+	b = b ? b + 1 : fname;
+	x = strrchr(b, '.');
+	if (!x || (x == b)) x = b + strlen(b);
+	sprintf(buf, "%d", idx);
+
+	/* Measure, then fill */
+	for (res = NULL; TRUE; )
+	{
+		for (s = arg , d = res , l = 0; *s; s++)
+		{
+			sub = NULL;
+			if ((*s == '%') && s[1])
+			{
+				s++;
+				if (*s == 'f') sub = fname , ls = strlen(fname);
+				else if (*s == 'd') // "." if no dir part
+				{
+					sub = b > fname ? fname : ".";
+					ls = b > fname ? b - fname - 1 : 1;
+				}
+				else if (*s == 'n') sub = b , ls = x - b;
+				else if (*s == 'e') sub = x + (*x == '.') , ls = strlen(sub);
+				else if (*s == 'i') sub = buf , ls = strlen(buf);
+				else if (*s != '%') s--; // Not a field - leave as is
+			}
+			if (!sub) sub = s , ls = 1;
+			if (d) memcpy(d, sub, ls) , d += ls;
+			l += ls;
+		}
+		if (d)
+		{
+			*d = '\0';
+			return (res);
+		}
+		res = malloc(l + 1);
+		if (!res) return (arg); // Better unexpanded than nothing
+	}
+}
+
+/* Read next filename from stdin, one per line */
+static char *batch_stdin(char *buf)
+{
+	char *tmp;
+
+	while (fgets(buf, PATHBUF, stdin))
+	{
+		if ((tmp = strchr(buf, '\n'))) *tmp = '\0';
+		if ((tmp = strchr(buf, '\r'))) *tmp = '\0';
+		if (buf[0]) return (buf);
+	}
+	return (NULL);
+}
+
+/* Apply the script to each file in turn, in this same process; the image
+ * and undo stack get reused, as loading without undo just replaces them */
+static int batch_run(char **script)
+{
+	GTimer *timer;
+	char **cmds, *fname, buf[PATHBUF];
+	double t, total = 0.0;
+	int i, n, res, nf = 0, fails = 0, from_stdin;
+
+
+	for (n = 0; script[n] && strcmp(script[n], "--"); n++);
+	cmds = calloc(n + 1, sizeof(char *));
+	if (!cmds) return (1);
+
+	from_stdin = (files_passed == 1) && !strcmp(file_args[0], "-");
+	timer = g_timer_new();
+	while (TRUE)
+	{
+		if (from_stdin) fname = batch_stdin(buf);
+		else fname = nf < files_passed ? file_args[nf] : NULL;
+		if (!fname) break;
+		nf++;
+
+		g_timer_start(timer);
+		script_cmds = script; // Load as if from script: no dialogs
+		res = !do_a_load(fname, FALSE);
+		script_cmds = NULL;
+		if (res)
+		{
+			for (i = 0; i < n; i++)
+				cmds[i] = batch_expand(script[i], fname, nf);
+			res = run_script(cmds) > 0;
+			for (i = 0; i < n; i++)
+				if (cmds[i] != script[i]) free(cmds[i]);
+		}
+		fails += !res;
+		t = g_timer_elapsed(timer, NULL);
+		total += t;
+		fprintf(stderr, "%s: %s, %.3f s\n", fname,
+			res ? "done" : "FAILED", t);
+		if (user_break) break;
+	}
+	g_timer_destroy(timer);
+	free(cmds);
+
+	fprintf(stderr, "%d file(s), %d failed, %.3f s total\n", nf, fails, total);
+	return (fails || user_break);
+}
 
 int main( int argc, char *argv[] )
 {
 	glob_t globdata;
 	int i, j, l, file_arg_start, new_empty = TRUE, get_screenshot = FALSE;
+	int batch = FALSE;
 
 	if (argc > 1)
 	{
@@ -271,13 +384,18 @@ int main( int argc, char *argv[] )
 				"  --help          Output this help\n"
 				"  --version       Output version information\n"
 				"  --cmd           Commandline scripting mode, no GUI\n"
+				"  --batch         Run the script on each file in turn;\n"
+				"                  \"-\" as the only file reads names from\n"
+				"                  stdin; %%f %%d %%n %%e %%i in the script\n"
+				"                  expand to file's name, dir, basename,\n"
+				"                  extension and number\n"
 				"  -s              Grab screenshot\n"
 				"  -v              Start in viewer mode\n"
 				"  --              End of options\n\n"
 			, MT_VERSION);
 			exit(0);
 		}
-		if (!strcmp(argv[1], "--cmd"))
+		if (!strcmp(argv[1], "--cmd") || (batch = !strcmp(argv[1], "--batch")))
 		{
 			cmd_mode = TRUE;
 			script_cmds = argv + 2;
@@ -412,6 +530,7 @@ int main( int argc, char *argv[] )
 	string_init();				// Translate static strings
 	var_init();				// Load INI variables
 	mem_init();				// Set up memory & back end
+	init_threads();				// Launch helper threads
 	layers_init();
 	init_cols();
 
@@ -428,7 +547,7 @@ int main( int argc, char *argv[] )
 		do_new_chores(FALSE);
 		notify_changed();
 	}
-	else
+	else if (!batch) // Batch mode loads files later
 	{
 		if ((files_passed > 0) && !do_a_load(file_args[0], FALSE))
 			new_empty = FALSE;
@@ -441,7 +560,9 @@ int main( int argc, char *argv[] )
 
 	update_menus();
 
-	if (cmd_mode) // Console
+	if (batch) // Console, many files
+		user_break = batch_run(script_cmds);
+	else if (cmd_mode) // Console
 		run_script(script_cmds);
 	else // GUI
 	{
@@ -109,6 +109,7 @@ static inilist ini_bool[] = {
 	{ "autopreviewToggle",	&brcosa_auto,		TRUE  },
 	{ "colorGrid",		&color_grid,		TRUE  },
 	{ "defaultGamma",	&use_gamma,		TRUE  },
+	{ "fastGauss",		&fast_gauss,		FALSE },
 	{ "undoableLoad",	&undo_load,		TRUE  },
 	{ "tiffPredictor",	&tiff_predictor,	TRUE  },
 #if STATUS_ITEMS != 5
@@ -149,8 +150,14 @@ static inilist ini_int[] = {
 	{ "gridMin",		&mem_grid_min,		8   },
 	{ "undoMBlimit",	&mem_undo_limit,	0   },
 	{ "undoCommon",		&mem_undo_common,	25  },
+	{ "bigChannelMB",	&mem_bigchan_mb,	512 },
+	{ "undoDiskMB",		&mem_undo_disk,		0   },
 	{ "maxThreads",		&maxthreads,		0   },
 	{ "kpixThreads",	&kpix_threads,		256 },
+	{ "threadStats",	&thread_stats,		0   },
+	{ "scaleSIMD",		&scale_simd,		SCALE_SIMD_OFF },
+	{ "scaleCheck",		&scale_check,		0   },
+	{ "scaleTolerance",	&scale_tolerance,	1   },
 	{ "backgroundGrey",	&mem_background,	180 },
 	{ "pixelNudge",		&mem_nudge,		8   },
 	{ "recentFiles",	&recent_files,		10  },
@@ -1905,9 +1912,10 @@ void render_row(renderstate *r, unsigned char *rgb, chanlist base_img,
 		alpha = xtra_img[CHN_ALPHA];
 	}
 	if (rr.cmask & CMASK_ALPHA) alpha = &beta; /* Ignore alpha if disabled */
-	if (!src) src = base_img[CHN_IMAGE] + (rr.mw * y + x) * rr.bpp;
-	if (!alpha) alpha = base_img[CHN_ALPHA] ? base_img[CHN_ALPHA] +
-		rr.mw * y + x : &beta;
+	if (!src) src = ROW_PTR(base_img[CHN_IMAGE], y, rr.mw, rr.bpp) +
+		x * rr.bpp;
+	if (!alpha) alpha = base_img[CHN_ALPHA] ?
+		ROW_PTR(base_img[CHN_ALPHA], y, rr.mw, 1) + x : &beta;
 	if (alpha != &beta) da = rr.zoom;
 	dest = rgb;
 	ii = rr.dx;
@@ -2277,6 +2285,8 @@ typedef struct {
 	int scale;		// Replication factor
 	int lop;		// Base opacity
 	int xpm;		// Transparent color
+	int ml;			// Mipmap level, 0 if none
+	unsigned char **mip;	// Mipmap level channels
 } main_render_state;
 
 typedef struct {
@@ -2413,7 +2423,7 @@ typedef struct {
 	main_render_state r;
 	paste_render_state p;
 	render_mem_req m;
-	int tflag, gflag, pflag, lr;
+	int tflag, gflag, pflag, lr, lc;
 	int pw;
 	int cxy[4];
 	unsigned char *rgb, *irgb;
@@ -2458,6 +2468,16 @@ static void main_render_req(u_render_state *u)
 	if (show_paste && (marq_status >= MARQUEE_PASTE) && !u->m.overlay_s &&
 		!u->gflag) u->pflag = paste_render_req(&u->m, &u->p, &r);
 
+	/* Plain RGB image zoomed out - draw it from a mipmap */
+	if ((r.zoom > 1) && (mem_img_bpp == 3) && (r.xpm < 0) && !u->tflag &&
+		!u->m.overlay_s && !u->gflag && !u->pflag &&
+		(r.ml = mip_level(r.zoom)))
+	{
+		r.mip = mip_get(&mem_image, r.ml, r.dx, r.rxy[1] * r.zoom,
+			r.dx + r.lx, (r.rxy[3] - 1) * r.zoom + 1);
+		if (!r.mip) r.ml = 0;
+	}
+
 	/* Pass the data */
 	u->r = r;
 }
@@ -2468,7 +2488,8 @@ static void main_render(u_render_state *u, int py, int ph)
 	grad_render_state grstate;
 	renderstate rs;
 	unsigned char *rgb, **tlist = r.tlist, *overlay = u->m.overlay;
-	int j, jj, j0, l, pw2, pw;
+	unsigned char **img = r.ml ? r.mip : mem_img;
+	int j, jj, j0, l, pw2, pw, ml = r.ml;
 
 	/* ****** Init phase ****** */
 
@@ -2491,7 +2512,8 @@ static void main_render(u_render_state *u, int py, int ph)
 
 	/* Start rendering */
 	pw2 = r.rxy[2] - r.rxy[0];
-	setup_row(&rs, r.rxy[0], pw2, r.zoom, r.scale, mem_width, r.xpm, r.lop,
+	setup_row(&rs, r.rxy[0], pw2, r.zoom >> ml, r.scale,
+		(mem_width + (1 << ml) - 1) >> ml, r.xpm, r.lop,
 		u->gflag && grstate.rgb ? 3 : mem_img_bpp, mem_pal);
 	rs.cmask = (hide_image ? CMASK_IMAGE : 0) |
 		(channel_dis[CHN_ALPHA] ? CMASK_ALPHA : 0) |
@@ -2548,8 +2570,9 @@ static void main_render(u_render_state *u, int py, int ph)
 			memcpy(rgb, rgb - pw, pw2);
 			continue;
 		}
-		render_row(&rs, rgb, mem_img, r.dx, j, tlist);
-		if (!overlay) overlay_row(&rs, rgb, mem_img, r.dx, j, tlist);
+		render_row(&rs, rgb, img, r.dx >> ml, j >> ml, tlist);
+		if (!overlay) overlay_row(&rs, rgb, img, r.dx >> ml, j >> ml,
+			tlist);
 		else overlay_preview(&rs, rgb, overlay, csel_preview, csel_preview_a);
 	}
 }
@@ -2977,6 +3000,268 @@ void prepare_line_clip(int *lxy, int *vxy, int scale)
 		lxy[i] = floor_div(vxy[i] - margin_main_xy[i & 1] - (i >> 1), scale);
 }
 
+/* Layers under and over the current one get composited once for the visible
+ * area, so that changes to the current layer do not redraw all the others */
+
+typedef struct {
+	unsigned char *img, *alpha;
+	int x, y, w, h, bpp, trans, opacity, visible;
+} lc_layer;
+
+typedef struct {
+	int zoom, scale, lr, lrt, bk, oa;
+	lc_layer l[MAX_LAYERS + 1];
+} lc_state;
+
+typedef struct {
+	int xy[4];		// Area, in canvas coordinates
+	int *span;		// Valid part of each row, as x0, x1
+	unsigned char *below;	// Layers under, over background
+	unsigned char *above0;	// Layers over, on black
+	unsigned char *above1;	// Layers over, on white
+	lc_state s;		// What it is valid for
+} layers_cache;
+
+static layers_cache lcache;
+
+static void lc_free(layers_cache *lc)
+{
+	free(lc->span);
+	free(lc->below);
+	memset(lc->xy, 0, sizeof(lc->xy));
+	lc->span = NULL;
+	lc->below = lc->above0 = lc->above1 = NULL;
+}
+
+static int lc_alloc(layers_cache *lc, int *xy)
+{
+	int w = xy[2] - xy[0], h = xy[3] - xy[1];
+
+	lc->span = calloc(h * 2, sizeof(int));
+	lc->below = malloc((size_t)w * h * 3 * 3);
+	if (!lc->span || !lc->below)
+	{
+		lc_free(lc);
+		return (FALSE);
+	}
+	lc->above0 = lc->below + (size_t)w * h * 3;
+	lc->above1 = lc->above0 + (size_t)w * h * 3;
+	copy4(lc->xy, xy);
+	return (TRUE);
+}
+
+/* Forget the composited layers, where they may have changed */
+void main_update_layers(int x, int y, int w, int h)
+{
+	layers_cache *lc = &lcache;
+	int y0 = lc->xy[1], y1 = lc->xy[3], zoom = lc->s.zoom, scale = lc->s.scale;
+
+	if (!lc->span) return;
+	if (w >= 0) // Not everything
+	{
+		if (y0 < floor_div(y * scale, zoom))
+			y0 = floor_div(y * scale, zoom);
+		if (y1 > floor_div((y + h) * scale + zoom - 1, zoom) + 1)
+			y1 = floor_div((y + h) * scale + zoom - 1, zoom) + 1;
+		if (y0 >= y1) return;
+	}
+	memset(lc->span + (y0 - lc->xy[1]) * 2, 0, (y1 - y0) * 2 * sizeof(int));
+}
+
+/* Make the cache fit current state & visible area; FALSE if cannot use it */
+static int lc_prepare(int *cxy, int zoom, int scale)
+{
+	layers_cache *lc = &lcache, old;
+	lc_state s;
+	lc_layer *l;
+	int i, y, w, h, ow, xyhv[4], vxy[4], rxy[4];
+
+	/* Visible area */
+	cmd_peekv(scrolledwindow_canvas, xyhv, sizeof(xyhv), CSCROLL_XYSIZE);
+	vxy[2] = (vxy[0] = xyhv[0] - margin_main_x) + xyhv[2];
+	vxy[3] = (vxy[1] = xyhv[1] - margin_main_y) + xyhv[3];
+	/* Drawing outside of it, for some reason */
+	if (!clip(rxy, vxy[0], vxy[1], vxy[2], vxy[3], cxy) ||
+		memcmp(rxy, cxy, sizeof(rxy))) return (FALSE);
+
+	/* What the layers are like */
+	memset(&s, 0, sizeof(s));
+	s.zoom = zoom; s.scale = scale;
+	s.lr = layer_selected; s.lrt = layers_total;
+	s.bk = mem_background; s.oa = overlay_alpha;
+	for (i = 0; i <= layers_total; i++)
+	{
+		layer_node *t = layer_table_p + i;
+		image_info *image = &t->image->image_;
+
+		l = s.l + i;
+		l->x = t->x; l->y = t->y;
+		if (i == layer_selected) continue; // Only position matters
+		l->img = image->img[CHN_IMAGE];
+		l->alpha = image->img[CHN_ALPHA];
+		l->w = image->width; l->h = image->height;
+		l->bpp = image->bpp; l->trans = image->trans;
+		l->opacity = t->opacity; l->visible = t->visible;
+	}
+	if (memcmp(&lc->s, &s, sizeof(s)))
+	{
+		lc->s = s;
+		main_update_layers(0, 0, -1, -1);
+	}
+
+	/* Same area - done */
+	if (!memcmp(lc->xy, vxy, sizeof(vxy))) return (!!lc->span);
+
+	/* Move over what is still visible */
+	old = *lc;
+	if (!lc_alloc(lc, vxy))
+	{
+		lc_free(&old);
+		return (FALSE);
+	}
+	if (old.span && clip(rxy, vxy[0], vxy[1], vxy[2], vxy[3], old.xy))
+	{
+		ow = old.xy[2] - old.xy[0];
+		w = vxy[2] - vxy[0];
+		for (y = rxy[1]; y < rxy[3]; y++)
+		{
+			int *os = old.span + (y - old.xy[1]) * 2;
+			int *ns = lc->span + (y - vxy[1]) * 2;
+			size_t o = ((y - old.xy[1]) * ow + rxy[0] - old.xy[0]) * 3;
+			size_t n = ((y - vxy[1]) * w + rxy[0] - vxy[0]) * 3;
+
+			ns[0] = os[0] < rxy[0] ? rxy[0] : os[0];
+			ns[1] = os[1] > rxy[2] ? rxy[2] : os[1];
+			if (ns[0] >= ns[1])
+			{
+				ns[0] = ns[1] = 0;
+				continue;
+			}
+			h = (rxy[2] - rxy[0]) * 3;
+			memcpy(lc->below + n, old.below + o, h);
+			memcpy(lc->above0 + n, old.above0 + o, h);
+			memcpy(lc->above1 + n, old.above1 + o, h);
+		}
+	}
+	lc_free(&old);
+	return (TRUE);
+}
+
+/* Composite layers under & over the current one into the cache */
+static void lc_render(int x0, int y0, int x1, int y1)
+{
+	layers_cache *lc = &lcache;
+	unsigned char *dest, *dest1;
+	int i, rxy[4], w = lc->xy[2] - lc->xy[0], l = (x1 - x0) * 3;
+	size_t ofs = ((y0 - lc->xy[1]) * w + x0 - lc->xy[0]) * 3;
+
+	rxy[0] = x0; rxy[1] = y0; rxy[2] = x1; rxy[3] = y1;
+	dest = lc->below + ofs;
+	for (i = y0; i < y1; i++ , dest += w * 3)
+		memset(dest, lc->s.bk, l);
+	render_layers(lc->below + ofs, rxy, w * 3, lc->s.zoom, lc->s.scale,
+		0, layer_selected - 1, FALSE);
+
+	if (layer_selected >= layers_total) return;
+	/* How layers above change black & white tells what they do to any
+	 * color under them */
+	dest = lc->above0 + ofs;
+	dest1 = lc->above1 + ofs;
+	for (i = y0; i < y1; i++ , dest += w * 3 , dest1 += w * 3)
+	{
+		memset(dest, 0, l);
+		memset(dest1, 255, l);
+	}
+	render_layers(lc->above0 + ofs, rxy, w * 3, lc->s.zoom, lc->s.scale,
+		layer_selected + 1, layers_total, FALSE);
+	render_layers(lc->above1 + ofs, rxy, w * 3, lc->s.zoom, lc->s.scale,
+		layer_selected + 1, layers_total, FALSE);
+}
+
+/* Render layers under the current one from the cache, updating it if needed */
+static void lc_below(unsigned char *rgb, int *cxy, int pw)
+{
+	layers_cache *lc = &lcache;
+	int *span, x0, x1, y, y1, w = lc->xy[2] - lc->xy[0];
+
+	for (y = cxy[1]; y < cxy[3]; y = y1)
+	{
+		/* Rows with same valid part get done together */
+		span = lc->span + (y - lc->xy[1]) * 2;
+		x0 = span[0]; x1 = span[1];
+		for (y1 = y + 1; y1 < cxy[3]; y1++)
+		{
+			span += 2;
+			if ((span[0] != x0) || (span[1] != x1)) break;
+		}
+		/* Nothing usable */
+		if ((x0 >= x1) || (x0 > cxy[2]) || (x1 < cxy[0]))
+			lc_render(x0 = cxy[0], y, x1 = cxy[2], y1);
+		/* Extend the valid part */
+		else
+		{
+			if (x0 > cxy[0]) lc_render(cxy[0], y, x0, y1) , x0 = cxy[0];
+			if (x1 < cxy[2]) lc_render(x1, y, cxy[2], y1) , x1 = cxy[2];
+		}
+		for (span = lc->span + (y - lc->xy[1]) * 2; span <
+			lc->span + (y1 - lc->xy[1]) * 2; span += 2)
+			span[0] = x0 , span[1] = x1;
+	}
+
+	for (y = cxy[1]; y < cxy[3]; y++ , rgb += pw)
+		memcpy(rgb, lc->below + ((y - lc->xy[1]) * w + cxy[0] -
+			lc->xy[0]) * 3, (cxy[2] - cxy[0]) * 3);
+}
+
+/* Check if the layers over the current one are translucent anywhere in a row;
+ * as each layer's blend is monotonic and never widens the difference between
+ * two colors, the black & white results are exact for any color under them
+ * only where they are the same (opaque), or 255 apart (fully transparent) */
+static int lc_mixed(unsigned char *a0, unsigned char *a1, int l)
+{
+	int i, d;
+
+	for (i = 0; i < l; i++)
+	{
+		d = a1[i] - a0[i];
+		if (d && (d < 255)) return (TRUE);
+	}
+	return (FALSE);
+}
+
+/* Put layers over the current one on top, from the cache where it is exact */
+static void lc_above(unsigned char *rgb, int *cxy, int pw)
+{
+	layers_cache *lc = &lcache;
+	unsigned char *a0, *a1;
+	int i, y, y1, rxy[4], l = (cxy[2] - cxy[0]) * 3, w = lc->xy[2] - lc->xy[0];
+
+	if (layer_selected >= layers_total) return;
+	for (y = cxy[1]; y < cxy[3]; y = y1)
+	{
+		i = ((y - lc->xy[1]) * w + cxy[0] - lc->xy[0]) * 3;
+		a0 = lc->above0 + i; a1 = lc->above1 + i;
+
+		/* Rows with translucent parts get rendered the slow way */
+		for (y1 = y; (y1 < cxy[3]) && lc_mixed(a0, a1, l);
+			y1++ , a0 += w * 3 , a1 += w * 3);
+		if (y1 > y)
+		{
+			copy4(rxy, cxy);
+			rxy[1] = y; rxy[3] = y1;
+			render_layers(rgb, rxy, pw, lc->s.zoom, lc->s.scale,
+				layer_selected + 1, layers_total, FALSE);
+			rgb += (y1 - y) * pw;
+			continue;
+		}
+
+		for (i = 0; i < l; i++)
+			if (a0[i] == a1[i]) rgb[i] = a0[i]; // Opaque
+		rgb += pw;
+		y1 = y + 1;
+	}
+}
+
 static void canvas_render(u_render_state *u, int py, int ph)
 {
 	int cxy[4], rxy[4], pw = u->pw;
@@ -2988,7 +3273,8 @@ static void canvas_render(u_render_state *u, int py, int ph)
 		copy4(cxy, u->cxy);
 		rgb = u->rgb + (py - cxy[1]) * pw;
 		cxy[3] = (cxy[1] = py) + ph;
-		render_layers(rgb, cxy, pw, u->r.zoom, u->r.scale,
+		if (u->lc) lc_below(rgb, cxy, pw);
+		else render_layers(rgb, cxy, pw, u->r.zoom, u->r.scale,
 			0, layer_selected - 1, FALSE);
 	}
 
@@ -2997,7 +3283,9 @@ static void canvas_render(u_render_state *u, int py, int ph)
 		main_render(u, rxy[1], rxy[3] - rxy[1]);
 
 	/* Render overlying layers */
-	if (u->lr) render_layers(rgb, cxy, pw, u->r.zoom, u->r.scale,
+	if (!u->lr);
+	else if (u->lc) lc_above(rgb, cxy, pw);
+	else render_layers(rgb, cxy, pw, u->r.zoom, u->r.scale,
 		layer_selected + 1, layers_total, FALSE);
 }
 
@@ -3037,6 +3325,8 @@ static int paint_canvas(void *dt, void **wdata, int what, void **where,
 	irgb = clip_to_image(rect, rgb, ctx->xy);
 
 	/* !!! This uses the fact that zoom factor is either N or 1/N !!! */
+	/* For 1/N, the renderer draws RGB from the largest mipmap level that
+	 * divides N, and subsamples it by the remaining factor */
 	if (can_zoom < 1.0) zoom = rint(1.0 / can_zoom);
 	else scale = rint(can_zoom);
 
@@ -3066,7 +3356,10 @@ static int paint_canvas(void *dt, void **wdata, int what, void **where,
 			(!overlay_alpha && mem_img[CHN_ALPHA] && !channel_dis[CHN_ALPHA])))
 			async_bk = render_background(irgb, rect[0], rect[1],
 				rect[2] - rect[0], rect[3] - rect[1], pw * 3);
+		lc_free(&lcache); // Not needed anymore
 	}
+	/* Other layers from cache, if they are on plain background */
+	else u.lc = lc_prepare(u.cxy, zoom, scale);
 
 	while (irgb || u.lr)
 	{
@@ -3118,9 +3411,7 @@ static int paint_canvas(void *dt, void **wdata, int what, void **where,
 #ifdef U_THREADS
 		if (u.tdata && (u.tdata != MEM_NONE)) // Threads w/allocation
 		{
-			nt /= u.tdata->count;
-			if (nt > MAX_TH_STRIPS) nt = MAX_TH_STRIPS;
-			u.tdata->chunks = nt;
+			u.tdata->chunks = THREAD_STEAL;
 			u.tdata->silent = TRUE;
 			launch_threads(do_canvas_render, u.tdata, NULL, wh);
 		}
@@ -3207,21 +3498,138 @@ void repaint_canvas(int px, int py, int pw, int ph)
 	cmd_setv(drawing_canvas, &ctx, CANVAS_PAINT);
 }
 
+/* Changed areas aren't repainted right away, but marked in a bitmap of canvas
+ * tiles; once per frame, runs of marked tiles are merged into rectangles and
+ * queued for redraw together. This way, a burst of small updates, like from a
+ * brush stroke, gets rendered once per frame and not once per update */
+
+#define UPD_TILE_SHIFT 6 /* 64x64 */
+#define UPD_FRAME 16 /* Milliseconds: render no faster than display refresh */
+
+static struct {
+	int xy[4];	// Visible area, in tiles
+	int rw;		// Words per bitmap row
+	guint32 *map;	// Dirty tiles
+	int dirty;
+	guint timer;
+} upd_tiles;
+
+#define UPD_BIT(R,X) ((R)[(X) >> 5] & (1U << ((X) & 31)))
+
+static void upd_flush()
+{
+	int i, j, x0, y0, x1, y1, w, h, rw = upd_tiles.rw, rxy[4];
+	guint32 *row, *map = upd_tiles.map;
+
+	if (!upd_tiles.dirty) return;
+	upd_tiles.dirty = FALSE;
+	w = upd_tiles.xy[2] - upd_tiles.xy[0];
+	h = upd_tiles.xy[3] - upd_tiles.xy[1];
+
+	for (y0 = 0 , row = map; y0 < h; y0++ , row += rw)
+	{
+		for (x0 = 0; x0 < w; x0 = x1 + 1)
+		{
+			/* Find a run of dirty tiles */
+			for (; (x0 < w) && !UPD_BIT(row, x0); x0++);
+			if (x0 >= w) break;
+			for (x1 = x0 + 1; (x1 < w) && UPD_BIT(row, x1); x1++);
+			/* Extend it down while the rows below have it too */
+			for (y1 = y0 + 1; y1 < h; y1++)
+			{
+				guint32 *r2 = map + y1 * rw;
+				for (i = x0; (i < x1) && UPD_BIT(r2, i); i++);
+				if (i < x1) break;
+			}
+			/* Take the rectangle off the map */
+			for (j = y0; j < y1; j++)
+			for (i = x0; i < x1; i++)
+				map[j * rw + (i >> 5)] &= ~(1U << (i & 31));
+			/* And have it redrawn */
+			rxy[0] = (upd_tiles.xy[0] + x0) << UPD_TILE_SHIFT;
+			rxy[1] = (upd_tiles.xy[1] + y0) << UPD_TILE_SHIFT;
+			rxy[2] = (upd_tiles.xy[0] + x1) << UPD_TILE_SHIFT;
+			rxy[3] = (upd_tiles.xy[1] + y1) << UPD_TILE_SHIFT;
+			cmd_setv(drawing_canvas, rxy, CANVAS_REPAINT);
+		}
+	}
+}
+
+static gboolean upd_timer_call(gpointer data)
+{
+	upd_tiles.timer = 0;
+	upd_flush();
+	return (FALSE);
+}
+
+/* Schedule repaint of canvas area */
+static void upd_schedule(int *rxy)
+{
+	int i, j, w, h, xyhv[4], vxy[4], txy[4];
+
+	if (cmd_mode) return; // No canvas to paint
+
+	/* Only what is visible is worth waiting for */
+	cmd_peekv(scrolledwindow_canvas, xyhv, sizeof(xyhv), CSCROLL_XYSIZE);
+	vxy[2] = (vxy[0] = xyhv[0]) + xyhv[2];
+	vxy[3] = (vxy[1] = xyhv[1]) + xyhv[3];
+	if (!clip(vxy, vxy[0], vxy[1], vxy[2], vxy[3], rxy)) return;
+
+	/* Map the visible area */
+	txy[0] = xyhv[0] >> UPD_TILE_SHIFT;
+	txy[1] = xyhv[1] >> UPD_TILE_SHIFT;
+	txy[2] = ((xyhv[0] + xyhv[2] - 1) >> UPD_TILE_SHIFT) + 1;
+	txy[3] = ((xyhv[1] + xyhv[3] - 1) >> UPD_TILE_SHIFT) + 1;
+	if (memcmp(txy, upd_tiles.xy, sizeof(txy)))
+	{
+		upd_flush(); // Scrolled or resized - send out what was before
+		free(upd_tiles.map);
+		copy4(upd_tiles.xy, txy);
+		w = txy[2] - txy[0];
+		h = txy[3] - txy[1];
+		upd_tiles.rw = (w + 31) >> 5;
+		upd_tiles.map = calloc(upd_tiles.rw * h, sizeof(guint32));
+		if (!upd_tiles.map)
+		{
+			memset(upd_tiles.xy, 0, sizeof(upd_tiles.xy));
+			cmd_setv(drawing_canvas, vxy, CANVAS_REPAINT);
+			return;
+		}
+	}
+
+	/* Mark the tiles */
+	vxy[0] = (vxy[0] >> UPD_TILE_SHIFT) - txy[0];
+	vxy[1] = (vxy[1] >> UPD_TILE_SHIFT) - txy[1];
+	vxy[2] = ((vxy[2] - 1) >> UPD_TILE_SHIFT) + 1 - txy[0];
+	vxy[3] = ((vxy[3] - 1) >> UPD_TILE_SHIFT) + 1 - txy[1];
+	for (j = vxy[1]; j < vxy[3]; j++)
+	{
+		guint32 *row = upd_tiles.map + j * upd_tiles.rw;
+		for (i = vxy[0]; i < vxy[2]; i++) row[i >> 5] |= 1U << (i & 31);
+	}
+	upd_tiles.dirty = TRUE;
+
+	if (!upd_tiles.timer) upd_tiles.timer =
+		threads_timeout_add(UPD_FRAME, upd_timer_call, NULL);
+}
+
 /* Update x,y,w,h area of current image */
 void main_update_area(int x, int y, int w, int h)
 {
 	int zoom, scale, rxy[4];
 
+	mip_update(&mem_image, x, y, w, h);
 	if (can_zoom < 1.0)
 	{
 		zoom = rint(1.0 / can_zoom);
-		w += x;
-		h += y;
-		x = floor_div(x + zoom - 1, zoom);
-		y = floor_div(y + zoom - 1, zoom);
-		w = (w - x * zoom + zoom - 1) / zoom;
-		h = (h - y * zoom + zoom - 1) / zoom;
 		if ((w <= 0) || (h <= 0)) return;
+		/* Mipmapped pixels average whole blocks, so cover them all */
+		w = floor_div(x + w - 1, zoom) + 1;
+		h = floor_div(y + h - 1, zoom) + 1;
+		x = floor_div(x, zoom);
+		y = floor_div(y, zoom);
+		w -= x;
+		h -= y;
 	}
 	else
 	{
@@ -3236,7 +3644,7 @@ void main_update_area(int x, int y, int w, int h)
 
 	rxy[2] = (rxy[0] = x + margin_main_x) + w;
 	rxy[3] = (rxy[1] = y + margin_main_y) + h;
-	cmd_setv(drawing_canvas, rxy, CANVAS_REPAINT);
+	upd_schedule(rxy);
 }
 
 /* Get zoomed canvas size */
@@ -306,12 +306,6 @@ extern void *scriptbar_code[];		// Set up scriptable items for tools toolbar
 
 int kpix_threads;			// Min kpixels per render thread
 
-/* With 2 cores and uniform layers stack, no noticeable difference between
- * 1, 4 and 8 strips per thread; time jitter of about 10% is common, and spikes
- * of about 40% sometimes happen; with 1 strip, even 50% was observed once.
- * Still, with nonuniform layers, more strips can maybe balance better - WJ */
-#define MAX_TH_STRIPS 8
-
 void var_init();			// Load INI variables
 void string_init();			// Translate static strings
 void main_init();			// Initialise and display the main window
@@ -324,6 +318,7 @@ void draw_poly(int *xy, int cnt, int shift, int x00, int y00, rgbcontext *ctx);
 void canvas_size(int *w, int *h);	// Get zoomed canvas size
 void prepare_line_clip(int *lxy, int *vxy, int scale);	// Map clipping rectangle to line-space
 void main_update_area(int x, int y, int w, int h);	// Update x,y,w,h area of current image
+void main_update_layers(int x, int y, int w, int h);	// Forget x,y,w,h area of other layers, or all if w<0
 void repaint_canvas( int px, int py, int pw, int ph );		// Redraw area of canvas
 void grad_stroke(int x, int y);		// Update stroke gradient
 
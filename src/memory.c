@@ -37,6 +37,18 @@
 #include "viewer.h"
 #include "csel.h"
 #include "thread.h"
+#include "spawn.h"
+
+#include <zlib.h>
+
+#ifdef HAVE_X86_SIMD
+#include <immintrin.h>
+#endif
+
+#ifndef WIN32
+#include <sys/mman.h>
+#include <fcntl.h>
+#endif
 
 
 grad_info gradient[NUM_CHANNELS];	// Per-channel gradients
@@ -112,12 +124,19 @@ transform_state mem_bcsp[2];
 #define UF_SIZED 0x04
 #define UF_ORIG  0x08 /* Unmodified state */
 #define UF_ACCUM 0x10 /* Cumulative */
+#define UF_PACKED 0x20 /* Tiles compressed */
+
+static void undo_pack_done(undo_item *undo, int wait);
+static void undo_unspool(undo_item *undo);
 
 int mem_undo_limit;		// Max MB memory allocation limit
 int mem_undo_common;		// Percent of undo space in common arena
 int mem_undo_opacity;		// Use previous image for opacity calculations?
 
 int mem_undo_fail;		// Undo space shortfall
+int mem_undo_disk;		// Max MB of undo data spilled to disk, 0 = none
+
+static size_t undo_disk_used;	// Bytes of it in use
 
 typedef struct {
 	unsigned int n, size, freecnt;
@@ -558,7 +577,7 @@ int mem_add_frame(frameset *fset, int w, int h, int bpp, int cmask, png_color *p
 	for (i = CHN_IMAGE; res && (i < NUM_CHANNELS); i++)
 	{
 		if (cmask & CMASK_FOR(i))
-			res = frm->img[i] = malloc(l);
+			res = frm->img[i] = mem_chan_alloc(l);
 		l = sz;
 	}
 
@@ -577,7 +596,7 @@ int mem_add_frame(frameset *fset, int w, int h, int bpp, int cmask, png_color *p
 
 	if (!res) /* Not enough memory */
 	{
-		while (--i >= 0) free(frm->img[i]);
+		while (--i >= 0) mem_chan_free(frm->img[i]);
 		return (FALSE);
 	}
 
@@ -794,6 +813,140 @@ void update_undo(image_info *image)
 	undo->flags = image->changed ? 0 : UF_ORIG;
 }
 
+/* Channels of mem_bigchan_mb+ megabytes get mapped from an unnamed tempfile,
+ * so that the OS pages them in and out on demand, instead of them going into
+ * swap or failing to allocate at all */
+
+#ifndef WIN32
+
+typedef struct {
+	void *addr;
+	size_t size;
+} bigchan;
+
+static bigchan *bigchans;
+static int nbigchans, maxbigchans;
+
+/* Loaders on pool threads and the background undo packer allocate channels
+ * too, and "threads_running" does not cover the latter - so lock always */
+#ifdef U_THREADS
+static GStaticMutex bigchan_lock = G_STATIC_MUTEX_INIT;
+#define BIGCHAN_LOCK() g_static_mutex_lock(&bigchan_lock)
+#define BIGCHAN_UNLOCK() g_static_mutex_unlock(&bigchan_lock)
+#else
+#define BIGCHAN_LOCK()
+#define BIGCHAN_UNLOCK()
+#endif
+
+/* Map a block of a new spoolfile */
+static void *spool_map(size_t l)
+{
+	void *res = NULL;
+	int fd;
+
+	if ((fd = open_spoolfile()) < 0) return (NULL);
+	/* Reserve disk space now, to avoid a SIGBUS on writing later */
+	if (!posix_fallocate(fd, 0, l))
+	{
+		res = mmap(NULL, l, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+		if (res == MAP_FAILED) res = NULL;
+	}
+	close(fd); // The mapping keeps the file alive
+	return (res);
+}
+
+#define spool_unmap(A,L) munmap((A), (L))
+
+static void *bigchan_alloc(size_t l)
+{
+	void *res;
+
+	if (!mem_bigchan_mb || (l < ((size_t)mem_bigchan_mb << 20))) return (NULL);
+	if (!(res = spool_map(l))) return (NULL);
+	BIGCHAN_LOCK();
+	if (nbigchans >= maxbigchans)
+	{
+		int n = maxbigchans * 2 + 16;
+		bigchan *tmp = realloc(bigchans, n * sizeof(bigchan));
+		if (!tmp)
+		{
+			BIGCHAN_UNLOCK();
+			spool_unmap(res, l);
+			return (NULL);
+		}
+		bigchans = tmp;
+		maxbigchans = n;
+	}
+	bigchans[nbigchans].addr = res;
+	bigchans[nbigchans++].size = l;
+	BIGCHAN_UNLOCK();
+	return (res);
+}
+
+/* Call with the lock held */
+static int bigchan_index(void *chan)
+{
+	int i;
+
+	for (i = nbigchans - 1; (i >= 0) && (bigchans[i].addr != chan); i--);
+	return (i);
+}
+
+static int bigchan_find(void *chan)
+{
+	int i;
+
+	BIGCHAN_LOCK();
+	i = bigchan_index(chan);
+	BIGCHAN_UNLOCK();
+	return (i);
+}
+
+static int bigchan_free(void *chan)
+{
+	size_t l;
+	int i;
+
+	BIGCHAN_LOCK();
+	i = bigchan_index(chan);
+	if (i >= 0)
+	{
+		l = bigchans[i].size;
+		bigchans[i] = bigchans[--nbigchans];
+	}
+	BIGCHAN_UNLOCK();
+	if (i < 0) return (FALSE);
+	spool_unmap(chan, l);
+	return (TRUE);
+}
+
+#else /* No file mapping on Windows */
+
+#define spool_map(L) NULL
+#define spool_unmap(A,L)
+#define bigchan_alloc(L) NULL
+#define bigchan_find(C) (-1)
+#define bigchan_free(C) FALSE
+
+#endif
+
+void *mem_chan_alloc(size_t l)
+{
+	void *res = bigchan_alloc(l);
+	return (res ? res : malloc(l));
+}
+
+void mem_chan_free(void *chan)
+{
+	if (!bigchan_free(chan)) free(chan);
+}
+
+/* Mapped blocks stay as they are - the unused tail costs only disk space */
+static void *mem_chan_realloc(void *chan, size_t l)
+{
+	return (bigchan_find(chan) < 0 ? realloc(chan, l) : NULL);
+}
+
 void mem_free_chanlist(chanlist img)
 {
 	int i;
@@ -801,7 +954,7 @@ void mem_free_chanlist(chanlist img)
 	for (i = 0; i < NUM_CHANNELS; i++)
 	{
 		if (!img[i]) continue;
-		if (img[i] != (void *)(-1)) free(img[i]);
+		if (img[i] != (void *)(-1)) mem_chan_free(img[i]);
 	}
 }
 
@@ -811,9 +964,11 @@ static size_t undo_free_x(undo_item **undo_)
 	size_t j;
 
 	if (!undo) return (0);
+	undo_pack_done(undo, TRUE); // Cannot free what is being read
 	j = undo->size;
 	undo_free_data(undo);
 	free(undo->pal_);
+	undo_unspool(undo);
 	mem_free_chanlist(undo->img);
 	memset(undo, 0, sizeof(undo_item));
 	freechunk(&undo_items, undo);
@@ -891,6 +1046,7 @@ void mem_free_image(image_info *image, int mode)
 	/* Delete current image (don't rely on undo frame being up to date) */
 	if (mode & FREE_IMAGE)
 	{
+		mip_drop(image);
 		mem_free_chanlist(image->img);
 		memset(image->img, 0, sizeof(chanlist));
 		image->width = image->height = 0;
@@ -957,7 +1113,7 @@ int mem_alloc_image(int mode, image_info *image, int w, int h, int bpp,
 	res = (void *)(-1);
 	for (i = CHN_IMAGE; res && (i < NUM_CHANNELS); i++)
 	{
-		if (cmask & CMASK_FOR(i)) res = image->img[i] = malloc(l);
+		if (cmask & CMASK_FOR(i)) res = image->img[i] = mem_chan_alloc(l);
 		l = sz;
 	}
 	if (res && image->undo_.items)
@@ -969,7 +1125,7 @@ int mem_alloc_image(int mode, image_info *image, int w, int h, int bpp,
 	{
 		free(image->filename);
 		image->filename = NULL;
-		while (--i >= 0) free(image->img[i]);
+		while (--i >= 0) mem_chan_free(image->img[i]);
 		memset(image->img, 0, sizeof(chanlist));
 		return (FALSE);
 	}
@@ -1324,7 +1480,7 @@ static void mem_undo_tile(undo_item *undo)
 		if (!(nc & 1 << cc)) continue;
 		if (!ntiles) /* Channels unchanged - free the memory */
 		{
-			free(undo->img[cc]);
+			mem_chan_free(undo->img[cc]);
 			undo->img[cc] = (void *)(-1);
 			continue;
 		}
@@ -1366,14 +1522,14 @@ static void mem_undo_tile(undo_item *undo)
 		/* Resize or free memory block */
 		if (blk == undo->img[cc]) /* Resize old */
 		{
-			dest = realloc(undo->img[cc], l);
+			dest = mem_chan_realloc(undo->img[cc], l);
 			/* Leave chunk alone if resizing failed */
 			if (!dest) l = sz * bpp;
 			else undo->img[cc] = dest;
 		}
 		else /* Replace with new */
 		{
-			free(undo->img[cc]);
+			mem_chan_free(undo->img[cc]);
 			undo->img[cc] = blk;
 		}
 		msize += l + 32;
@@ -1395,6 +1551,328 @@ static void mem_undo_tile(undo_item *undo)
 	undo->flags |= UF_SIZED;
 }
 
+/* Tiled frames get their tiles packed with zlib, on the background thread if
+ * there is one; one frame at a time, with main thread picking up the results
+ * at its convenience. Each packed channel block starts with raw and packed
+ * data lengths, and the first one has the tilemap after the data */
+
+#define PACK_HDR (sizeof(size_t) * 2)
+#define PACK_LEVEL 1 /* Fastest */
+
+typedef struct {
+	undo_item *undo;	// Frame being packed, NULL if none
+	unsigned char *src[NUM_CHANNELS], *dest[NUM_CHANNELS];
+	unsigned char *tmap;
+	size_t len[NUM_CHANNELS];
+	int tsz, ok;
+} undo_packjob;
+
+static undo_packjob packjob;
+
+static int tilemap_size(int w, int h)
+{
+	return ((((w + TILE_SIZE - 1) / TILE_SIZE + 7) >> 3) *
+		((h + TILE_SIZE - 1) / TILE_SIZE));
+}
+
+/* Count pixels in the tiles */
+static size_t tilemap_area(unsigned char *tmap, int w, int h)
+{
+	int spans[(MAX_WIDTH + TILE_SIZE - 1) / TILE_SIZE + 3];
+	size_t area = 0;
+	int i, nw = ((w + TILE_SIZE - 1) / TILE_SIZE + 7) >> 3;
+
+	for (i = 0; i < h; i += TILE_SIZE , tmap += nw)
+		area += (size_t)mem_undo_spans(spans, tmap, w, 1) *
+			(h - i > TILE_SIZE ? TILE_SIZE : h - i);
+	return (area);
+}
+
+/* !!! Runs on background thread - must not touch anything but the job */
+static void undo_pack_job(void *data)
+{
+	undo_packjob *job = data;
+	unsigned char *buf;
+	size_t raw = 0, packed = 0;
+	uLongf l;
+	int i, tsz = job->tsz;
+
+	job->ok = FALSE;
+	for (i = 0; i < NUM_CHANNELS; i++)
+	{
+		if (!job->src[i]) continue;
+		l = compressBound(job->len[i]);
+		job->dest[i] = buf = malloc(PACK_HDR + l + tsz);
+		if (!buf) break;
+		if (compress2(buf + PACK_HDR, &l, job->src[i], job->len[i],
+			PACK_LEVEL) != Z_OK) break;
+		((size_t *)buf)[0] = job->len[i];
+		((size_t *)buf)[1] = l;
+		if (tsz) memcpy(buf + PACK_HDR + l, job->tmap, tsz);
+		if ((buf = realloc(buf, PACK_HDR + l + tsz))) job->dest[i] = buf;
+		raw += job->len[i] + tsz;
+		packed += PACK_HDR + l + tsz;
+		tsz = 0; // Tilemap goes only into first block
+	}
+	/* Keep the result only if all went well, and it is worth it */
+	if ((i >= NUM_CHANNELS) && (packed < raw - (raw >> 3))) job->ok = TRUE;
+	else for (i = 0; i < NUM_CHANNELS; i++)
+	{
+		free(job->dest[i]);
+		job->dest[i] = NULL;
+	}
+}
+
+/* Pick up results of the packing job, if any, when it is done; if a frame is
+ * given, only if it is the one being packed */
+static void undo_pack_done(undo_item *what, int wait)
+{
+	undo_packjob *job = &packjob;
+	undo_item *undo = job->undo;
+	size_t msize = 0;
+	int i, tsz = job->tsz;
+
+	if (!undo || (what && (what != undo))) return;
+	if (!wait && thread_bg_busy()) return;
+	thread_bg_wait();
+	job->undo = NULL;
+	if (!job->ok) return;
+
+	for (i = 0; i < NUM_CHANNELS; i++)
+	{
+		if (!job->dest[i]) continue;
+		mem_chan_free(undo->img[i]);
+		undo->img[i] = job->dest[i];
+		msize += PACK_HDR + ((size_t *)job->dest[i])[1] + tsz + 32;
+		if (tsz) undo->tileptr = job->dest[i] + PACK_HDR +
+			((size_t *)job->dest[i])[1];
+		tsz = 0;
+	}
+	if (undo->pal_) msize += SIZEOF_PALETTE + 32;
+	undo->size = msize;
+	undo->flags |= UF_PACKED | UF_SIZED;
+}
+
+/* Start packing a tiled frame */
+static void undo_pack(undo_item *undo)
+{
+	undo_packjob *job = &packjob;
+	size_t area;
+	int i, bpp;
+
+	/* Leave the frame unpacked if the previous job is still running */
+	undo_pack_done(NULL, FALSE);
+	if (job->undo) return;
+	if ((undo->flags & (UF_TILED | UF_PACKED)) != UF_TILED) return;
+
+	job->tsz = tilemap_size(mem_width, mem_height);
+	job->tmap = undo->tileptr;
+	area = tilemap_area(undo->tileptr, mem_width, mem_height);
+	for (i = 0; i < NUM_CHANNELS; i++)
+	{
+		job->dest[i] = job->src[i] = NULL;
+		if (!undo->img[i] || (undo->img[i] == (void *)(-1))) continue;
+		job->src[i] = undo->img[i];
+		bpp = BPP(i);
+		job->len[i] = area * bpp;
+	}
+	job->undo = undo;
+	if (!thread_bg_run(undo_pack_job, job)) undo_pack_job(job);
+}
+
+/* Unpack a packed frame in preparation for swapping */
+static int undo_unpack(undo_item *undo)
+{
+	unsigned char *src, *dest[NUM_CHANNELS];
+	size_t msize = 0;
+	uLongf l;
+	int i, tsz, tsz0 = tilemap_size(mem_width, mem_height);
+
+	/* Allocate all, or nothing */
+	for (i = 0 , tsz = tsz0; i < NUM_CHANNELS; i++)
+	{
+		dest[i] = NULL;
+		if (!undo->img[i] || (undo->img[i] == (void *)(-1))) continue;
+		l = ((size_t *)undo->img[i])[0];
+		if (!(dest[i] = mem_chan_alloc(l + tsz)))
+		{
+			while (i-- > 0) mem_chan_free(dest[i]);
+			return (FALSE);
+		}
+		tsz = 0;
+	}
+
+	/* Unpack all, or fail with the frame left as it was */
+	for (i = 0; i < NUM_CHANNELS; i++)
+	{
+		if (!dest[i]) continue;
+		src = undo->img[i];
+		l = ((size_t *)src)[0];
+		if ((uncompress(dest[i], &l, src + PACK_HDR,
+			((size_t *)src)[1]) == Z_OK) &&
+			(l == ((size_t *)src)[0])) continue;
+		for (i = 0; i < NUM_CHANNELS; i++) mem_chan_free(dest[i]);
+		return (FALSE);
+	}
+
+	for (i = 0 , tsz = tsz0; i < NUM_CHANNELS; i++)
+	{
+		if (!dest[i]) continue;
+		src = undo->img[i];
+		l = ((size_t *)src)[0];
+		if (tsz) memcpy(undo->tileptr = dest[i] + l,
+			src + PACK_HDR + ((size_t *)src)[1], tsz);
+		mem_chan_free(src);
+		undo->img[i] = dest[i];
+		msize += l + tsz + 32;
+		tsz = 0;
+	}
+	if (undo->pal_) msize += SIZEOF_PALETTE + 32;
+	undo->size = msize;
+	undo->flags &= ~UF_PACKED;
+	return (TRUE);
+}
+
+/* Frames going over the memory limit can be moved to disk instead of being
+ * dropped, if mem_undo_disk allows: all their data blocks get copied into one
+ * spoolfile mapping, and copied back into memory when needed again */
+
+/* Get sizes of frame's data blocks, return their total */
+static size_t undo_blocks(undo_item *undo, size_t *sz)
+{
+	size_t k, area = 0, total = 0;
+	int i, tsz = 0, w = undo->width, h = undo->height;
+
+	k = (size_t)w * h;
+	if (undo->flags & UF_TILED)
+	{
+		tsz = tilemap_size(w, h);
+		if (!(undo->flags & UF_PACKED))
+			k = area = tilemap_area(undo->tileptr, w, h);
+	}
+	for (i = 0; i < NUM_CHANNELS; i++)
+	{
+		sz[i] = 0;
+		if (!undo->img[i] || (undo->img[i] == (void *)(-1))) continue;
+		if (undo->flags & UF_PACKED)
+			sz[i] = PACK_HDR + ((size_t *)undo->img[i])[1];
+		else sz[i] = k * (i == CHN_IMAGE ? undo->bpp : 1);
+		sz[i] += tsz; // Tilemap is in first block
+		total += sz[i];
+		tsz = 0;
+	}
+	return (total);
+}
+
+/* Move frame to disk; return the memory size gained */
+static size_t undo_spill(undo_item *undo)
+{
+	unsigned char *spool, *tmap = NULL;
+	size_t l, sz[NUM_CHANNELS], res;
+	int i;
+
+	undo_pack_done(undo, TRUE);
+	if (undo->spool || !undo->width) return (0);
+	if (!(l = undo_blocks(undo, sz))) return (0);
+	if (undo_disk_used + l > (size_t)mem_undo_disk * (1024 * 1024)) return (0);
+	if (!(spool = spool_map(l))) return (0);
+
+	undo->spool = spool;
+	undo->spool_size = l;
+	undo_disk_used += l;
+	for (i = 0; i < NUM_CHANNELS; i++)
+	{
+		if (!sz[i]) continue;
+		memcpy(spool, undo->img[i], sz[i]);
+		if (!tmap && (undo->flags & UF_TILED))
+			tmap = undo->tileptr = spool + (undo->tileptr - undo->img[i]);
+		mem_chan_free(undo->img[i]);
+		undo->img[i] = spool;
+		spool += sz[i];
+	}
+	res = undo->size;
+	undo->size = undo->pal_ ? SIZEOF_PALETTE + 32 : 0;
+	undo->flags |= UF_SIZED;
+	return (res - undo->size);
+}
+
+/* Release frame's spool, if any */
+static void undo_unspool(undo_item *undo)
+{
+	int i;
+
+	if (!undo->spool) return;
+	for (i = 0; i < NUM_CHANNELS; i++)
+		if (undo->img[i] != (void *)(-1)) undo->img[i] = NULL;
+	spool_unmap(undo->spool, undo->spool_size);
+	undo_disk_used -= undo->spool_size;
+	undo->spool = NULL;
+	undo->spool_size = 0;
+}
+
+/* Move frame back into memory */
+static int undo_unspill(undo_item *undo)
+{
+	unsigned char *dest[NUM_CHANNELS], *tmap = NULL;
+	size_t sz[NUM_CHANNELS], msize = 0;
+	int i;
+
+	if (!undo->spool) return (TRUE);
+	undo_blocks(undo, sz);
+
+	/* Allocate all, or nothing */
+	for (i = 0; i < NUM_CHANNELS; i++)
+	{
+		dest[i] = NULL;
+		if (!sz[i]) continue;
+		if (!(dest[i] = mem_chan_alloc(sz[i])))
+		{
+			while (i-- > 0) mem_chan_free(dest[i]);
+			return (FALSE);
+		}
+	}
+
+	for (i = 0; i < NUM_CHANNELS; i++)
+	{
+		if (!dest[i]) continue;
+		memcpy(dest[i], undo->img[i], sz[i]);
+		if (!tmap && (undo->flags & UF_TILED))
+			tmap = undo->tileptr = dest[i] + (undo->tileptr - undo->img[i]);
+		msize += sz[i] + 32;
+	}
+	undo_unspool(undo);
+	for (i = 0; i < NUM_CHANNELS; i++)
+		if (dest[i]) undo->img[i] = dest[i];
+	if (undo->pal_) msize += SIZEOF_PALETTE + 32;
+	undo->size = msize;
+	undo->flags |= UF_SIZED;
+	return (TRUE);
+}
+
+/* Move the oldest frame still in memory to disk */
+static size_t spill_oldest(undo_stack *ustack)
+{
+	size_t res;
+	int i, j;
+
+	if (!mem_undo_disk) return (0);
+	i = ustack->done > ustack->redo ? ustack->done : ustack->redo;
+	for (; i > 0; i--)
+	{
+		if (i <= ustack->redo)
+		{
+			j = (ustack->pointer + i) % ustack->max;
+			if ((res = undo_spill(ustack->items[j]))) return (res);
+		}
+		if (i <= ustack->done)
+		{
+			j = (ustack->pointer - i + ustack->max) % ustack->max;
+			if ((res = undo_spill(ustack->items[j]))) return (res);
+		}
+	}
+	return (0);
+}
+
 /* Compress last undo frame */
 void mem_undo_prepare()
 {
@@ -1416,6 +1894,8 @@ void mem_undo_prepare()
 	}
 	/* Tile image */
 	mem_undo_tile(undo);
+	/* Pack the tiles */
+	undo_pack(undo);
 }
 
 static size_t mem_undo_size(undo_stack *ustack)
@@ -1473,6 +1953,7 @@ static int mem_undo_space(size_t mem_req)
 {
 	undo_stack *heap[MAX_LAYERS + 2], *wp, *hp;
 	size_t mem_lim, mem_max = (size_t)mem_undo_limit * (1024 * 1024);
+	size_t res, mem_req0 = mem_req;
 	int i, l, l2, h, csz = mem_undo_common * layers_total;
 	
 	/* Layer mem limit including common area */
@@ -1481,12 +1962,25 @@ static int mem_undo_space(size_t mem_req)
 	/* Fail if hopeless */
 	if (mem_req > mem_lim) return (mem_req - mem_lim);
 
+	/* Take in the packed frame if ready */
+	undo_pack_done(NULL, FALSE);
+
 	/* Layer mem limit exceeded - drop oldest */
 	mem_req += mem_undo_size(&mem_image.undo_);
 	while (mem_req > mem_lim)
 	{
+		/* Packing may free enough space by itself */
+		if (packjob.undo)
+		{
+			undo_pack_done(NULL, TRUE);
+			mem_req = mem_req0 + mem_undo_size(&mem_image.undo_);
+			continue;
+		}
 		if (!mem_undo_done) return (mem_req - mem_lim);
-		mem_req -= lose_oldest(&mem_image.undo_);
+		/* Move frames to disk while there is room, then drop them */
+		if (!(res = spill_oldest(&mem_image.undo_)))
+			res = lose_oldest(&mem_image.undo_);
+		mem_req -= res;
 	}
 	/* All done if no common area */
 	if (!csz) return (0);
@@ -1524,7 +2018,7 @@ static int mem_undo_space(size_t mem_req)
 		wp = heap[1];
 		while (TRUE)
 		{
-			size_t res = lose_oldest(wp);
+			if (!(res = spill_oldest(wp))) res = lose_oldest(wp);
 			wp->size -= res; // Maintain undo stack size
 			mem_req -= res;
 			if (mem_req <= mem_max) return (0);
@@ -1548,11 +2042,12 @@ static int mem_undo_space(size_t mem_req)
 }
 
 /* Try to allocate a memory block, releasing undo frames if needed */
+// !!! Big blocks can get file-backed, so free them with mem_chan_free()
 void *mem_try_malloc(size_t size)
 {
 	void *ptr;
 
-	while (!((ptr = malloc(size))))
+	while (!((ptr = mem_chan_alloc(size))))
 	{
 // !!! Hardcoded to work with mem_image for now
 		if (!mem_undo_done) return (NULL);
@@ -1659,7 +2154,7 @@ int undo_next_core(int mode, int new_width, int new_height, int new_bpp, int cma
 		{
 			free(newpal);
 			for (j = 0; j < i; j++)
-				if (holder[j] != mem_img[j]) free(holder[j]);
+				if (holder[j] != mem_img[j]) mem_chan_free(holder[j]);
 			return (1);
 		}
 		holder[i] = img;
@@ -1860,7 +2355,17 @@ void mem_do_undo(int redo)
 		/* Swap data */
 		curr = mem_undo_im_[mem_undo_pointer];
 		prev = mem_undo_im_[i];
+		undo_pack_done(prev, TRUE);
+		if (!undo_unspill(prev) ||
+			((prev->flags & UF_PACKED) && !undo_unpack(prev)))
+		{
+			pen_down = 0;
+			memory_errors(1);
+			return;
+		}
 		mem_undo_swap(prev, redo);
+		/* Repack if not busy with something else */
+		if (!thread_bg_busy()) undo_pack(prev);
 
 		/* Swap frames */
 		mem_undo_im_[mem_undo_pointer] = prev;
@@ -2247,26 +2752,42 @@ void mem_get_histogram(int channel)	// Calculate how many of each colour index i
 	for (i = 0; i < j; i++) mem_histogram[*img++]++;
 }
 
+/* Color transform gets compiled into a plan: the per-channel parts become
+ * lookup tables, and only hue and saturation are left to per-pixel math */
+
+#define XF_LUT 0 /* Tables only */
+#define XF_SAT 1 /* Tables & saturation */
+#define XF_HUE 2 /* Tables, hue, and maybe saturation */
+
+#define XF_BLOCK 8 /* Pixels per saturation block */
+
 typedef struct {
-	int last_gamma, last_br, last_co, last_ps;
+	transform_state t;	// Settings the plan is made for
+	int valid, mode;
+	int ops;		// Mask of channels to leave unchanged
+	int sa, dH, sH, dc;	// Saturation & hue shift
+	int src[3];		// Source channel for each output channel
+	unsigned char pre[256];	// Gamma; also brightness-contrast if no hue
+	unsigned char mid[256];	// Brightness-contrast after hue
+	unsigned char post[256];// Posterize
+	unsigned char lut[3][256]; // Everything at once, in XF_LUT mode
+} transform_plan;
+
+static const int ixx[7] = {0, 1, 2, 0, 1, 2, 0};
+
+static transform_plan *transform_prepare(int brush)
+{
+	static transform_plan tc[2];
+	transform_plan *tp = tc + !!brush;
+	transform_state *mp = mem_bcsp + !!brush;
 	unsigned char gamma_table[256], bc_table[256], ps_table[256];
-} transform_cache;
-
-void do_transform(int start, int step, int cnt, unsigned char *mask,
-	unsigned char *imgr, unsigned char *img0, int m0)
-{
-	static const int ixx[7] = {0, 1, 2, 0, 1, 2, 0};
-	static unsigned char fmask = 255;
-	static transform_cache tc[2];
-	int do_gamma, do_bc, /*do_sa,*/ do_ps;
-	unsigned char rgb[3];
-	int br, co, sa;
-	int dH, sH, tH, ix0, ix1, ix2, c0, c1, c2, dc = 0, ops = 0;
-	int j, mstep, r, g, b;
-	transform_cache *tp = tc;
-	transform_state *mp = mem_bcsp;
+	int do_gamma, do_bc, do_ps;
+	int i, j, k, br, co, sa, dH, sH, dc = 0, ops = 0;
 
-	if (m0 > 255) tp++ , mp++; // Brush mode
+	/* Same settings, same plan */
+	if (tp->valid && !memcmp(&tp->t, mp, sizeof(transform_state)))
+		return (tp);
+	tp->valid = FALSE;
 
 	if (!mp->allow[0]) ops |= 0xFF;
 	if (!mp->allow[1]) ops |= 0xFF00;
@@ -2287,15 +2808,13 @@ void do_transform(int start, int step, int cnt, unsigned char *mask,
 
 	do_gamma = mp->bcsp[4] - 100;
 	do_bc = br | (co - 256);
-//	do_sa = sa - 255;
 
 	/* Prepare posterize table */
-	if (do_ps && (do_ps != tp->last_ps))
+	for (i = 0; i < 256; i++) ps_table[i] = i;
+	if (do_ps)
 	{
 		int mul = do_ps & 255, div = 256, add = 0, div2 = mul - 1;
-		int i, j;
 
-		tp->last_ps = do_ps;
 		if (do_ps > 255) // Rounded
 		{
 			mul += mul - 2;
@@ -2305,32 +2824,28 @@ void do_transform(int start, int step, int cnt, unsigned char *mask,
 		for (i = 0; i < 256; i++)
 		{
 			j = (i * mul + add) / div;
-			tp->ps_table[i] = (j * 255 * 2 + div2) / (div2 + div2);
+			ps_table[i] = (j * 255 * 2 + div2) / (div2 + div2);
 		}
 	}
 	/* Prepare gamma table */
-	if (do_gamma && (do_gamma != tp->last_gamma))
+	for (i = 0; i < 256; i++) gamma_table[i] = i;
+	if (do_gamma)
 	{
-		double w;
-		int i;
+		double w = 100.0 / (double)(do_gamma + 100);
 
-		tp->last_gamma = do_gamma;
-		w = 100.0 / (double)(do_gamma + 100);
 		for (i = 0; i < 256; i++)
 		{
-			tp->gamma_table[i] = rint(255.0 * pow((double)i / 255.0, w));
+			gamma_table[i] = rint(255.0 * pow((double)i / 255.0, w));
 		}
 	}
 	/* Prepare brightness-contrast table */
-	if (do_bc && ((br ^ tp->last_br) | (co ^ tp->last_co)))
+	for (i = 0; i < 256; i++) bc_table[i] = i;
+	if (do_bc)
 	{
-		int i, j;
-
-		tp->last_br = br; tp->last_co = co;
 		for (i = 0; i < 256; i++)
 		{
 			j = ((i + i - 255) * co + (255 * 256)) / 2 + br;
-			tp->bc_table[i] = j < 0 ? 0 : j > (255 * 256) ? 255 : j >> 8;
+			bc_table[i] = j < 0 ? 0 : j > (255 * 256) ? 255 : j >> 8;
 		}
 	}
 	if (dH)
@@ -2343,136 +2858,305 @@ void do_transform(int start, int step, int cnt, unsigned char *mask,
 			dc = dc < 4 ? dc + 2 : 0;
 		}
 	}
-	ix0 = ixx[dc]; ix1 = ixx[dc + 1]; ix2 = ixx[dc + 2];
-
-	/* Use fake mask if no real one provided */
-	if (!mask) mask = &fmask , mstep = 0;
-	else mask += start - step , mstep = step;
 
-	start *= 3; step *= 3; // Step by triples
-	img0 += start - step;
-	imgr += start - step;
-	while (cnt-- > 0)
+	/* Hue shifts by multiples of 120 degrees just swap channels */
+	tp->ops = ops; tp->sa = sa;
+	tp->dH = dH; tp->sH = sH; tp->dc = dc;
+	for (i = 0; i < 3; i++) tp->src[i] = ixx[dc + i];
+	tp->mode = dH ? XF_HUE : sa ? XF_SAT : XF_LUT;
+	memcpy(tp->post, ps_table, 256);
+	if (dH) /* Hue needs gamma-corrected values, and goes before the rest */
 	{
-		img0 += step; imgr += step; mask += mstep;
-		if (*mask == (unsigned char)m0) continue;
-		rgb[0] = img0[0];
-		rgb[1] = img0[1];
-		rgb[2] = img0[2];
-		/* If we do gamma transform */
-		if (do_gamma)
-		{
-			rgb[0] = tp->gamma_table[rgb[0]];
-			rgb[1] = tp->gamma_table[rgb[1]];
-			rgb[2] = tp->gamma_table[rgb[2]];
-		}
-		/* If we do hue transform & colour has a hue */
-		if (dH && ((rgb[0] ^ rgb[1]) | (rgb[0] ^ rgb[2])))
-		{
-			/* Min. component */
-			c2 = dc;
-			if (rgb[ix2] < rgb[ix0]) c2++;
-			if (rgb[ixx[c2]] >= rgb[ixx[c2 + 1]]) c2++;
-			/* Actual indices */
-			c2 = ixx[c2];
-			c0 = ixx[c2 + 1];
-			c1 = ixx[c2 + 2];
+		memcpy(tp->pre, gamma_table, 256);
+		memcpy(tp->mid, bc_table, 256);
+	}
+	else for (i = 0; i < 256; i++) tp->pre[i] = bc_table[gamma_table[i]];
 
-			/* Max. component & edge dir */
-			if ((tH = rgb[c0] <= rgb[c1]))
-			{
-				c0 = ixx[c2 + 2];
-				c1 = ixx[c2 + 1];
-			}
-			/* Do adjustment */
-			j = dH * (rgb[c0] - rgb[c2]) + 127; /* Round up (?) */
-			j = (j + (j >> 8) + 1) >> 8;
-			r = rgb[c0]; g = rgb[c1]; b = rgb[c2];
-			if (tH ^ sH) /* Falling edge */
-			{
-				rgb[c1] = r = g > j + b ? g - j : b;
-				rgb[c2] += j + r - g;
-			}
-			else /* Rising edge */
-			{
-				rgb[c1] = b = g < r - j ? g + j : r;
-				rgb[c0] -= j + g - b;
-			}
-		}
-		r = rgb[ix0];
-		g = rgb[ix1];
-		b = rgb[ix2];
-		/* If we do brightness/contrast transform */
-		if (do_bc)
-		{
-			r = tp->bc_table[r];
-			g = tp->bc_table[g];
-			b = tp->bc_table[b];
-		}
-		/* If we do saturation transform */
-		if (sa)
-		{
-			j = (299 * r + 587 * g + 114 * b) / 1000;
-			r = r * 256 + (r - j) * sa;
-			r = r < 0 ? 0 : r > (255 * 256) ? 255 : r >> 8;
-			g = g * 256 + (g - j) * sa;
-			g = g < 0 ? 0 : g > (255 * 256) ? 255 : g >> 8;
-			b = b * 256 + (b - j) * sa;
-			b = b < 0 ? 0 : b > (255 * 256) ? 255 : b >> 8;
-		}
-		/* If we do posterize transform */
-		if (do_ps)
-		{
-			r = tp->ps_table[r];
-			g = tp->ps_table[g];
-			b = tp->ps_table[b];
-		}
-		/* If we do channel masking */
-		if (ops)
+	/* Fold everything into per-channel tables */
+	if (tp->mode == XF_LUT) for (k = 0; k < 3; k++ , ops >>= 8)
+	{
+		if (ops & 1) /* Channel stays as it was */
 		{
-			r ^= (r ^ img0[0]) & ops;
-			g ^= (g ^ img0[1]) & (ops >> 8);
-			b ^= (b ^ img0[2]) & (ops >> 16);
+			tp->src[k] = k;
+			for (i = 0; i < 256; i++) tp->lut[k][i] = i;
 		}
-		imgr[0] = r;
-		imgr[1] = g;
-		imgr[2] = b;
+		else for (i = 0; i < 256; i++)
+			tp->lut[k][i] = ps_table[tp->pre[i]];
 	}
-}
 
-static unsigned char pal_dupes[256];
+	/* Mark the plan usable only once it is complete */
+	tp->t = *mp;
+	tp->valid = TRUE;
+	return (tp);
+}
 
-int scan_duplicates()	// Find duplicate palette colours, return number found
+/* Hue shift for one pixel, from gamma-corrected values to unpermuted ones */
+static void hue_pixel(transform_plan *tp, unsigned char *rgb)
 {
-	int i, j, c, found, pmap[256];
+	int j, r, g, b, c0, c1, c2, tH, dc = tp->dc;
 
-	for (i = 0; i < mem_cols; i++)
-		pmap[i] = PNG_2_INT(mem_pal[i]);
-	/* Transparent color is different from any normal one */
-	if (mem_xpm_trans >= 0) pmap[mem_xpm_trans] = -1;
+	/* Only if the colour has a hue */
+	if (!((rgb[0] ^ rgb[1]) | (rgb[0] ^ rgb[2]))) return;
 
-	for (found = 0 , i = mem_cols - 1; i >= 0; i--)
+	/* Min. component */
+	c2 = dc;
+	if (rgb[ixx[dc + 2]] < rgb[ixx[dc]]) c2++;
+	if (rgb[ixx[c2]] >= rgb[ixx[c2 + 1]]) c2++;
+	/* Actual indices */
+	c2 = ixx[c2];
+	c0 = ixx[c2 + 1];
+	c1 = ixx[c2 + 2];
+
+	/* Max. component & edge dir */
+	if ((tH = rgb[c0] <= rgb[c1]))
 	{
-		c = pmap[i];
-		for (j = 0; pmap[j] != c; j++);
-		pal_dupes[i] = j;
-		found += i != j;
+		c0 = ixx[c2 + 2];
+		c1 = ixx[c2 + 1];
+	}
+	/* Do adjustment */
+	j = tp->dH * (rgb[c0] - rgb[c2]) + 127; /* Round up (?) */
+	j = (j + (j >> 8) + 1) >> 8;
+	r = rgb[c0]; g = rgb[c1]; b = rgb[c2];
+	if (tH ^ tp->sH) /* Falling edge */
+	{
+		rgb[c1] = r = g > j + b ? g - j : b;
+		rgb[c2] += j + r - g;
+	}
+	else /* Rising edge */
+	{
+		rgb[c1] = b = g < r - j ? g + j : r;
+		rgb[c0] -= j + g - b;
 	}
-
-	return (found);
 }
 
-void remove_duplicates()	// Remove duplicate palette colours - call AFTER scan_duplicates
+#ifndef HAVE_X86_SIMD
+
+/* Saturation for a block of pixels: XF_BLOCK reds, then greens, then blues */
+static void sat_block(short *rgb, int sa)
 {
-	do_xlate(pal_dupes, mem_img[CHN_IMAGE], mem_width * mem_height);
+	int i, j, r, g, b;
+
+	for (i = 0; i < XF_BLOCK; i++)
+	{
+		r = rgb[i]; g = rgb[i + XF_BLOCK]; b = rgb[i + XF_BLOCK * 2];
+		j = (299 * r + 587 * g + 114 * b) / 1000;
+		r = r * 256 + (r - j) * sa;
+		rgb[i] = r < 0 ? 0 : r > (255 * 256) ? 255 : r >> 8;
+		g = g * 256 + (g - j) * sa;
+		rgb[i + XF_BLOCK] = g < 0 ? 0 : g > (255 * 256) ? 255 : g >> 8;
+		b = b * 256 + (b - j) * sa;
+		rgb[i + XF_BLOCK * 2] = b < 0 ? 0 : b > (255 * 256) ? 255 : b >> 8;
+	}
 }
 
-int mem_remove_unused_check()
+#else /* HAVE_X86_SIMD */
+
+/* Saturation for a block of pixels: XF_BLOCK reds, then greens, then blues;
+ * all 8 pixels at once, and exact, as float division by 1000 can't round a
+ * 24-bit integer's quotient up to the next integer */
+static void sat_block_sse2(short *rgb, int sa)
 {
-	int i, found = 0;
+	__m128i r = _mm_load_si128((__m128i *)rgb);
+	__m128i g = _mm_load_si128((__m128i *)(rgb + XF_BLOCK));
+	__m128i b = _mm_load_si128((__m128i *)(rgb + XF_BLOCK * 2));
+	__m128i z = _mm_setzero_si128(), top = _mm_set1_epi16(255);
+	__m128i krg = _mm_unpacklo_epi16(_mm_set1_epi16(299), _mm_set1_epi16(587));
+	__m128i kb = _mm_unpacklo_epi16(_mm_set1_epi16(114), z);
+	__m128i ks = _mm_unpacklo_epi16(_mm_set1_epi16(256), _mm_set1_epi16(sa));
+	__m128 d = _mm_set1_ps(1000.0f);
+	__m128i l0, l1, j, v, *dest = (__m128i *)rgb;
+	int i;
 
-	mem_get_histogram(CHN_IMAGE);
-	for (i = 0; i < mem_cols; i++)
+	/* Luminance */
+	l0 = _mm_add_epi32(_mm_madd_epi16(_mm_unpacklo_epi16(r, g), krg),
+		_mm_madd_epi16(_mm_unpacklo_epi16(b, z), kb));
+	l1 = _mm_add_epi32(_mm_madd_epi16(_mm_unpackhi_epi16(r, g), krg),
+		_mm_madd_epi16(_mm_unpackhi_epi16(b, z), kb));
+	l0 = _mm_cvttps_epi32(_mm_div_ps(_mm_cvtepi32_ps(l0), d));
+	l1 = _mm_cvttps_epi32(_mm_div_ps(_mm_cvtepi32_ps(l1), d));
+	j = _mm_packs_epi32(l0, l1);
+
+	/* Push components away from it */
+	for (i = 0; i < 3; i++)
+	{
+		v = i == 0 ? r : i == 1 ? g : b;
+		l0 = _mm_unpacklo_epi16(v, _mm_sub_epi16(v, j));
+		l1 = _mm_unpackhi_epi16(v, _mm_sub_epi16(v, j));
+		l0 = _mm_srai_epi32(_mm_madd_epi16(l0, ks), 8);
+		l1 = _mm_srai_epi32(_mm_madd_epi16(l1, ks), 8);
+		v = _mm_packs_epi32(l0, l1);
+		_mm_store_si128(dest + i, _mm_min_epi16(_mm_max_epi16(v, z), top));
+	}
+}
+
+#endif /* HAVE_X86_SIMD */
+
+void do_transform(int start, int step, int cnt, unsigned char *mask,
+	unsigned char *imgr, unsigned char *img0, int m0)
+{
+	static unsigned char fmask = 255;
+	transform_plan *tp = transform_prepare(m0 > 255);
+	unsigned char *tmp, *tmi, *l0, *l1, *l2, rgb[3];
+	int i, n, ops, mstep, s0, s1, s2, r, g, b;
+
+	m0 = (unsigned char)m0;
+	/* Use fake mask if no real one provided */
+	if (!mask) mask = &fmask , mstep = 0;
+	else mask += start , mstep = step;
+
+	img0 += start * 3; imgr += start * 3;
+	step *= 3; // Step by triples
+	s0 = tp->src[0]; s1 = tp->src[1]; s2 = tp->src[2];
+
+	if (tp->mode == XF_LUT)
+	{
+		l0 = tp->lut[0]; l1 = tp->lut[1]; l2 = tp->lut[2];
+		for (; cnt-- > 0; img0 += step , imgr += step , mask += mstep)
+		{
+			if (*mask == m0) continue;
+			r = l0[img0[s0]];
+			g = l1[img0[s1]];
+			b = l2[img0[s2]];
+			imgr[0] = r;
+			imgr[1] = g;
+			imgr[2] = b;
+		}
+		return;
+	}
+
+	/* Do pixels by blocks, to do saturation on all of them at once */
+	ops = tp->ops;
+	while (cnt > 0)
+	{
+		short buf[XF_BLOCK * 3 + 8], *wrk = ALIGNED(buf, 16);
+
+		n = cnt < XF_BLOCK ? cnt : XF_BLOCK;
+		memset(wrk, 0, XF_BLOCK * 3 * sizeof(short));
+		for (i = 0 , tmi = img0; i < n; i++ , tmi += step)
+		{
+			rgb[0] = tp->pre[tmi[0]];
+			rgb[1] = tp->pre[tmi[1]];
+			rgb[2] = tp->pre[tmi[2]];
+			if (tp->mode == XF_HUE)
+			{
+				hue_pixel(tp, rgb);
+				rgb[0] = tp->mid[rgb[0]];
+				rgb[1] = tp->mid[rgb[1]];
+				rgb[2] = tp->mid[rgb[2]];
+			}
+			wrk[i] = rgb[s0];
+			wrk[i + XF_BLOCK] = rgb[s1];
+			wrk[i + XF_BLOCK * 2] = rgb[s2];
+		}
+		if (tp->sa)
+#ifdef HAVE_X86_SIMD
+			sat_block_sse2(wrk, tp->sa);
+#else
+			sat_block(wrk, tp->sa);
+#endif
+		for (i = 0; i < n; i++ , img0 += step , mask += mstep)
+		{
+			tmp = imgr + i * step;
+			if (*mask == m0) continue;
+			r = tp->post[wrk[i]];
+			g = tp->post[wrk[i + XF_BLOCK]];
+			b = tp->post[wrk[i + XF_BLOCK * 2]];
+			/* If we do channel masking */
+			if (ops)
+			{
+				r ^= (r ^ img0[0]) & ops;
+				g ^= (g ^ img0[1]) & (ops >> 8);
+				b ^= (b ^ img0[2]) & (ops >> 16);
+			}
+			tmp[0] = r;
+			tmp[1] = g;
+			tmp[2] = b;
+		}
+		imgr += n * step;
+		cnt -= n;
+	}
+}
+
+typedef struct {
+	unsigned char *img, *mask0;	// Image & mask channel
+	unsigned char *mask, *xbuf;	// Row buffers
+	int w;
+} xform_data;
+
+static void do_transform_rows(tcb *thread)
+{
+	xform_data *xd = thread->data;
+	unsigned char *tmp, *mask0 = NULL;
+	int n, w = xd->w, y = thread->step0;
+
+	tmp = xd->img + y * w * 3;
+	if (xd->mask0) mask0 = xd->mask0 + y * w;
+	for (n = thread->nsteps; n > 0; n--)
+	{
+		prep_mask(0, 1, w, xd->mask, mask0, tmp);
+		do_transform(0, 1, w, xd->mask, xd->xbuf, tmp, 255);
+		process_img(0, 1, w, xd->mask, tmp, tmp, xd->xbuf,
+			NULL, 3, BLENDF_SET | BLENDF_INVM);
+		if (mask0) mask0 += w;
+		tmp += w * 3;
+	}
+	thread_done(thread);
+}
+
+/* Apply color transform to the RGB image, honoring the mask */
+int mem_transform_image(unsigned char *mask0)
+{
+	xform_data xd;
+	threaddata *tdata;
+
+	/* Compile the plan once, before threads start using it */
+	transform_prepare(FALSE);
+
+	xd.img = mem_img[CHN_IMAGE];
+	xd.mask0 = mask0;
+	xd.w = mem_width;
+	tdata = talloc(0, image_threads(mem_width, mem_height), &xd, sizeof(xd),
+		NULL, &xd.mask, mem_width, &xd.xbuf, mem_width * 3, NULL);
+	if (!tdata) return (1);
+	tdata->silent = TRUE;
+	launch_threads(do_transform_rows, tdata, NULL, mem_height);
+	free(tdata);
+	return (0);
+}
+
+static unsigned char pal_dupes[256];
+
+int scan_duplicates()	// Find duplicate palette colours, return number found
+{
+	int i, j, c, found, pmap[256];
+
+	for (i = 0; i < mem_cols; i++)
+		pmap[i] = PNG_2_INT(mem_pal[i]);
+	/* Transparent color is different from any normal one */
+	if (mem_xpm_trans >= 0) pmap[mem_xpm_trans] = -1;
+
+	for (found = 0 , i = mem_cols - 1; i >= 0; i--)
+	{
+		c = pmap[i];
+		for (j = 0; pmap[j] != c; j++);
+		pal_dupes[i] = j;
+		found += i != j;
+	}
+
+	return (found);
+}
+
+void remove_duplicates()	// Remove duplicate palette colours - call AFTER scan_duplicates
+{
+	do_xlate(pal_dupes, mem_img[CHN_IMAGE], mem_width * mem_height);
+}
+
+int mem_remove_unused_check()
+{
+	int i, found = 0;
+
+	mem_get_histogram(CHN_IMAGE);
+	for (i = 0; i < mem_cols; i++)
 		if (!mem_histogram[i]) found++;
 
 	if (!found) return 0;	// All palette colours are used on the canvas
@@ -2571,6 +3255,25 @@ void do_convert_rgb(int start, int step, int cnt, unsigned char *dest,
 	}
 }
 
+/* Open-addressing hash of RGB colours, for finding them in a list; as lists
+ * hold at most 1024 colours, a table this small beats the 2Mb colour cube of
+ * mem_count_all_cols_real() - it stays in cache, and clearing it for each
+ * animation frame or stripe costs next to nothing */
+
+#define COLHASH_BITS 11
+#define COLHASH_SIZE (1 << COLHASH_BITS) /* More than twice the list size */
+
+/* Return pointer to slot holding colour's list index + 1, or empty slot */
+static inline int *colhash_slot(int *hash, int *list, int pix)
+{
+	int i, j;
+
+	i = ((guint32)pix * 0x9E3779B1U) >> (32 - COLHASH_BITS);
+	while ((j = hash[i]) && (list[j - 1] != pix))
+		i = (i + 1) & (COLHASH_SIZE - 1);
+	return (hash + i);
+}
+
 // Convert colours list into palette
 void mem_cols_found(png_color *userpal)
 {
@@ -2589,19 +3292,25 @@ void mem_cols_found(png_color *userpal)
 int mem_convert_indexed()
 {
 	unsigned char *old_image, *new_image;
-	int i, j, k, pix;
+	int hash[COLHASH_SIZE], *slot;
+	int i, j, k;
+
+	/* Hash the palette, letting first of duplicate colours win */
+	memset(hash, 0, sizeof(hash));
+	for (i = 0; i < 256; i++)
+	{
+		slot = colhash_slot(hash, found, found[i]);
+		if (!*slot) *slot = i + 1;
+	}
 
 	old_image = mem_undo_previous(CHN_IMAGE);
 	new_image = mem_img[CHN_IMAGE];
 	j = mem_width * mem_height;
 	for (i = 0; i < j; i++)
 	{
-		pix = MEM_2_INT(old_image, 0);
-		for (k = 0; k < 256; k++)	// Find index of this RGB
-		{
-			if (found[k] == pix) break;
-		}
-		if (k > 255) return (1);	// No index found - BAD ERROR!!
+		// Find index of this RGB
+		k = *colhash_slot(hash, found, MEM_2_INT(old_image, 0)) - 1;
+		if (k < 0) return (1);	// No index found - BAD ERROR!!
 		*new_image++ = k;
 		old_image += 3;
 	}
@@ -2917,24 +3626,158 @@ static const distance_func distance_3d[NUM_DISTANCES] = {
 	distance_linf, distance_l1, distance_l2
 };
 
+/* Squared L2, for when it is what is compared */
+static double REGPARM2 distance_l2sq(const double *v0, const double *v1)
+{
+	return ((v0[0] - v1[0]) * (v0[0] - v1[0]) +
+		(v0[1] - v1[1]) * (v0[1] - v1[1]) +
+		(v0[2] - v1[2]) * (v0[2] - v1[2]));
+}
+
+/* Palette index keeps colours sorted by their first coordinate; the search
+ * goes outward from the point's own, and stops when that coordinate alone is
+ * farther than the best match. With any of the distances above, it returns
+ * the same colour as a linear search, including the lowest index on ties */
+
+typedef struct {
+	double xyz[256 * 3];	// Colour coords
+	double x0[256];		// First coords, ascending
+	int idx[256];		// Palette indices, in that order
+	int n;
+} palindex;
+
+static void palindex_build(palindex *pi, int n)
+{
+	double v;
+	int i, j;
+
+	/* Insertion sort is fast enough for 256 */
+	for (i = 0; i < n; i++)
+	{
+		v = pi->xyz[i * 3];
+		for (j = i; (j > 0) && (pi->x0[j - 1] > v); j--)
+		{
+			pi->x0[j] = pi->x0[j - 1];
+			pi->idx[j] = pi->idx[j - 1];
+		}
+		pi->x0[j] = v;
+		pi->idx[j] = i;
+	}
+	pi->n = n;
+}
+
+static int palindex_find(palindex *pi, const double *xyz, double d,
+	distance_func dist, int sq)
+{
+	double td, dl, dr, x = xyz[0];
+	int i, j, k, n = pi->n, res = 0;
+
+	/* Find where the point goes */
+	for (i = 0 , j = n; i < j; )
+	{
+		k = (i + j) >> 1;
+		if (pi->x0[k] < x) i = k + 1;
+		else j = k;
+	}
+	/* Go both ways from there, nearest first */
+	for (i--; TRUE; )
+	{
+		dl = i >= 0 ? x - pi->x0[i] : -1.0;
+		dr = j < n ? pi->x0[j] - x : -1.0;
+		if ((dl < 0.0) || ((dr >= 0.0) && (dr < dl))) dl = dr , k = j++;
+		else k = i--;
+		if ((dl < 0.0) || ((sq ? dl * dl : dl) > d)) break;
+		k = pi->idx[k];
+		td = dist(xyz, pi->xyz + k * 3);
+		if ((td < d) || ((td == d) && (k < res))) d = td , res = k;
+	}
+	return (res);
+}
+
+/* Palette is remembered along with settings, to tell when a cache built for
+ * them can be reused */
+
+typedef struct {
+	int n, mode;
+	png_color pal[256];
+} palkey;
+
+static int palkey_same(palkey *key, png_color *pal, int n, int mode)
+{
+	int res = (key->n == n) && (key->mode == mode) &&
+		!memcmp(key->pal, pal, n * sizeof(png_color));
+
+	key->n = n;
+	key->mode = mode;
+	memcpy(key->pal, pal, n * sizeof(png_color));
+	return (res);
+}
+
+/* Index a palette in plain or gamma corrected RGB; reuse the last index made
+ * if palette is the same */
+static palindex *pal_index_rgb(png_color *pal, int n, int gc)
+{
+	static palindex pis[2];
+	static palkey keys[2];
+	palindex *pi = pis + !!gc;
+	double *tmp = pi->xyz;
+	int i;
+
+	if (palkey_same(keys + !!gc, pal, n, 0)) return (pi);
+	for (i = 0; i < n; i++ , tmp += 3)
+	{
+		if (gc)
+		{
+			tmp[0] = gamma256[pal[i].red];
+			tmp[1] = gamma256[pal[i].green];
+			tmp[2] = gamma256[pal[i].blue];
+		}
+		else
+		{
+			tmp[0] = pal[i].red;
+			tmp[1] = pal[i].green;
+			tmp[2] = pal[i].blue;
+		}
+	}
+	palindex_build(pi, n);
+	return (pi);
+}
+
 /* Dithering works with 6-bit colours, because hardware VGA palette is 6-bit,
  * and any kind of dithering is imprecise by definition anyway - WJ */
 
 typedef struct {
-	double xyz256[768], gamma[256 * 2], lin[256 * 2];
+	palindex pi;
+	double gamma[256 * 2], lin[256 * 2];
 	int cspace, cdist, ncols;
 	guint32 xcmap[64 * 64 * 2 + 128 * 2]; /* Cache bitmap */
 	guint32 lcmap[64 * 64 * 2]; /* Extension bitmap */
 	unsigned char cmap[64 * 64 * 64 + 128 * 64]; /* Index cache */
 } ctable;
 
-static ctable *ctp;
+static ctable *dither_cache;	// Colours found by last mem_dither() run
+static palkey dither_key;	// Palette and settings it ran with
+
+/* Add colours found in one cache to another */
+static void ctable_merge(ctable *dest, ctable *src)
+{
+	guint32 v;
+	int i, k;
+
+	for (i = 0; i < 64 * 64 * 2 + 128 * 2; i++)
+	{
+		if (!(v = src->xcmap[i] & ~dest->xcmap[i])) continue;
+		dest->xcmap[i] |= v;
+		for (k = i * 32; v; v >>= 1 , k++)
+			if (v & 1) dest->cmap[k] = src->cmap[k];
+	}
+}
 
 /* !!! Beware of GCC misoptimizing this! The two functions below is the result
  * of much trial and error, and hopefully not VERY brittle; but still, after any
  * modification to them, compare the performance to what it was before - WJ */
 
-static int find_nearest(int col[3], int n)
+static int find_nearest(ctable *ctp, int col[3], int n)
 {
 	/* !!! Stack misalignment is a very real issue here */
 	unsigned char tmp_[4 * sizeof(double)];
@@ -2962,21 +3805,11 @@ static int find_nearest(int col[3], int n)
 	}
 
 	/* Find nearest colour */
-	{
-		const distance_func dist = distance_3d[ctp->cdist];
-		double d = 1000000000.0, td, *xyz = ctp->xyz256;
-		int i, j, l = ctp->ncols;
-
-		for (i = j = 0; i < l; i++)
-		{
-			td = dist(tmp, xyz + i * 3);
-			if (td < d) j = i , d = td;
-		}
-		return (j);
-	}
+	return (palindex_find(&ctp->pi, tmp, 1000000000.0,
+		distance_3d[ctp->cdist], FALSE));
 }
 
-static int lookup_srgb(double *srgb)
+static int lookup_srgb(ctable *ctp, double *srgb)
 {
 	int k, n = 0, col[3];
 
@@ -2996,129 +3829,118 @@ static int lookup_srgb(double *srgb)
 	if (!(ctp->xcmap[k >> 5] & (1 << (k & 31))))
 	{
 		ctp->xcmap[k >> 5] |= 1 << (k & 31);
-		ctp->cmap[k] = find_nearest(col, n);
+		ctp->cmap[k] = find_nearest(ctp, col, n);
 	}
 
 	return (ctp->cmap[k]);
 }
 
-// !!! No support for transparency yet !!!
-/* Damping functions roughly resemble old GIMP's behaviour, but may need some
- * tuning because linear sRGB is just too different from normal RGB */
-int mem_dither(unsigned char *old, int ncols, short *dither, int cspace,
-	int dist, int limit, int selc, int serpent, int rgb8b, double emult)
-{
-	int i, j, k, l, kk, j0, j1, dj, rlen, col0, col1, progress;
-	unsigned char *ddata, *src, *dest;
-	double *row0, *row1, *row2, *tmp;
-	double err, intd, extd, *gamma6, *lin6;
-	double tc0[3], tc1[3], color0[3], color1[3];
-	double fdiv = 0, gamut[6] = {1, 1, 1, 0, 0, 0};
-
-	/* Allocate working space */
-	rlen = (mem_width + 4) * 3 * sizeof(double);
-	ddata = multialloc(MA_ALIGN_DOUBLE,
-		&row0, rlen,
-		&row1, rlen,
-		&row2, rlen,
-		&ctp, sizeof(ctable),
-		NULL);
-	if (!ddata) return (1);
+/* Error diffusion is done by a wavefront of threads, each taking the next
+ * unclaimed row and following the one above it by a few pixels. Every pixel
+ * of a row receives error from 5 pixels of the row above, and the lag keeps
+ * those additions in the same order as in one-pass processing, so that the
+ * results do not depend on the number of threads. Serpentine scan reverses
+ * direction each row, so it cannot be overlapped and runs in one thread */
 
-	if ((progress = mem_width * mem_height > 1000000))
-		progress_init(_("Converting to Indexed Palette"), 0);
+#define DITHER_LAG 4	/* Pixels of lag behind previous row, besides one */
+#define DITHER_STEP 16	/* Pixels between progress reports */
 
-	/* Preprocess palette to find whether to extend precision and where */
-	for (i = 0; i < ncols; i++)
-	{
-		j = ((mem_pal[i].red & 0xFC) << 10) +
-			((mem_pal[i].green & 0xFC) << 4) +
-			(mem_pal[i].blue >> 2);
-		if (!(l = ctp->cmap[j]))
-		{
-			ctp->cmap[j] = l = i + 1;
-			ctp->xcmap[l * 4 + 2] = j;
-		}
-		k = ((mem_pal[i].red & 3) << 4) +
-			((mem_pal[i].green & 3) << 2) +
-			(mem_pal[i].blue & 3);
-		ctp->xcmap[l * 4 + (k & 1)] |= 1 << (k >> 1);
-	}
-	memset(ctp->cmap, 0, 64 * 64 * 64);
-	for (k = 0 , i = 4; i < 256 * 4; i += 4)
-	{
-		guint32 v = ctp->xcmap[i] | ctp->xcmap[i + 1];
-		/* Are 2+ colors there somewhere? */
-		if (!((v & (v - 1)) | (ctp->xcmap[i] & ctp->xcmap[i + 1])))
-			continue;
-		rgb8b = TRUE; /* Force 8-bit precision */
-		j = ctp->xcmap[i + 2];
-		ctp->lcmap[j >> 5] |= 1 << (j & 31);
-		ctp->cmap[j] = k++;
-	}
-	memset(ctp->xcmap, 0, 257 * 4 * sizeof(guint32));
+typedef struct {
+	ctable *ct;		// Colour cache, per thread
+	double *rows;		// Error rows, "nrows" of "rlen" doubles
+	int *prog;		// Rows' progress, at (row * (width + 1) + pixels)
+	int *next;		// Next row to take
+	int *waiting;		// Threads sleeping in dither_wait()
+	unsigned char *old;	// RGB source
+	short *dither;		// Error weights, or NULL
+	double gamut[6], emult, fdiv;
+	int nrows, rlen, g6, limit, selc, serpent;
+} ditherd;
+
+/* Wait till progress grows to "need" past "base", and return how far past it
+ * it is; -1 if stopped */
+static int dither_wait(tcb *thread, ditherd *dd, int *prog, int base, int need)
+{
+	int v;
+
+	if ((v = thread_xadd(prog, 0) - base) >= need) return (v);
+	/* Sleep till some thread moves forward; the waiters count is raised
+	 * before rechecking, so dither_move() cannot miss a sleeper */
+	thread_lock();
+	thread_xadd(dd->waiting, 1);
+	while (((v = thread_xadd(prog, 0) - base) < need) && !thread->stop)
+		thread_wait();
+	thread_xadd(dd->waiting, -1);
+	thread_unlock();
+	return (v < need ? -1 : v);
+}
+
+/* Advance progress, and wake up whoever may be waiting for it */
+static void dither_move(ditherd *dd, int *prog, int n)
+{
+	thread_xadd(prog, n);
+	if (!thread_xadd(dd->waiting, 0)) return;
+	thread_lock();
+	thread_wake();
+	thread_unlock();
+}
+
+static void do_dither(tcb *thread)
+{
+	ditherd *dd = thread->data;
+	ctable *ctp = dd->ct;
+	short *dither = dd->dither;
+	unsigned char *src, *dest;
+	double *row0, *row1, *row2, *gamma6 = ctp->gamma + dd->g6;
+	double err, intd, extd, emult = dd->emult, fdiv = dd->fdiv;
+	double tc0[3], tc1[3], color0[3], color1[3], gamut[6];
+	int i, j, k, l, kk, p, j0, j1, dj, col0, col1, lim, done, cnt = 0;
+	int w = mem_width, w1 = mem_width + 1, n = dd->nrows, rlen = dd->rlen;
+	int limit = dd->limit, selc = dd->selc;
 
-	/* Prepare tables */
-	for (i = 0; i < 256; i++)
-	{
-		j = (i & 0xFC) + (i >> 6);
-		ctp->gamma[i] = gamma256[i];
-		ctp->gamma[i + 256] = gamma256[j];
-		ctp->lin[i] = i * (1.0 / 255.0);
-		ctp->lin[i + 256] = j * (1.0 / 255.0);
-	}
-	/* Keep all 8 bits of input or posterize to 6 bits? */
-	i = rgb8b ? 0 : 256;
-	gamma6 = ctp->gamma + i; lin6 = ctp->lin + i;
-	tmp = ctp->xyz256;
-	for (i = 0; i < ncols; i++ , tmp += 3)
-	{
-		/* Update gamut limits */
-		tmp[0] = gamma6[mem_pal[i].red];
-		tmp[1] = gamma6[mem_pal[i].green];
-		tmp[2] = gamma6[mem_pal[i].blue];
-		for (j = 0; j < 3; j++)
-		{
-			if (tmp[j] < gamut[j]) gamut[j] = tmp[j];
-			if (tmp[j] > gamut[j + 3]) gamut[j + 3] = tmp[j];
-		}
-		/* Store colour coords */
-		switch (cspace)
-		{
-		default:
-		case CSPACE_RGB:
-			tmp[0] = lin6[mem_pal[i].red];
-			tmp[1] = lin6[mem_pal[i].green];
-			tmp[2] = lin6[mem_pal[i].blue];
-			break;
-		case CSPACE_SRGB:
-			break; /* Done already */
-		case CSPACE_LXN:
-			rgb2LXN(tmp, tmp[0], tmp[1], tmp[2]);
-			break;
-		}
-	}
-	ctp->cspace = cspace; ctp->cdist = dist; ctp->ncols = ncols;
-	serpent = serpent ? 0 : 2;
-	if (dither) fdiv = 1.0 / *dither++;
+	memcpy(gamut, dd->gamut, sizeof(gamut));
 
-	/* Process image */
-	for (i = 0; i < mem_height; i++)
+	while ((i = thread_xadd(dd->next, 1)) < mem_height)
 	{
-		src = old + i * mem_width * 3;
+		src = dd->old + i * mem_width * 3;
 		dest = mem_img[CHN_IMAGE] + i * mem_width;
-		memset(row2, 0, rlen);
-		if (serpent ^= 1)
+		row0 = dd->rows + (i % n) * rlen;
+		row1 = dd->rows + ((i + 1) % n) * rlen;
+		row2 = dd->rows + ((i + 2) % n) * rlen;
+		/* Row "i + 2 - n" must be done with the buffer being reused */
+		if (dither_wait(thread, dd, dd->prog + (i + 2) % n,
+			(i + 2 - n) * w1, w) < 0) return;
+		memset(row2, 0, rlen * sizeof(double));
+		/* Claim own progress slot, left at "row i - n done" */
+		dither_move(dd, dd->prog + i % n, n * w1 - w);
+		if (dd->serpent && (i & 1))
 		{
-			j0 = 0; j1 = mem_width * 3; dj = 1;
+			j0 = (mem_width - 1) * 3; j1 = -3; dj = -1;
+			dest += mem_width - 1;
 		}
 		else
 		{
-			j0 = (mem_width - 1) * 3; j1 = -3; dj = -1;
-			dest += mem_width - 1;
+			j0 = 0; j1 = mem_width * 3; dj = 1;
 		}
-		for (j = j0; j != j1; j += dj * 3)
+		lim = dither ? 0 : w;
+		for (j = j0 , p = done = 0; j != j1; j += dj * 3 , p++)
 		{
+			/* Stay behind the previous row */
+			if (p >= lim)
+			{
+				k = p + DITHER_LAG + 1;
+				if (k > w) k = w;
+				k = dither_wait(thread, dd,
+					dd->prog + (i + n - 1) % n, (i - 1) * w1, k);
+				if (k < 0) return;
+				lim = k < w ? k - DITHER_LAG : w;
+			}
+			/* Let the next row follow */
+			if (p - done >= DITHER_STEP)
+			{
+				dither_move(dd, dd->prog + i % n, p - done);
+				done = p;
+			}
 			for (k = 0; k < 3; k++)
 			{
 				/* Posterize to 6 bits as natural for palette */
@@ -3143,7 +3965,7 @@ int mem_dither(unsigned char *old, int ncols, short *dither, int cspace,
 				if (color1[k] > gamut[k + 3]) color1[k] = gamut[k + 3];
 			}
 			/* Output best colour */
-			col1 = lookup_srgb(color1);
+			col1 = lookup_srgb(ctp, color1);
 			*dest = col1;
 			dest += dj;
 			if (!dither) continue;
@@ -3153,7 +3975,7 @@ int mem_dither(unsigned char *old, int ncols, short *dither, int cspace,
 			tc1[2] = gamma6[mem_pal[col1].blue];
 			if (selc) /* Selective error damping */
 			{
-				col0 = lookup_srgb(color0);
+				col0 = lookup_srgb(ctp, color0);
 				tc0[0] = gamma6[mem_pal[col0].red];
 				tc0[1] = gamma6[mem_pal[col0].green];
 				tc0[2] = gamma6[mem_pal[col0].blue];
@@ -3216,13 +4038,165 @@ int mem_dither(unsigned char *old, int ncols, short *dither, int cspace,
 				}
 			}
 		}
-		tmp = row0; row0 = row1; row1 = row2; row2 = tmp;
-		if (progress && (i * 10) % mem_height >= mem_height - 10)
-			progress_update((float)(i + 1) / mem_height);
+		dither_move(dd, dd->prog + i % n, w - done);
+		if (thread_step(thread, ++cnt, mem_height, 10)) break;
 	}
+	thread_done(thread);
+}
+
+// !!! No support for transparency yet !!!
+/* Damping functions roughly resemble old GIMP's behaviour, but may need some
+ * tuning because linear sRGB is just too different from normal RGB */
+int mem_dither(unsigned char *old, int ncols, short *dither, int cspace,
+	int dist, int limit, int selc, int serpent, int rgb8b, double emult)
+{
+	ditherd dd;
+	threaddata *tdata;
+	ctable *ctp;
+	int i, j, k, l, nt, progress;
+	double *tmp, *gamma6, *lin6, *gamut = dd.gamut;
+
+	/* Serpentine error diffusion is strictly sequential */
+	nt = serpent && dither ? 1 : image_threads(mem_width, mem_height);
+
+	/* Allocate working space */
+	memset(&dd, 0, sizeof(dd));
+	dd.nrows = nt + 2;
+	dd.rlen = (mem_width + 4) * 3;
+	tdata = talloc(MA_ALIGN_DOUBLE, nt, &dd, sizeof(dd),
+		&dd.rows, dd.nrows * dd.rlen * sizeof(double),
+		&dd.prog, (dd.nrows + 2) * sizeof(int),
+		NULL,
+		&dd.ct, sizeof(ctable),
+		NULL);
+	if (!tdata) return (1);
+	ctp = dd.ct;
+
+	if ((progress = mem_width * mem_height > 1000000))
+		progress_init(_("Converting to Indexed Palette"), 0);
+
+	/* Preprocess palette to find whether to extend precision and where */
+	memset(ctp, 0, sizeof(ctable));
+	for (i = 0; i < ncols; i++)
+	{
+		j = ((mem_pal[i].red & 0xFC) << 10) +
+			((mem_pal[i].green & 0xFC) << 4) +
+			(mem_pal[i].blue >> 2);
+		if (!(l = ctp->cmap[j]))
+		{
+			ctp->cmap[j] = l = i + 1;
+			ctp->xcmap[l * 4 + 2] = j;
+		}
+		k = ((mem_pal[i].red & 3) << 4) +
+			((mem_pal[i].green & 3) << 2) +
+			(mem_pal[i].blue & 3);
+		ctp->xcmap[l * 4 + (k & 1)] |= 1 << (k >> 1);
+	}
+	memset(ctp->cmap, 0, 64 * 64 * 64);
+	for (k = 0 , i = 4; i < 256 * 4; i += 4)
+	{
+		guint32 v = ctp->xcmap[i] | ctp->xcmap[i + 1];
+		/* Are 2+ colors there somewhere? */
+		if (!((v & (v - 1)) | (ctp->xcmap[i] & ctp->xcmap[i + 1])))
+			continue;
+		rgb8b = TRUE; /* Force 8-bit precision */
+		j = ctp->xcmap[i + 2];
+		ctp->lcmap[j >> 5] |= 1 << (j & 31);
+		ctp->cmap[j] = k++;
+	}
+	memset(ctp->xcmap, 0, 257 * 4 * sizeof(guint32));
+
+	/* Prepare tables */
+	for (i = 0; i < 256; i++)
+	{
+		j = (i & 0xFC) + (i >> 6);
+		ctp->gamma[i] = gamma256[i];
+		ctp->gamma[i + 256] = gamma256[j];
+		ctp->lin[i] = i * (1.0 / 255.0);
+		ctp->lin[i + 256] = j * (1.0 / 255.0);
+	}
+	/* Keep all 8 bits of input or posterize to 6 bits? */
+	dd.g6 = i = rgb8b ? 0 : 256;
+	gamma6 = ctp->gamma + i; lin6 = ctp->lin + i;
+	tmp = ctp->pi.xyz;
+	gamut[0] = gamut[1] = gamut[2] = 1;
+	for (i = 0; i < ncols; i++ , tmp += 3)
+	{
+		/* Update gamut limits */
+		tmp[0] = gamma6[mem_pal[i].red];
+		tmp[1] = gamma6[mem_pal[i].green];
+		tmp[2] = gamma6[mem_pal[i].blue];
+		for (j = 0; j < 3; j++)
+		{
+			if (tmp[j] < gamut[j]) gamut[j] = tmp[j];
+			if (tmp[j] > gamut[j + 3]) gamut[j + 3] = tmp[j];
+		}
+		/* Store colour coords */
+		switch (cspace)
+		{
+		default:
+		case CSPACE_RGB:
+			tmp[0] = lin6[mem_pal[i].red];
+			tmp[1] = lin6[mem_pal[i].green];
+			tmp[2] = lin6[mem_pal[i].blue];
+			break;
+		case CSPACE_SRGB:
+			break; /* Done already */
+		case CSPACE_LXN:
+			rgb2LXN(tmp, tmp[0], tmp[1], tmp[2]);
+			break;
+		}
+	}
+	ctp->cspace = cspace; ctp->cdist = dist; ctp->ncols = ncols;
+	palindex_build(&ctp->pi, ncols);
+
+	/* Reuse colours found last time, if palette and settings are the same */
+	if (palkey_same(&dither_key, mem_pal, ncols,
+		(cspace * NUM_DISTANCES + dist) * 2 + !!rgb8b) && dither_cache)
+		memcpy(ctp, dither_cache, sizeof(ctable));
+
+	/* Error rows for rows 0 and 1 start out empty, and progress slots
+	 * as if rows from -nrows to -1 were done */
+	memset(dd.rows, 0, 2 * dd.rlen * sizeof(double));
+	for (i = 0; i < dd.nrows; i++)
+		dd.prog[i] = (i - dd.nrows) * (mem_width + 1) + mem_width;
+	dd.next = dd.prog + dd.nrows;
+	*dd.next = 0;
+	dd.waiting = dd.next + 1;
+	*dd.waiting = 0;
+	dd.old = old;
+	dd.limit = limit;
+	dd.selc = selc;
+	dd.serpent = serpent;
+	dd.emult = emult;
+	if (dither) dd.fdiv = 1.0 / *dither++;
+	dd.dither = dither;
+
+	/* Give every thread the same parameters and own copy of cache */
+	for (i = 0; i < tdata->count; i++)
+	{
+		ditherd *tdd = tdata->threads[i]->data;
+		ctable *ct = tdd->ct;
+
+		*tdd = dd;
+		tdd->ct = ct;
+		if (ct != ctp) memcpy(ct, ctp, sizeof(ctable));
+	}
+
+	launch_threads(do_dither, tdata, NULL, mem_height);
+
+	/* Keep all the colours found, for next time */
+	if (!dither_cache) dither_cache = malloc(sizeof(ctable));
+	if (dither_cache)
+	{
+		memcpy(dither_cache, ctp, sizeof(ctable));
+		for (i = 1; i < tdata->count; i++) ctable_merge(dither_cache,
+			((ditherd *)tdata->threads[i]->data)->ct);
+	}
+	else dither_key.n = -1; // Invalidate
 
 	if (progress) progress_end();
-	free(ddata);
+	free(tdata);
 	return (0);
 }
 
@@ -3232,10 +4206,11 @@ int mem_dither(unsigned char *old, int ncols, short *dither, int cspace,
 int mem_dumb_dither(unsigned char *old, unsigned char *new, png_color *pal,
 	int width, int height, int ncols, int dither)
 {
-	unsigned short cols[32768], sqrtb[512], *sqr;
+	unsigned short cols[32768];
 	short limtb[512], *lim, fr[3] = {0, 0, 0};
 	short *rows = NULL, *row0 = fr, *row1 = fr;
 	unsigned char clamp[768], *src, *dest;
+	palindex *pi;
 	int i, j, k, j0, dj, dj3, r, g, b, rlen, serpent = 2;
 
 	/* Allocate working space */
@@ -3247,10 +4222,9 @@ int mem_dumb_dither(unsigned char *old, unsigned char *new, png_color *pal,
 		serpent = 0;
 	}
 
-	/* Color cache, squares table, clamp table */
+	/* Color cache, palette index, clamp table */
 	memset(cols, 0, sizeof(cols));
-	sqr = sqrtb + 256;
-	for (i = -255; i < 256; i++) sqr[i] = i * i;
+	pi = pal_index_rgb(pal, ncols, FALSE);
 	memset(clamp, 0, 256);
 	memset(clamp + 512, 255, 256);
 	for (i = 0; i < 256; i++) clamp[i + 256] = i;
@@ -3294,20 +4268,14 @@ int mem_dumb_dither(unsigned char *old, unsigned char *new, png_color *pal,
 			k = ((r & 0xF8) << 7) + ((g & 0xF8) << 2) + (b >> 3);
 			if (!cols[k]) /* Find nearest color in RGB */
 			{
-				int i, j, n = 0, l = 1000000;
+				double rgb[3];
 
 /* Searching for color nearest to first color in cell, instead of to cell
  * itself, looks like a bug, but works like a feature - makes FS dither less
  * prone to patterning. This trick I learned from Dennis Lee's code - WJ */
-				for (i = 0; i < ncols; i++)
-				{
-					j = sqr[r - pal[i].red] +
-						sqr[g - pal[i].green] +
-						sqr[b - pal[i].blue];
-					if (j >= l) continue;
-					l = j; n = i;
-				}
-				cols[k] = n + 1;
+				rgb[0] = r; rgb[1] = g; rgb[2] = b;
+				cols[k] = palindex_find(pi, rgb, 1000000.0,
+					distance_l2sq, TRUE) + 1;
 			}
 			*dest = k = cols[k] - 1;
 			if (!dither) continue;
@@ -3343,23 +4311,16 @@ void mem_find_dither(int red, int green, int blue)
 	int pat = 4, dp = 3;
 	int i, ix1, ix2, pn, tpn, pp2 = pat * pat * 2;
 	double r, g, b, r1, g1, b1, dr0, dg0, db0, dr, dg, db;
-	double l, l2, tl, t;
+	double l, l2, tl, t, rgb[3];
+	palindex *pi;
 
-	r = gamma256[red];
-	g = gamma256[green];
-	b = gamma256[blue];
-	l = 16.0; ix1 = 0;
+	rgb[0] = r = gamma256[red];
+	rgb[1] = g = gamma256[green];
+	rgb[2] = b = gamma256[blue];
 
-	for (i = 0; i < mem_cols; i++)
-	{
-		dr = r - gamma256[mem_pal[i].red];
-		dg = g - gamma256[mem_pal[i].green];
-		db = b - gamma256[mem_pal[i].blue];
-		tl = dr * dr + dg * dg + db * db;
-		if (tl >= l) continue;
-		l = tl;
-		ix1 = i;
-	}
+	pi = pal_index_rgb(mem_pal, mem_cols, TRUE);
+	ix1 = palindex_find(pi, rgb, 16.0, distance_l2sq, TRUE);
+	l = distance_l2sq(rgb, pi->xyz + ix1 * 3);
 
 	r1 = gamma256[mem_pal[ix1].red];
 	g1 = gamma256[mem_pal[ix1].green];
@@ -5026,7 +5987,7 @@ int mem_sel_rot( int dir )			// Rotate clipboard 90 degrees
 		buf = malloc(j * bpp);
 		if (!buf) break;	// Not enough memory
 		mem_rotate(buf, mem_clip.img[i], mem_clip_w, mem_clip_h, dir, bpp);
-		free(mem_clip.img[i]);
+		mem_chan_free(mem_clip.img[i]);
 		mem_clip.img[i] = buf;
 	}
 
@@ -5062,73 +6023,45 @@ static void mem_clear_img(chanlist img, int w, int h, int bpp)
 		if (img[k]) memset(img[k], 0, l);
 }
 
-void mem_rotate_free_real(chanlist old_img, chanlist new_img, int ow, int oh,
-	int nw, int nh, int bpp, double angle, int mode, int gcor, int dis_a,
-	int silent)
+typedef struct {
+	unsigned char **src, **dest;
+	int ow, oh, nw, nh, bpp, mode, gcor, dis_a, progress;
+	double s1, s2, c1, c2, x00, y00;
+	double sca, csa, Y00, Y0h, Yw0, Ywh, X00, Xwh;
+	unsigned char A_rgb[3];
+} rotate_context;
+
+static void do_rotate(tcb *thread)
 {
-	unsigned char *src, *dest, *alpha, A_rgb[3];
+	rotate_context *ctx = thread->data;
+	unsigned char **old_img = ctx->src, **new_img = ctx->dest;
+	unsigned char *src, *dest, *alpha, *A_rgb = ctx->A_rgb;
 	unsigned char *pix1, *pix2, *pix3, *pix4;
-	int nx, ny, ox, oy, cc;
-	double rangle = (M_PI / 180.0) * angle;	// Radians
-	double s1, s2, c1, c2;			// Trig values
-	double cx0, cy0, cx1, cy1;
-	double x00, y00, x0y, y0y;		// Quick look up values
+	int nx, ny, ox, oy, cc, ii, cnt = thread->nsteps;
+	int ow = ctx->ow, oh = ctx->oh, nw = ctx->nw, bpp = ctx->bpp;
+	int mode = ctx->mode, gcor = ctx->gcor, dis_a = ctx->dis_a;
+	double s1 = ctx->s1, s2 = ctx->s2, c1 = ctx->c1, c2 = ctx->c2;
+	double x0y, y0y;			// Quick look up values
 	double fox, foy, k1, k2, k3, k4;	// Pixel weights
 	double aa1, aa2, aa3, aa4, aa;
 	double rr, gg, bb;
-	double tw, th, ta, ca, sa, sca, csa, Y00, Y0h, Yw0, Ywh, X00, Xwh;
-
-	c2 = cos(rangle);
-	s2 = sin(rangle);
-	c1 = -s2;
-	s1 = c2;
-
-	/* Centerpoints, including half-pixel offsets */
-	cx0 = (ow - 1) / 2.0;
-	cy0 = (oh - 1) / 2.0;
-	cx1 = (nw - 1) / 2.0;
-	cy1 = (nh - 1) / 2.0;
-
-	x00 = cx0 - cx1 * s1 - cy1 * s2;
-	y00 = cy0 - cx1 * c1 - cy1 * c2;
-	A_rgb[0] = mem_col_A24.red;
-	A_rgb[1] = mem_col_A24.green;
-	A_rgb[2] = mem_col_A24.blue;
-
-	/* Prepare clipping rectangle */
-	tw = 0.5 * (ow + (mode ? 1 : 0));
-	th = 0.5 * (oh + (mode ? 1 : 0));
-	ta = M_PI * (angle / 180.0 - floor(angle / 180.0));
-	ca = cos(ta); sa = sin(ta);
-	sca = ca ? sa / ca : 0.0;
-	csa = sa ? ca / sa : 0.0;
-	Y00 = cy1 - th * ca - tw * sa;
-	Y0h = cy1 + th * ca - tw * sa;
-	Yw0 = cy1 - th * ca + tw * sa;
-	Ywh = cy1 + th * ca + tw * sa;
-	X00 = cx1 - tw * ca + th * sa;
-	Xwh = cx1 + tw * ca - th * sa;
 
-	mem_clear_img(new_img, nw, nh, bpp); /* Clear the channels */
-
-	for (ny = 0; ny < nh; ny++)
+	for (ny = thread->step0 , ii = 0; ii < cnt; ny++ , ii++)
 	{
 		int xl, xm;
-		if (!silent && ((ny * 10) % nh >= nh - 10))
-			progress_update((float)ny / nh);
 
 		/* Clip this row */
-		if (ny < Y0h) xl = ceil(X00 + (Y00 - ny) * sca);
-		else if (ny < Ywh) xl = ceil(Xwh + (ny - Ywh) * csa);
-		else /* if (ny < Yw0) */ xl = ceil(Xwh + (Ywh - ny) * sca);
-		if (ny < Y00) xm = ceil(X00 + (Y00 - ny) * sca);
-		else if (ny < Yw0) xm = ceil(X00 + (ny - Y00) * csa);
-		else /* if (ny < Ywh) */ xm = ceil(Xwh + (Ywh - ny) * sca);
+		if (ny < ctx->Y0h) xl = ceil(ctx->X00 + (ctx->Y00 - ny) * ctx->sca);
+		else if (ny < ctx->Ywh) xl = ceil(ctx->Xwh + (ny - ctx->Ywh) * ctx->csa);
+		else /* if (ny < Yw0) */ xl = ceil(ctx->Xwh + (ctx->Ywh - ny) * ctx->sca);
+		if (ny < ctx->Y00) xm = ceil(ctx->X00 + (ctx->Y00 - ny) * ctx->sca);
+		else if (ny < ctx->Yw0) xm = ceil(ctx->X00 + (ny - ctx->Y00) * ctx->csa);
+		else /* if (ny < Ywh) */ xm = ceil(ctx->Xwh + (ctx->Ywh - ny) * ctx->sca);
 		if (xl < 0) xl = 0;
 		if (--xm >= nw) xm = nw - 1;
 
-		x0y = ny * s2 + x00;
-		y0y = ny * c2 + y00;
+		x0y = ny * s2 + ctx->x00;
+		y0y = ny * c2 + ctx->y00;
 		for (cc = 0; cc < NUM_CHANNELS; cc++)
 		{
 			if (!new_img[cc]) continue;
@@ -5272,7 +6205,94 @@ void mem_rotate_free_real(chanlist old_img, chanlist new_img, int ow, int oh,
 				*dest++ = rint(aa1 + aa2 + aa3 + aa4);
 			}
 		}
+		if (ctx->progress && thread_step(thread, ii + 1, cnt, 10)) break;
+	}
+	thread_done(thread);
+}
+
+/* Allocate everything rotation needs, so that callers can do it before
+ * changing any state, and have nothing to roll back if it fails */
+static threaddata *rotate_prepare(int ow, int oh, int nw, int nh, int bpp,
+	double angle, int mode, int gcor, int dis_a, int silent)
+{
+	rotate_context ctx;
+	double rangle = (M_PI / 180.0) * angle;	// Radians
+	double cx0, cy0, cx1, cy1, tw, th, ta, ca, sa;
+
+	ctx.src = ctx.dest = NULL;
+	ctx.ow = ow;
+	ctx.oh = oh;
+	ctx.nw = nw;
+	ctx.nh = nh;
+	ctx.bpp = bpp;
+	ctx.mode = mode;
+	ctx.gcor = gcor;
+	ctx.dis_a = dis_a;
+	ctx.progress = !silent;
+
+	ctx.c2 = cos(rangle);
+	ctx.s2 = sin(rangle);
+	ctx.c1 = -ctx.s2;
+	ctx.s1 = ctx.c2;
+
+	/* Centerpoints, including half-pixel offsets */
+	cx0 = (ow - 1) / 2.0;
+	cy0 = (oh - 1) / 2.0;
+	cx1 = (nw - 1) / 2.0;
+	cy1 = (nh - 1) / 2.0;
+
+	ctx.x00 = cx0 - cx1 * ctx.s1 - cy1 * ctx.s2;
+	ctx.y00 = cy0 - cx1 * ctx.c1 - cy1 * ctx.c2;
+	ctx.A_rgb[0] = mem_col_A24.red;
+	ctx.A_rgb[1] = mem_col_A24.green;
+	ctx.A_rgb[2] = mem_col_A24.blue;
+
+	/* Prepare clipping rectangle */
+	tw = 0.5 * (ow + (mode ? 1 : 0));
+	th = 0.5 * (oh + (mode ? 1 : 0));
+	ta = M_PI * (angle / 180.0 - floor(angle / 180.0));
+	ca = cos(ta); sa = sin(ta);
+	ctx.sca = ca ? sa / ca : 0.0;
+	ctx.csa = sa ? ca / sa : 0.0;
+	ctx.Y00 = cy1 - th * ca - tw * sa;
+	ctx.Y0h = cy1 + th * ca - tw * sa;
+	ctx.Yw0 = cy1 - th * ca + tw * sa;
+	ctx.Ywh = cy1 + th * ca + tw * sa;
+	ctx.X00 = cx1 - tw * ca + th * sa;
+	ctx.Xwh = cx1 + tw * ca - th * sa;
+
+	return (talloc(0, image_threads(nw, nh), &ctx, sizeof(ctx), NULL, NULL));
+}
+
+/* Run prepared rotation, and free its data */
+static void rotate_run(threaddata *tdata, chanlist old_img, chanlist new_img)
+{
+	rotate_context *tc, *ctx = tdata->threads[0]->data;
+	int i;
+
+	for (i = 0; i < tdata->count; i++)
+	{
+		tc = tdata->threads[i]->data;
+		tc->src = old_img;
+		tc->dest = new_img;
 	}
+	mem_clear_img(new_img, ctx->nw, ctx->nh, ctx->bpp); /* Clear the channels */
+
+	/* Rows are independent, so each thread does its own stripe */
+	launch_threads(do_rotate, tdata, NULL, ctx->nh);
+	free(tdata);
+}
+
+int mem_rotate_free_real(chanlist old_img, chanlist new_img, int ow, int oh,
+	int nw, int nh, int bpp, double angle, int mode, int gcor, int dis_a,
+	int silent)
+{
+	threaddata *tdata = rotate_prepare(ow, oh, nw, nh, bpp, angle, mode,
+		gcor, dis_a, silent);
+
+	if (!tdata) return (1);
+	rotate_run(tdata, old_img, new_img);
+	return (0);
 }
 
 #define PIX_ADD (127.0 / 128.0) /* Include all _visibly_ altered pixels */
@@ -5300,6 +6320,7 @@ void mem_rotate_geometry(int ow, int oh, double angle, int *nw, int *nh)
 int mem_rotate_free(double angle, int type, int gcor, int clipboard)
 {
 	chanlist old_img, new_img;
+	threaddata *tdata;
 	int ow, oh, nw, nh, res, rot_bpp;
 
 
@@ -5321,11 +6342,20 @@ int mem_rotate_free(double angle, int type, int gcor, int clipboard)
 
 	if ( nw>MAX_WIDTH || nh>MAX_HEIGHT ) return -5;		// If new image is too big return -5
 
+	if ( rot_bpp == 1 ) type = FALSE;
+	tdata = rotate_prepare(ow, oh, nw, nh, rot_bpp, angle, type, gcor,
+		channel_dis[CHN_ALPHA] && !clipboard, clipboard);
+	if (!tdata) return (1);		// Not enough memory
+
 	if (!clipboard)
 	{
 		memcpy(old_img, mem_img, sizeof(chanlist));
 		res = undo_next_core(UC_NOCOPY, nw, nh, mem_img_bpp, CMASK_ALL);
-		if (res) return (res);		// No undo space
+		if (res)
+		{
+			free(tdata);
+			return (res);	// No undo space
+		}
 		memcpy(new_img, mem_img, sizeof(chanlist));
 		progress_init(_("Free Rotation"), 0);
 	}
@@ -5334,24 +6364,23 @@ int mem_rotate_free(double angle, int type, int gcor, int clipboard)
 		/* Note:  even if the original clipboard doesn't have a mask,
 		 * the rotation will need one to chop off the corners of
 		 * a rotated rectangle. */
-		if (!mem_clip_mask && mem_clip_mask_init(255))
+		if ((!mem_clip_mask && mem_clip_mask_init(255)) ||
+			mem_clip_new(nw, nh, mem_clip_bpp,
+			cmask_from(mem_clip.img), old_img))
+		{
+			free(tdata);
 			return (1);	// Not enough memory
-
-		res = mem_clip_new(nw, nh, mem_clip_bpp,
-			cmask_from(mem_clip.img), old_img);
-		if (res) return (1);	// Not enough memory
+		}
 		memcpy(new_img, mem_clip.img, sizeof(chanlist));
 	}
 
-	if ( rot_bpp == 1 ) type = FALSE;
-	mem_rotate_free_real(old_img, new_img, ow, oh, nw, nh, rot_bpp, angle, type,
-		gcor, channel_dis[CHN_ALPHA] && !clipboard, clipboard);
+	rotate_run(tdata, old_img, new_img);
 	if (!clipboard) progress_end();
 
 	/* Lose old unwanted clipboard */
 	if (clipboard) mem_free_chanlist(old_img);
 
-	return 0;
+	return (0);
 }
 
 int mem_image_rot( int dir )					// Rotate image 90 degrees
@@ -5550,81 +6579,481 @@ static fstep *make_filter(int l0, int l1, int type, int sharp, int bound)
 	return (res);
 }
 
+/* Vectorized scaling: operations on accumulator rows of doubles or floats */
+
 typedef struct {
-	int tmask, gcor, progress;
-	int ow, oh, nw, nh, bpp;
-	unsigned char **src, **dest;
-	double *rgb;
-	fstep *hfilter, *vfilter;
-	threaddata *tdata; // For simplicity
-} scale_context;
+	int esz;	// Accumulator size
+	/* Add "n" values of row, weighted by "tk", to accumulator row; with
+	 * gamma table, look values up in it */
+	void (*vadd)(void *wrk, unsigned char *img, int n, double tk,
+		const void *gt);
+	/* Same for RGBA: weighted RGB & RGB * alpha interleaved, then alpha */
+	void (*vadd4)(void *wrk, void *wrka, unsigned char *img,
+		unsigned char *imga, int n, double tk, const void *gt);
+	/* Apply horizontal filter to 1 channel */
+	double (*dot1)(void *wrk, const float *k, int n);
+	/* Same for 3 channels out of "stride" interleaved ones */
+	void (*dot3)(void *wrk, int stride, const float *k, int n, double *sum);
+} scale_ops;
+
+#ifdef HAVE_X86_SIMD
+
+/* SSE2 is always there on x86-64; AVX2 gets checked for at runtime. Double
+ * accumulators give exactly the same vertical pass as scalar code; the
+ * horizontal dot products add terms in a different order, so results can
+ * rarely round to a neighbouring level. Float ones trade precision for speed */
+
+static void vadd_d_sse2(void *wrk_, unsigned char *img, int n, double tk,
+	const void *gt_)
+{
+	double *wrk = wrk_;
+	const double *gt = gt_;
+	__m128d v0, v1, kv = _mm_set1_pd(tk);
+	__m128i x, z = _mm_setzero_si128();
+	int j, i4;
+
+	for (j = 0; j <= n - 4; j += 4)
+	{
+		if (gt)
+		{
+			v0 = _mm_set_pd(gt[img[j + 1]], gt[img[j]]);
+			v1 = _mm_set_pd(gt[img[j + 3]], gt[img[j + 2]]);
+		}
+		else
+		{
+			memcpy(&i4, img + j, 4);
+			x = _mm_unpacklo_epi8(_mm_cvtsi32_si128(i4), z);
+			x = _mm_unpacklo_epi16(x, z);
+			v0 = _mm_cvtepi32_pd(x);
+			v1 = _mm_cvtepi32_pd(_mm_shuffle_epi32(x, 0xEE));
+		}
+		_mm_storeu_pd(wrk + j, _mm_add_pd(_mm_loadu_pd(wrk + j),
+			_mm_mul_pd(v0, kv)));
+		_mm_storeu_pd(wrk + j + 2, _mm_add_pd(_mm_loadu_pd(wrk + j + 2),
+			_mm_mul_pd(v1, kv)));
+	}
+	for (; j < n; j++) wrk[j] += (gt ? gt[img[j]] : img[j]) * tk;
+}
 
-static void clear_scale(scale_context *ctx)
+static void vadd_f_sse2(void *wrk_, unsigned char *img, int n, double tk,
+	const void *gt_)
 {
-	free(ctx->hfilter);
-	free(ctx->vfilter);
-	free(ctx->tdata);
+	float *wrk = wrk_;
+	const float *gt = gt_;
+	__m128 v, kv = _mm_set1_ps(tk);
+	__m128i x, z = _mm_setzero_si128();
+	int j, i4;
+
+	for (j = 0; j <= n - 4; j += 4)
+	{
+		if (gt) v = _mm_set_ps(gt[img[j + 3]], gt[img[j + 2]],
+			gt[img[j + 1]], gt[img[j]]);
+		else
+		{
+			memcpy(&i4, img + j, 4);
+			x = _mm_unpacklo_epi8(_mm_cvtsi32_si128(i4), z);
+			v = _mm_cvtepi32_ps(_mm_unpacklo_epi16(x, z));
+		}
+		_mm_storeu_ps(wrk + j, _mm_add_ps(_mm_loadu_ps(wrk + j),
+			_mm_mul_ps(v, kv)));
+	}
+	for (; j < n; j++) wrk[j] += (gt ? gt[img[j]] : img[j]) * (float)tk;
 }
 
-static int prepare_scale(scale_context *ctx, int type, int sharp, int bound)
+static void vadd4_d_sse2(void *wrk_, void *wrka_, unsigned char *img,
+	unsigned char *imga, int n, double tk, const void *gt_)
 {
-	ctx->hfilter = ctx->vfilter = NULL;
-	ctx->tdata = NULL;
-
-	/* We don't use threading for NN */
-	if (!type || (ctx->bpp == 1)) return (TRUE);
+	double *wrk = wrk_, *wrka = wrka_;
+	const double *gt = gt_;
+	__m128d kv = _mm_set1_pd(tk);
+	int j;
 
-	if ((ctx->hfilter = make_filter(ctx->ow, ctx->nw, type, sharp, bound)) &&
-		(ctx->vfilter = make_filter(ctx->oh, ctx->nh, type, sharp, bound)))
+	for (j = 0; j < n; j++ , wrk += 6 , img += 3)
 	{
-		int l = (ctx->ow - ctx->hfilter[0].idx * 2) * sizeof(double);
-		if ((ctx->tdata = talloc(MA_ALIGN_DOUBLE,
-			image_threads(ctx->nw, ctx->nh), ctx, sizeof(*ctx),
-			NULL,
-			// !!! No space for RGBAS for now
-			&ctx->rgb, l * (ctx->tmask ? 7 : 3),
-			NULL))) return (TRUE);
-	}
+		double kk = imga[j] * tk, v0, v1, v2;
 
-	clear_scale(ctx);
-	return (FALSE);
+		wrka[j] += kk;
+		if (gt) v0 = gt[img[0]] , v1 = gt[img[1]] , v2 = gt[img[2]];
+		else v0 = img[0] , v1 = img[1] , v2 = img[2];
+		_mm_storeu_pd(wrk, _mm_add_pd(_mm_loadu_pd(wrk),
+			_mm_mul_pd(_mm_set_pd(v1, v0), kv)));
+		_mm_storeu_pd(wrk + 2, _mm_add_pd(_mm_loadu_pd(wrk + 2),
+			_mm_mul_pd(_mm_set_pd(v0, v2), _mm_set_pd(kk, tk))));
+		_mm_storeu_pd(wrk + 4, _mm_add_pd(_mm_loadu_pd(wrk + 4),
+			_mm_mul_pd(_mm_set_pd(v2, v1), _mm_set1_pd(kk))));
+	}
 }
 
-static void tile_extend(double *temp, int w, int l)
+static void vadd4_f_sse2(void *wrk_, void *wrka_, unsigned char *img,
+	unsigned char *imga, int n, double tk, const void *gt_)
 {
-	memcpy(temp - l, temp + w - l, l * sizeof(*temp));
-	memcpy(temp + w, temp, l * sizeof(*temp));
-}
+	float *wrk = wrk_, *wrka = wrka_;
+	const float *gt = gt_;
+	__m128 v, w;
+	int j;
 
-typedef void REGPARM2 (*istore_func)(unsigned char *img, const double *sum);
+	for (j = 0; j < n; j++ , wrk += 6 , img += 3)
+	{
+		float kk = imga[j] * (float)tk, v0, v1, v2;
 
-static void REGPARM2 istore_gc(unsigned char *img, const double *sum)
+		wrka[j] += kk;
+		if (gt) v0 = gt[img[0]] , v1 = gt[img[1]] , v2 = gt[img[2]];
+		else v0 = img[0] , v1 = img[1] , v2 = img[2];
+		_mm_storeu_ps(wrk, _mm_add_ps(_mm_loadu_ps(wrk),
+			_mm_mul_ps(_mm_set_ps(v0, v2, v1, v0),
+			_mm_set_ps(kk, tk, tk, tk))));
+		/* Last 2 values */
+		w = _mm_loadl_pi(_mm_setzero_ps(), (__m64 *)(wrk + 4));
+		v = _mm_mul_ps(_mm_set_ps(0, 0, v2, v1), _mm_set1_ps(kk));
+		_mm_storel_pi((__m64 *)(wrk + 4), _mm_add_ps(w, v));
+	}
+}
+
+static double dot1_d_sse2(void *wrk_, const float *k, int n)
 {
-	/* Reverse gamma correction */
-	img[0] = UNGAMMA256X(sum[0]);
-	img[1] = UNGAMMA256X(sum[1]);
-	img[2] = UNGAMMA256X(sum[2]);
+	double *wrk = wrk_, sum;
+	__m128d a0 = _mm_setzero_pd(), a1 = a0;
+	int t;
+
+	for (t = 0; t <= n - 4; t += 4)
+	{
+		a0 = _mm_add_pd(a0, _mm_mul_pd(_mm_loadu_pd(wrk + t),
+			_mm_cvtps_pd(_mm_castpd_ps(_mm_load_sd((double *)(k + t))))));
+		a1 = _mm_add_pd(a1, _mm_mul_pd(_mm_loadu_pd(wrk + t + 2),
+			_mm_cvtps_pd(_mm_castpd_ps(_mm_load_sd((double *)(k + t + 2))))));
+	}
+	a0 = _mm_add_pd(a0, a1);
+	sum = _mm_cvtsd_f64(_mm_add_sd(a0, _mm_unpackhi_pd(a0, a0)));
+	for (; t < n; t++) sum += wrk[t] * k[t];
+	return (sum);
 }
 
-static void REGPARM2 istore_3(unsigned char *img, const double *sum)
+static double dot1_f_sse2(void *wrk_, const float *k, int n)
 {
-	int j = (int)rint(sum[0]);
-	img[0] = j < 0 ? 0 : j > 0xFF ? 0xFF : j;
-	j = (int)rint(sum[1]);
-	img[1] = j < 0 ? 0 : j > 0xFF ? 0xFF : j;
-	j = (int)rint(sum[2]);
-	img[2] = j < 0 ? 0 : j > 0xFF ? 0xFF : j;
+	float *wrk = wrk_, sum;
+	__m128 a0 = _mm_setzero_ps(), a1 = a0;
+	int t;
+
+	for (t = 0; t <= n - 8; t += 8)
+	{
+		a0 = _mm_add_ps(a0, _mm_mul_ps(_mm_loadu_ps(wrk + t),
+			_mm_loadu_ps(k + t)));
+		a1 = _mm_add_ps(a1, _mm_mul_ps(_mm_loadu_ps(wrk + t + 4),
+			_mm_loadu_ps(k + t + 4)));
+	}
+	a0 = _mm_add_ps(a0, a1);
+	a0 = _mm_add_ps(a0, _mm_movehl_ps(a0, a0));
+	sum = _mm_cvtss_f32(_mm_add_ss(a0, _mm_shuffle_ps(a0, a0, 1)));
+	for (; t < n; t++) sum += wrk[t] * k[t];
+	return (sum);
 }
 
-static void REGPARM2 istore_1(unsigned char *img, const double *sum)
+static void dot3_d_sse2(void *wrk_, int stride, const float *k, int n,
+	double *sum)
 {
-	int j = (int)rint(sum[0]);
-	img[0] = j < 0 ? 0 : j > 0xFF ? 0xFF : j;
+	double *wrk = wrk_;
+	__m128d a01 = _mm_setzero_pd(), a2 = a01, b01 = a01, b2 = a01, kv;
+	int t;
+
+	/* Odd and even taps summed separately, for better pipelining */
+	for (t = 0; t < n - 1; t += 2 , wrk += stride * 2)
+	{
+		kv = _mm_set1_pd(k[t]);
+		a01 = _mm_add_pd(a01, _mm_mul_pd(_mm_loadu_pd(wrk), kv));
+		a2 = _mm_add_sd(a2, _mm_mul_sd(_mm_load_sd(wrk + 2), kv));
+		kv = _mm_set1_pd(k[t + 1]);
+		b01 = _mm_add_pd(b01, _mm_mul_pd(_mm_loadu_pd(wrk + stride), kv));
+		b2 = _mm_add_sd(b2, _mm_mul_sd(_mm_load_sd(wrk + stride + 2), kv));
+	}
+	if (t < n)
+	{
+		kv = _mm_set1_pd(k[t]);
+		a01 = _mm_add_pd(a01, _mm_mul_pd(_mm_loadu_pd(wrk), kv));
+		a2 = _mm_add_sd(a2, _mm_mul_sd(_mm_load_sd(wrk + 2), kv));
+	}
+	_mm_storeu_pd(sum, _mm_add_pd(a01, b01));
+	_mm_store_sd(sum + 2, _mm_add_sd(a2, b2));
 }
 
-/* !!! Once again, beware of GCC misoptimization! The two functions below
- * should not be both inlineable at once, otherwise poor code wasting both
- * time and space will be produced - WJ */
+static void dot3_f_sse2(void *wrk_, int stride, const float *k, int n,
+	double *sum)
+{
+	float *wrk = wrk_;
+	__m128 a = _mm_setzero_ps(), b = a;
+	int t;
+
+#define LOAD3F(P) _mm_movelh_ps(_mm_castpd_ps(_mm_load_sd((double *)(P))), \
+	_mm_load_ss((P) + 2))
+	for (t = 0; t < n - 1; t += 2 , wrk += stride * 2)
+	{
+		a = _mm_add_ps(a, _mm_mul_ps(LOAD3F(wrk), _mm_set1_ps(k[t])));
+		b = _mm_add_ps(b, _mm_mul_ps(LOAD3F(wrk + stride),
+			_mm_set1_ps(k[t + 1])));
+	}
+	if (t < n) a = _mm_add_ps(a, _mm_mul_ps(LOAD3F(wrk), _mm_set1_ps(k[t])));
+#undef LOAD3F
+	a = _mm_add_ps(a, b);
+	_mm_storeu_pd(sum, _mm_cvtps_pd(a));
+	_mm_store_sd(sum + 2, _mm_cvtps_pd(_mm_movehl_ps(a, a)));
+}
+
+#define AVX2 __attribute__((target("avx2")))
+
+static AVX2 void vadd_d_avx2(void *wrk_, unsigned char *img, int n, double tk,
+	const void *gt_)
+{
+	double *wrk = wrk_;
+	const double *gt = gt_;
+	__m256d v, kv = _mm256_set1_pd(tk);
+	__m128i x;
+	int j, i4;
+
+	for (j = 0; j <= n - 4; j += 4)
+	{
+		memcpy(&i4, img + j, 4);
+		x = _mm_cvtepu8_epi32(_mm_cvtsi32_si128(i4));
+		v = gt ? _mm256_i32gather_pd(gt, x, sizeof(double)) :
+			_mm256_cvtepi32_pd(x);
+		_mm256_storeu_pd(wrk + j, _mm256_add_pd(_mm256_loadu_pd(wrk + j),
+			_mm256_mul_pd(v, kv)));
+	}
+	for (; j < n; j++) wrk[j] += (gt ? gt[img[j]] : img[j]) * tk;
+}
+
+static AVX2 void vadd_f_avx2(void *wrk_, unsigned char *img, int n, double tk,
+	const void *gt_)
+{
+	float *wrk = wrk_;
+	const float *gt = gt_;
+	__m256 v, kv = _mm256_set1_ps(tk);
+	__m256i x;
+	int j;
+
+	for (j = 0; j <= n - 8; j += 8)
+	{
+		x = _mm256_cvtepu8_epi32(_mm_loadl_epi64((__m128i *)(img + j)));
+		v = gt ? _mm256_i32gather_ps(gt, x, sizeof(float)) :
+			_mm256_cvtepi32_ps(x);
+		_mm256_storeu_ps(wrk + j, _mm256_add_ps(_mm256_loadu_ps(wrk + j),
+			_mm256_mul_ps(v, kv)));
+	}
+	for (; j < n; j++) wrk[j] += (gt ? gt[img[j]] : img[j]) * (float)tk;
+}
+
+static AVX2 void vadd4_d_avx2(void *wrk_, void *wrka_, unsigned char *img,
+	unsigned char *imga, int n, double tk, const void *gt_)
+{
+	double *wrk = wrk_, *wrka = wrka_;
+	const double *gt = gt_;
+	int j;
+
+	for (j = 0; j < n; j++ , wrk += 6 , img += 3)
+	{
+		double kk = imga[j] * tk, v0, v1, v2;
+
+		wrka[j] += kk;
+		if (gt) v0 = gt[img[0]] , v1 = gt[img[1]] , v2 = gt[img[2]];
+		else v0 = img[0] , v1 = img[1] , v2 = img[2];
+		_mm256_storeu_pd(wrk, _mm256_add_pd(_mm256_loadu_pd(wrk),
+			_mm256_mul_pd(_mm256_set_pd(v0, v2, v1, v0),
+			_mm256_set_pd(kk, tk, tk, tk))));
+		_mm_storeu_pd(wrk + 4, _mm_add_pd(_mm_loadu_pd(wrk + 4),
+			_mm_mul_pd(_mm_set_pd(v2, v1), _mm_set1_pd(kk))));
+	}
+}
+
+static AVX2 double dot1_d_avx2(void *wrk_, const float *k, int n)
+{
+	double *wrk = wrk_, sum;
+	__m256d a0 = _mm256_setzero_pd(), a1 = a0;
+	__m128d s;
+	int t;
+
+	for (t = 0; t <= n - 8; t += 8)
+	{
+		a0 = _mm256_add_pd(a0, _mm256_mul_pd(_mm256_loadu_pd(wrk + t),
+			_mm256_cvtps_pd(_mm_loadu_ps(k + t))));
+		a1 = _mm256_add_pd(a1, _mm256_mul_pd(_mm256_loadu_pd(wrk + t + 4),
+			_mm256_cvtps_pd(_mm_loadu_ps(k + t + 4))));
+	}
+	a0 = _mm256_add_pd(a0, a1);
+	s = _mm_add_pd(_mm256_castpd256_pd128(a0), _mm256_extractf128_pd(a0, 1));
+	sum = _mm_cvtsd_f64(_mm_add_sd(s, _mm_unpackhi_pd(s, s)));
+	for (; t < n; t++) sum += wrk[t] * k[t];
+	return (sum);
+}
+
+static AVX2 double dot1_f_avx2(void *wrk_, const float *k, int n)
+{
+	float *wrk = wrk_, sum;
+	__m256 a0 = _mm256_setzero_ps(), a1 = a0;
+	__m128 s;
+	int t;
+
+	for (t = 0; t <= n - 16; t += 16)
+	{
+		a0 = _mm256_add_ps(a0, _mm256_mul_ps(_mm256_loadu_ps(wrk + t),
+			_mm256_loadu_ps(k + t)));
+		a1 = _mm256_add_ps(a1, _mm256_mul_ps(_mm256_loadu_ps(wrk + t + 8),
+			_mm256_loadu_ps(k + t + 8)));
+	}
+	a0 = _mm256_add_ps(a0, a1);
+	s = _mm_add_ps(_mm256_castps256_ps128(a0), _mm256_extractf128_ps(a0, 1));
+	s = _mm_add_ps(s, _mm_movehl_ps(s, s));
+	sum = _mm_cvtss_f32(_mm_add_ss(s, _mm_shuffle_ps(s, s, 1)));
+	for (; t < n; t++) sum += wrk[t] * k[t];
+	return (sum);
+}
+
+static AVX2 void dot3_d_avx2(void *wrk_, int stride, const float *k, int n,
+	double *sum)
+{
+	double *wrk = wrk_;
+	__m256d a = _mm256_setzero_pd(), b = a;
+	__m256i m3 = _mm256_set_epi64x(0, -1, -1, -1);
+	int t;
+
+	for (t = 0; t < n - 1; t += 2 , wrk += stride * 2)
+	{
+		a = _mm256_add_pd(a, _mm256_mul_pd(_mm256_maskload_pd(wrk, m3),
+			_mm256_set1_pd(k[t])));
+		b = _mm256_add_pd(b, _mm256_mul_pd(_mm256_maskload_pd(wrk + stride,
+			m3), _mm256_set1_pd(k[t + 1])));
+	}
+	if (t < n) a = _mm256_add_pd(a, _mm256_mul_pd(
+		_mm256_maskload_pd(wrk, m3), _mm256_set1_pd(k[t])));
+	_mm256_maskstore_pd(sum, m3, _mm256_add_pd(a, b));
+}
+
+static AVX2 void dot3_f_avx2(void *wrk_, int stride, const float *k, int n,
+	double *sum)
+{
+	float *wrk = wrk_;
+	__m128 a = _mm_setzero_ps(), b = a;
+	__m128i m3 = _mm_set_epi32(0, -1, -1, -1);
+	int t;
+
+	for (t = 0; t < n - 1; t += 2 , wrk += stride * 2)
+	{
+		a = _mm_add_ps(a, _mm_mul_ps(_mm_maskload_ps(wrk, m3),
+			_mm_set1_ps(k[t])));
+		b = _mm_add_ps(b, _mm_mul_ps(_mm_maskload_ps(wrk + stride, m3),
+			_mm_set1_ps(k[t + 1])));
+	}
+	if (t < n) a = _mm_add_ps(a, _mm_mul_ps(_mm_maskload_ps(wrk, m3),
+		_mm_set1_ps(k[t])));
+	_mm256_maskstore_pd(sum, _mm256_set_epi64x(0, -1, -1, -1),
+		_mm256_cvtps_pd(_mm_add_ps(a, b)));
+}
+
+#undef AVX2
+
+static const scale_ops scale_sse2[2] = {
+	{ sizeof(double), vadd_d_sse2, vadd4_d_sse2, dot1_d_sse2, dot3_d_sse2 },
+	{ sizeof(float), vadd_f_sse2, vadd4_f_sse2, dot1_f_sse2, dot3_f_sse2 }};
+static const scale_ops scale_avx2[2] = {
+	{ sizeof(double), vadd_d_avx2, vadd4_d_avx2, dot1_d_avx2, dot3_d_avx2 },
+	/* Nothing to gain from AVX2 in RGBA vertical pass with floats */
+	{ sizeof(float), vadd_f_avx2, vadd4_f_sse2, dot1_f_avx2, dot3_f_avx2 }};
+
+static const scale_ops *scale_simd_ops()
+{
+	if (!scale_simd) return (NULL);
+	return ((__builtin_cpu_supports("avx2") ? scale_avx2 : scale_sse2) +
+		(scale_simd == SCALE_SIMD_FLOAT));
+}
+
+#endif /* HAVE_X86_SIMD */
+
+typedef struct {
+	int tmask, gcor, progress;
+	int ow, oh, nw, nh, bpp;
+	unsigned char **src, **dest;
+	double *rgb;
+	fstep *hfilter, *vfilter;
+	threaddata *tdata; // For simplicity
+	const scale_ops *ops; // Vectorized code, if any
+	unsigned char *chk; // Row buffer for checking it against scalar code
+	int maxdiff, over; // Check results
+} scale_context;
+
+static void clear_scale(scale_context *ctx)
+{
+	free(ctx->hfilter);
+	free(ctx->vfilter);
+	free(ctx->tdata);
+}
+
+static int prepare_scale(scale_context *ctx, int type, int sharp, int bound)
+{
+	ctx->hfilter = ctx->vfilter = NULL;
+	ctx->tdata = NULL;
+	ctx->ops = NULL;
+	ctx->chk = NULL;
+	ctx->maxdiff = ctx->over = 0;
+
+	/* We don't use threading for NN */
+	if (!type || (ctx->bpp == 1)) return (TRUE);
+
+#ifdef HAVE_X86_SIMD
+	ctx->ops = scale_simd_ops();
+#endif
+	if ((ctx->hfilter = make_filter(ctx->ow, ctx->nw, type, sharp, bound)) &&
+		(ctx->vfilter = make_filter(ctx->oh, ctx->nh, type, sharp, bound)))
+	{
+		int l = (ctx->ow - ctx->hfilter[0].idx * 2) * sizeof(double);
+		if ((ctx->tdata = talloc(MA_ALIGN_DOUBLE | MA_SKIP_ZEROSIZE,
+			image_threads(ctx->nw, ctx->nh), ctx, sizeof(*ctx),
+			NULL,
+			// !!! No space for RGBAS for now
+			&ctx->rgb, l * (ctx->tmask ? 7 : 3),
+			&ctx->chk, ctx->ops && scale_check ?
+				ctx->nw * (NUM_CHANNELS + 2) : 0,
+			NULL))) return (TRUE);
+	}
+
+	clear_scale(ctx);
+	return (FALSE);
+}
+
+static void tile_extend(void *temp, int w, int l, int esz)
+{
+	char *tmp = temp;
+
+	w *= esz; l *= esz;
+	memcpy(tmp - l, tmp + w - l, l);
+	memcpy(tmp + w, tmp, l);
+}
+
+typedef void REGPARM2 (*istore_func)(unsigned char *img, const double *sum);
+
+static void REGPARM2 istore_gc(unsigned char *img, const double *sum)
+{
+	/* Reverse gamma correction */
+	img[0] = UNGAMMA256X(sum[0]);
+	img[1] = UNGAMMA256X(sum[1]);
+	img[2] = UNGAMMA256X(sum[2]);
+}
+
+static void REGPARM2 istore_3(unsigned char *img, const double *sum)
+{
+	int j = (int)rint(sum[0]);
+	img[0] = j < 0 ? 0 : j > 0xFF ? 0xFF : j;
+	j = (int)rint(sum[1]);
+	img[1] = j < 0 ? 0 : j > 0xFF ? 0xFF : j;
+	j = (int)rint(sum[2]);
+	img[2] = j < 0 ? 0 : j > 0xFF ? 0xFF : j;
+}
+
+static void REGPARM2 istore_1(unsigned char *img, const double *sum)
+{
+	int j = (int)rint(sum[0]);
+	img[0] = j < 0 ? 0 : j > 0xFF ? 0xFF : j;
+}
+
+/* !!! Once again, beware of GCC misoptimization! The two functions below
+ * should not be both inlineable at once, otherwise poor code wasting both
+ * time and space will be produced - WJ */
 
 static void scale_row(fstep *tmpy, fstep *hfilter, double *work_area,
 	int bpp, int gc, int ow, int oh, int nw, int i,
@@ -5649,7 +7078,7 @@ static void scale_row(fstep *tmpy, fstep *hfilter, double *work_area,
 		const double tk = kp[y];
 		double *wrk = work_area;
 		/* Only simple tiling isn't built into filter */
-		img = src + ((y + oh) % oh) * ow;
+		img = ROW_PTR(src, (y + oh) % oh, ow, 1);
 		if (gc) /* Gamma-correct */
 		{
 			for (j = 0; j < ow; j++)
@@ -5661,10 +7090,10 @@ static void scale_row(fstep *tmpy, fstep *hfilter, double *work_area,
 				*wrk++ += *img++ * tk;
 		}
 	}
-	tile_extend(work_area, ow, -ll * bpp);
+	tile_extend(work_area, ow, -ll * bpp, sizeof(double));
 	/* Scale it horizontally */
 	istore = gc ? istore_gc : bpp == 1 ? istore_1 : istore_3;
-	img = dest + i * nw * bpp;
+	img = ROW_PTR(dest, i, nw, bpp);
 	for (tmpx = hfilter; tmpx[1].k; tmpx++ , img += bpp)
 	{
 		__typeof__(*tmpx->k) *tp, *kp = tmpx[1].k;
@@ -5710,8 +7139,8 @@ static void scale_rgba(fstep *tmpy, fstep *hfilter, double *work_area,
 		unsigned char *img, *imga;
 		int ix = (y + oh) % oh;
 
-		img = src + ix * ow * 3;
-		imga = srca + ix * ow;
+		img = ROW_PTR(src, ix, ow, 3);
+		imga = ROW_PTR(srca, ix, ow, 1);
 		if (gc) /* Gamma-correct */
 		{
 			const double tk = kp[y];
@@ -5749,12 +7178,12 @@ static void scale_rgba(fstep *tmpy, fstep *hfilter, double *work_area,
 			}
 		}
 	}
-	tile_extend(work_area, ow * 6, -ll * 6);
-	tile_extend(wrka, ow, -ll);
+	tile_extend(work_area, ow * 6, -ll * 6, sizeof(double));
+	tile_extend(wrka, ow, -ll, sizeof(double));
 	/* Scale it horizontally */
 	istore = gc ? istore_gc : bpp == 1 ? istore_1 : istore_3;
-	img = dest + i * nw * 3;
-	imga = dsta + i * nw;
+	img = ROW_PTR(dest, i, nw, 3);
+	imga = ROW_PTR(dsta, i, nw, 1);
 	for (tmpx = hfilter; tmpx[1].k; tmpx++)
 	{
 		__typeof__(*tmpx->k) *tp, *kp = tmpx[1].k;
@@ -5790,35 +7219,213 @@ static void scale_rgba(fstep *tmpy, fstep *hfilter, double *work_area,
 	}
 }
 
-static void do_scale(tcb *thread)
+#ifdef HAVE_X86_SIMD
+
+static void scale_row_simd(const scale_ops *ops, fstep *tmpy, fstep *hfilter,
+	void *work_area, int bpp, int gc, int ow, int oh, int nw, int i,
+	unsigned char *src, unsigned char *dest)
 {
-	scale_context ctx = *(scale_context *)thread->data;
-	fstep *tmpy;
-	int i, ii, cc, cnt = thread->nsteps;
+	/* !!! Protect from possible stack misalignment */
+	unsigned char sum_[4 * sizeof(double)];
+	double *sum = ALIGNED(sum_, sizeof(double));
+	istore_func istore;
+	unsigned char *img;
+	fstep *tmpx;
+	char *wrk;
+	const void *gt = NULL;
+	__typeof__(*tmpy->k) *kp = tmpy->k - tmpy->idx;
+	int y, esz = ops->esz, h = tmpy[1].k - kp, ll = hfilter[0].idx;
 
 
-	/* For each destination line */
-	for (i = thread->step0 , ii = 0; ii < cnt; i++ , ii++)
+	if (gc) gt = esz == sizeof(float) ? (void *)gamma256f : (void *)gamma256;
+	wrk = (char *)work_area - ll * bpp * esz;
+	ow *= bpp;
+	memset(wrk, 0, ow * esz);
+	/* Build one vertically-scaled row */
+	for (y = tmpy->idx; y < h; y++)
+		/* Only simple tiling isn't built into filter */
+		ops->vadd(wrk, ROW_PTR(src, (y + oh) % oh, ow, 1), ow, kp[y], gt);
+	tile_extend(wrk, ow, -ll * bpp, esz);
+	/* Scale it horizontally */
+	istore = gc ? istore_gc : bpp == 1 ? istore_1 : istore_3;
+	img = ROW_PTR(dest, i, nw, bpp);
+	for (tmpx = hfilter; tmpx[1].k; tmpx++ , img += bpp)
+	{
+		void *wp = wrk + tmpx->idx * bpp * esz;
+		int n = tmpx[1].k - tmpx->k;
+
+		if (bpp == 1) sum[0] = ops->dot1(wp, tmpx->k, n);
+		else ops->dot3(wp, 3, tmpx->k, n, sum);
+		istore(img, sum);
+	}
+}
+
+static void scale_rgba_simd(const scale_ops *ops, fstep *tmpy, fstep *hfilter,
+	void *work_area, int bpp, int gc, int ow, int oh, int nw, int i,
+	unsigned char *src, unsigned char *dest,
+	unsigned char *srca, unsigned char *dsta)
+{
+	/* !!! Protect from possible stack misalignment */
+	unsigned char sum_[4 * sizeof(double)];
+	double *sum = ALIGNED(sum_, sizeof(double));
+	istore_func istore;
+	unsigned char *img, *imga;
+	fstep *tmpx;
+	char *wrk, *wrka;
+	const void *gt = NULL;
+	__typeof__(*tmpy->k) *kp = tmpy->k - tmpy->idx;
+	int j, y, esz = ops->esz, h = tmpy[1].k - kp, ll = hfilter[0].idx;
+
+
+	if (gc) gt = esz == sizeof(float) ? (void *)gamma256f : (void *)gamma256;
+	wrka = (char *)work_area + (ow * 6 - ll * 13) * esz;
+	wrk = (char *)work_area - ll * 6 * esz;
+	memset(wrk, 0, (ow - ll) * 7 * esz);
+	for (y = tmpy->idx; y < h; y++)
+	{
+		int ix = (y + oh) % oh;
+
+		ops->vadd4(wrk, wrka, ROW_PTR(src, ix, ow, 3),
+			ROW_PTR(srca, ix, ow, 1), ow,
+			kp[y], gt);
+	}
+	tile_extend(wrk, ow * 6, -ll * 6, esz);
+	tile_extend(wrka, ow, -ll, esz);
+	/* Scale it horizontally */
+	istore = gc ? istore_gc : bpp == 1 ? istore_1 : istore_3;
+	img = ROW_PTR(dest, i, nw, 3);
+	imga = ROW_PTR(dsta, i, nw, 1);
+	for (tmpx = hfilter; tmpx[1].k; tmpx++)
 	{
-		tmpy = ctx.vfilter + i;
-		if (ctx.dest[CHN_IMAGE]) // Chanlist may contain, e.g., only mask
+		char *wp;
+		double sa, mult;
+		int n = tmpx[1].k - tmpx->k;
+
+		sa = ops->dot1(wrka + tmpx->idx * esz, tmpx->k, n);
+		j = (int)rint(sa);
+		*imga = j < 0 ? 0 : j > 0xFF ? 0xFF : j;
+		wp = wrk + tmpx->idx * 6 * esz;
+		mult = 1.0;
+		if (*imga++)
 		{
-			(ctx.tmask == CMASK_NONE ? (__typeof__(&scale_rgba))scale_row :
-				scale_rgba)(tmpy, ctx.hfilter, ctx.rgb,
-				3, ctx.gcor, ctx.ow, ctx.oh, ctx.nw, i,
-				ctx.src[CHN_IMAGE], ctx.dest[CHN_IMAGE],
-				ctx.src[CHN_ALPHA], ctx.dest[CHN_ALPHA]);
+			wp += 3 * esz;
+			mult /= sa;
 		}
+		ops->dot3(wp, 6, tmpx->k, n, sum);
+		sum[0] *= mult; sum[1] *= mult; sum[2] *= mult;
+		istore(img, sum);
+		img += 3;
+	}
+}
+
+#endif /* HAVE_X86_SIMD */
+
+/* Scale source row "i" of all channels into row "y" of "dest" */
+static void scale_line(scale_context *ctx, const scale_ops *ops, int i,
+	unsigned char **dest, int y)
+{
+	fstep *tmpy = ctx->vfilter + i;
+	int cc;
+
+	if (dest[CHN_IMAGE]) // Chanlist may contain, e.g., only mask
+	{
+#ifdef HAVE_X86_SIMD
+		if (ops && (ctx->tmask == CMASK_NONE)) scale_row_simd(ops,
+			tmpy, ctx->hfilter, ctx->rgb,
+			3, ctx->gcor, ctx->ow, ctx->oh, ctx->nw, y,
+			ctx->src[CHN_IMAGE], dest[CHN_IMAGE]);
+		else if (ops) scale_rgba_simd(ops, tmpy, ctx->hfilter, ctx->rgb,
+			3, ctx->gcor, ctx->ow, ctx->oh, ctx->nw, y,
+			ctx->src[CHN_IMAGE], dest[CHN_IMAGE],
+			ctx->src[CHN_ALPHA], dest[CHN_ALPHA]);
+		else
+#endif
+		(ctx->tmask == CMASK_NONE ? (__typeof__(&scale_rgba))scale_row :
+			scale_rgba)(tmpy, ctx->hfilter, ctx->rgb,
+			3, ctx->gcor, ctx->ow, ctx->oh, ctx->nw, y,
+			ctx->src[CHN_IMAGE], dest[CHN_IMAGE],
+			ctx->src[CHN_ALPHA], dest[CHN_ALPHA]);
+	}
+
+	for (cc = CHN_IMAGE + 1; cc < NUM_CHANNELS; cc++)
+	{
+		if (!dest[cc] || (ctx->tmask & CMASK_FOR(cc))) continue;
+#ifdef HAVE_X86_SIMD
+		if (ops) scale_row_simd(ops, tmpy, ctx->hfilter, ctx->rgb,
+			1, FALSE, ctx->ow, ctx->oh, ctx->nw, y,
+			ctx->src[cc], dest[cc]);
+		else
+#endif
+		scale_row(tmpy, ctx->hfilter, ctx->rgb,
+			1, FALSE, ctx->ow, ctx->oh, ctx->nw, y,
+			ctx->src[cc], dest[cc]);
+	}
+}
+
+#ifdef HAVE_X86_SIMD
+
+/* Rescale row "i" with scalar code, and compare */
+static void scale_check_line(scale_context *ctx, int i)
+{
+	chanlist tlist;
+	unsigned char *src, *dest;
+	int j, l, d, cc;
 
-		for (cc = CHN_IMAGE + 1; cc < NUM_CHANNELS; cc++)
+	for (cc = 0; cc < NUM_CHANNELS; cc++) tlist[cc] = !ctx->dest[cc] ? NULL :
+		ctx->chk + ctx->nw * (cc ? cc + 2 : 0);
+	scale_line(ctx, NULL, i, tlist, 0);
+	for (cc = 0; cc < NUM_CHANNELS; cc++)
+	{
+		if (!(src = tlist[cc])) continue;
+		l = ctx->nw * (cc ? 1 : 3);
+		dest = ROW_PTR(ctx->dest[cc], i, l, 1);
+		for (j = 0; j < l; j++)
 		{
-			if (ctx.dest[cc] && !(ctx.tmask & CMASK_FOR(cc)))
-				scale_row(tmpy, ctx.hfilter, ctx.rgb,
-					1, FALSE, ctx.ow, ctx.oh, ctx.nw, i,
-					ctx.src[cc], ctx.dest[cc]);
+			d = abs(dest[j] - src[j]);
+			if (d > ctx->maxdiff) ctx->maxdiff = d;
+			ctx->over += d > scale_tolerance;
 		}
+	}
+}
+
+static void scale_check_report(scale_context *ctx)
+{
+	scale_context *tc;
+	int i, maxdiff = 0, over = 0;
+
+	if (!ctx->chk) return;
+	for (i = 0; i < ctx->tdata->count; i++)
+	{
+		tc = ctx->tdata->threads[i]->data;
+		if (tc->maxdiff > maxdiff) maxdiff = tc->maxdiff;
+		over += tc->over;
+	}
+	g_printerr("Scaling check, %s with %s: max difference %d, "
+		"%d values off by more than %d\n",
+		(ctx->ops == scale_avx2) || (ctx->ops == scale_avx2 + 1) ?
+		"AVX2" : "SSE2",
+		ctx->ops->esz == sizeof(float) ? "floats" : "doubles",
+		maxdiff, over, scale_tolerance);
+}
+
+#else
+#define scale_check_report(X)
+#endif
+
+static void do_scale(tcb *thread)
+{
+	scale_context *ctx = thread->data;
+	int i, ii, cnt = thread->nsteps;
 
-		if (ctx.progress && thread_step(thread, ii + 1, cnt, 10)) break;
+
+	/* For each destination line */
+	for (i = thread->step0 , ii = 0; ii < cnt; i++ , ii++)
+	{
+		scale_line(ctx, ctx->ops, i, ctx->dest, i);
+#ifdef HAVE_X86_SIMD
+		if (ctx->chk) scale_check_line(ctx, i);
+#endif
+		if (ctx->progress && thread_step(thread, ii + 1, cnt, 10)) break;
 	}
 	thread_done(thread);
 }
@@ -5880,9 +7487,13 @@ int mem_image_scale_real(chanlist old_img, int ow, int oh, int bpp,
 		return (1);	// Not enough memory
 
 	if (type && (bpp == 3))
+	{
 		launch_threads(do_scale, ctx.tdata, NULL, nh);
+		scale_check_report(&ctx);
+	}
 	else do_scale_nn(old_img, new_img, bpp, type, ow, oh, nw, nh, gcor, FALSE);
 
+	clear_scale(&ctx);
 	return (0);
 }
 
@@ -5914,7 +7525,10 @@ int mem_image_scale(int nw, int nh, int type, int gcor, int sharp, int bound)	//
 	{
 		progress_init(_("Scaling Image"), 0);
 		if (type && (mem_img_bpp == 3))
+		{
 			launch_threads(do_scale, ctx.tdata, NULL, mem_height);
+			scale_check_report(&ctx);
+		}
 		else do_scale_nn(old_img, mem_img, mem_img_bpp, type,
 			ctx.ow, ctx.oh, nw, nh, gcor, TRUE);
 		progress_end();
@@ -7288,27 +8902,59 @@ int mem_count_all_cols()				// Count all colours - Using main image
 	return mem_count_all_cols_real(mem_img[CHN_IMAGE], mem_width, mem_height);
 }
 
+typedef struct {
+	unsigned char *im;
+	int w, max;		// Image width, max colours to list
+	int n, full;		// Colours listed, whether stripe was done
+	int prog;		// Whether to show progress
+	guint32 *tab;		// Colour cube, for counting all colours
+	int *hash, *list;	// Unique colours & their hash, for listing them
+} colscan_data;
+
+static void count_cols_thread(tcb *thread)
+{
+	colscan_data *cd = thread->data;
+	unsigned char *im = cd->im + (size_t)thread->step0 * cd->w * 3;
+	guint32 *tab = cd->tab;
+	size_t l = (size_t)thread->nsteps * cd->w;
+
+	for (; l > 0; l-- , im += 3)	// Scan each pixel
+		tab[(im[0] >> 5) + (im[1] << 3) + (im[2] << 11)] |= 1 << (im[0] & 31);
+	thread_done(thread);
+}
+
 int mem_count_all_cols_real(unsigned char *im, int w, int h)	// Count all colours - very memory greedy
 {
+	colscan_data cd;
+	threaddata *tdata;
 	guint32 *tab;
-	int i, j, k, ix;
+	int i, j, k, nt;
+
+	/* Each thread needs a HUGE colour cube, so give it a lot of pixels */
+	nt = image_threads(w, h);
+	k = ((size_t)w * h) >> 19;
+	if (nt > k) nt = k;
 
+	cd.im = im;
+	cd.w = w;
 	j = 0x80000;
-	tab = calloc(j, sizeof(guint32));	// HUGE colour cube
-	if (!tab) return -1;			// Not enough memory Mr Greedy ;-)
+	tdata = talloc(0, nt, &cd, sizeof(cd), NULL,
+		&cd.tab, j * sizeof(guint32), NULL);
+	if (!tdata) return -1;			// Not enough memory Mr Greedy ;-)
+	launch_threads(count_cols_thread, tdata, NULL, h);
 
-	k = w * h;
-	for (i = 0; i < k; i++)			// Scan each pixel
+	// Merge the cubes
+	tab = ((colscan_data *)tdata->threads[0]->data)->tab;
+	for (k = 1; k < tdata->count; k++)
 	{
-		ix = (im[0] >> 5) + (im[1] << 3) + (im[2] << 11);
-		tab[ix] |= 1 << (im[0] & 31);
-		im += 3;
+		guint32 *tmp = ((colscan_data *)tdata->threads[k]->data)->tab;
+		for (i = 0; i < j; i++) tab[i] |= tmp[i];
 	}
 
 	// Count each colour
 	for (i = k = 0; i < j; i++) k += bitcount(tab[i]);
 
-	free(tab);
+	free(tdata);
 
 	return k;
 }
@@ -7321,26 +8967,86 @@ int mem_cols_used(int max_count)			// Count colours used in main RGB image
 		max_count, 1));
 }
 
-int mem_cols_used_real(unsigned char *im, int w, int h, int max_count, int prog)
-			// Count colours used in RGB chunk
+/* List unique colours in a stripe, stopping if there are too many */
+static void cols_used_thread(tcb *thread)
 {
-	int i, j = w * h * 3, k, res = 1, pix;
+	colscan_data *cd = thread->data;
+	unsigned char *im = cd->im + (size_t)thread->step0 * cd->w * 3;
+	int *slot, pix, l, n = 0, ii, cnt = thread->nsteps;
 
-	found[0] = MEM_2_INT(im, 0);
-	if (prog) progress_init(_("Counting Unique RGB Pixels"), 0);
-	for (i = 3; (i < j) && (res < max_count); i += 3) // Skim all pixels
+	for (ii = 0; ii < cnt; ii++)
 	{
-		pix = MEM_2_INT(im, i);
-		for (k = 0; k < res; k++)
+		for (l = cd->w; l > 0; l-- , im += 3)
 		{
-			if (found[k] == pix) break;
+			slot = colhash_slot(cd->hash, cd->list,
+				pix = MEM_2_INT(im, 0));
+			if (*slot) continue;
+			if (n >= cd->max) break;
+			cd->list[n] = pix;
+			*slot = ++n;
 		}
-		if (k >= res)	// New colour so add to list
-		{
-			found[res++] = pix;
-			if (!prog || (res & 7)) continue;
-			if (progress_update((float)res / max_count)) break;
+		if (l) break; // Too many colours
+		if (cd->prog && thread_step(thread, ii + 1, cnt, 10)) break;
+	}
+	cd->n = n;
+	cd->full = ii >= cnt;
+	thread_done(thread);
+}
+
+int mem_cols_used_real(unsigned char *im, int w, int h, int max_count, int prog)
+			// Count colours used in RGB chunk
+{
+	colscan_data cd;
+	threaddata *tdata;
+	int hash[COLHASH_SIZE], *slot;
+	int i, j, k, res = 0, pix;
+
+	if (max_count > 1024) max_count = 1024; // found[] size
+	memset(hash, 0, sizeof(hash));
+	if (prog) progress_init(_("Counting Unique RGB Pixels"), 0);
+
+	/* Merge per-stripe lists in order, while stripes are listed in full;
+	 * the result is the same as from scanning pixels one by one */
+	cd.im = im;
+	cd.w = w;
+	cd.max = max_count;
+	cd.n = cd.full = 0;
+	cd.prog = prog;
+	tdata = talloc(0, image_threads(w, h), &cd, sizeof(cd), NULL,
+		&cd.hash, sizeof(hash), &cd.list, max_count * sizeof(int), NULL);
+	i = 0;
+	if (tdata && (tdata->count > 1))
+	{
+		launch_threads(cols_used_thread, tdata, NULL, h);
+		/* Cancelled - merge the stripes done, and skip the rest */
+		if (tdata->threads[0]->stop) i = w * h * 3;
+		for (k = 0; k < tdata->count; k++)
+		{
+			colscan_data *tc = tdata->threads[k]->data;
+
+			if (!tc->full) break; // Continue from here by hand
+			for (j = 0; (j < tc->n) && (res < max_count); j++)
+			{
+				slot = colhash_slot(hash, found, pix = tc->list[j]);
+				if (*slot) continue;
+				found[res] = pix;
+				*slot = ++res;
+			}
 		}
+		if (!i) i = k < tdata->count ?
+			tdata->threads[k]->step0 * w * 3 : w * h * 3;
+	}
+	free(tdata);
+
+	/* Skim all (remaining) pixels */
+	for (j = w * h * 3; (i < j) && (res < max_count); i += 3)
+	{
+		slot = colhash_slot(hash, found, pix = MEM_2_INT(im, i));
+		if (*slot) continue;
+		found[res] = pix;	// New colour so add to list
+		*slot = ++res;
+		if (!prog || (res & 7)) continue;
+		if (progress_update((float)res / max_count)) break;
 	}
 	if (prog) progress_end();
 
@@ -7348,162 +9054,585 @@ int mem_cols_used_real(unsigned char *im, int w, int h, int max_count, int prog)
 }
 
 
-////	EFFECTS
+///	MIPMAPS
 
-static inline double dist(int n1, int n2)
+/* Pyramid of box-filtered levels, 1/2 down to 1/(2^MIP_LEVELS), for drawing
+ * RGB images zoomed out; each tile remembers which of its levels are valid,
+ * so levels get rebuilt lazily, and only where the image has changed */
+
+typedef struct {
+	chanlist base;		// Image channels it is made from
+	int w, h;		// Image size
+	int tw;			// Tiles across
+	unsigned char *valid;	// Bitmask of valid levels, per tile
+	chanlist lvl[MIP_LEVELS]; // Levels, from 1/2 down
+} mipmap;
+
+static mipmap mips[MIP_MAX];
+
+#define MIP_W(w, l) (((w) + (1 << (l)) - 1) >> (l))
+
+/* Largest level usable at given decimation factor */
+int mip_level(int zoom)
 {
-	return (sqrt(n1 * n1 + n2 * n2));
+	int l = 0;
+
+	while ((l < MIP_LEVELS) && !(zoom & ((2 << l) - 1))) l++;
+	return (l);
 }
 
-void do_effect(int type, int param)
+static void mip_free(mipmap *mp)
 {
-	unsigned char *src, *dest, *tmp, *mask, *buf;
-	int i, j, uninit_(k), k1, k2, bpp, ll, dxp1, dxm1, dyp1, dym1;
-	int op, md, ms;
-	double blur = (double)param / 200.0;
+	int i;
 
-	bpp = MEM_BPP;
-	ll = mem_width * bpp;
-	ms = bpp == 3 ? 1 : 4;
+	free(mp->valid);
+	for (i = 0; i < MIP_LEVELS; i++) free(mp->lvl[i][CHN_IMAGE]);
+	memset(mp, 0, sizeof(mipmap));
+}
 
-	src = mem_undo_previous(mem_channel);
-	mask = malloc(mem_width * (bpp + 1));
-	if (!mask)
+static int mip_alloc(mipmap *mp, image_info *image)
+{
+	unsigned char *mem;
+	size_t sz;
+	int i, l, n, w = image->width, h = image->height;
+
+	memcpy(mp->base, image->img, sizeof(chanlist));
+	mp->w = w; mp->h = h;
+	mp->tw = (w + MIP_TILE - 1) / MIP_TILE;
+	for (n = 3 , i = CHN_ALPHA; i < NUM_CHANNELS; i++) n += !!image->img[i];
+	mp->valid = calloc(mp->tw * ((h + MIP_TILE - 1) / MIP_TILE), 1);
+	for (l = 0; mp->valid && (l < MIP_LEVELS); l++)
 	{
-		memory_errors(1);
-		return;
+		/* One block per level */
+		sz = (size_t)MIP_W(w, l + 1) * MIP_W(h, l + 1);
+		if (!(mem = malloc(sz * n))) break;
+		mp->lvl[l][CHN_IMAGE] = mem;
+		mem += sz * 3;
+		for (i = CHN_ALPHA; i < NUM_CHANNELS; i++) if (image->img[i])
+			mp->lvl[l][i] = mem , mem += sz;
 	}
-	buf = mask + mem_width;
+	if (l < MIP_LEVELS) mip_free(mp);
+	return (!!mp->valid);
+}
 
-	progress_init(_("Applying Effect"), 1);
+/* Build level l of tile at tx, ty from level l - 1; at the edges, the last
+ * row and column get counted twice, for the average to still be right */
+static void mip_tile(mipmap *mp, int l, int tx, int ty)
+{
+	unsigned char **src = l > 1 ? mp->lvl[l - 2] : mp->base;
+	unsigned char **dest = mp->lvl[l - 1];
+	unsigned char *s0, *s1, *d, *a0, *a1;
+	int sw = MIP_W(mp->w, l - 1), sh = MIP_W(mp->h, l - 1);
+	int dw = MIP_W(mp->w, l), dh = MIP_W(mp->h, l);
+	int x, y, x0, y0, x1, y1, k, dx, dy, c, ss, ww[4];
 
-	for (i = 0; i < mem_height; i++)
+	x0 = (tx * MIP_TILE) >> l;
+	x1 = ((tx + 1) * MIP_TILE) >> l;
+	if (x1 > dw) x1 = dw;
+	y0 = (ty * MIP_TILE) >> l;
+	y1 = ((ty + 1) * MIP_TILE) >> l;
+	if (y1 > dh) y1 = dh;
+
+	for (y = y0; y < y1; y++)
 	{
-		row_protected(0, i, mem_width, tmp = mask);
-		dyp1 = i < mem_height - 1 ? ll : -ll;
-		dym1 = i ? -ll : ll;
-		dest = buf;
-		for (md = j = 0; j < ll; j++ , src++ , dest++)
-		{
-			op = *tmp;
-			/* One step for 1 or 3 bytes */
-			md += ms + (md >> 1);
-			tmp += md >> 2;
-			md &= 3;
-			if (op == 255) continue;
-			dxp1 = j < ll - bpp ? bpp : -bpp;
-			dxm1 = j >= bpp ? -bpp : bpp;
-			switch (type)
+		dy = y * 2 + 1 < sh ? sw : 0;
+
+		/* Utility channels are plain averages */
+		for (c = CHN_ALPHA; c < NUM_CHANNELS; c++)
+		{
+			if (!dest[c]) continue;
+			s0 = src[c] + y * 2 * sw;
+			s1 = s0 + dy;
+			d = dest[c] + y * dw;
+			for (x = x0; x < x1; x++)
 			{
-			case FX_EDGE: /* Edge detect */
-				k = *src;
-				k = abs(k - src[dym1]) + abs(k - src[dyp1]) +
-					abs(k - src[dxm1]) + abs(k - src[dxp1]);
-				k += k >> 1;
-				break;
-			case FX_EMBOSS: /* Emboss */
-				k = src[dym1] + src[dxm1] +
-					src[dxm1 + dym1] + src[dxp1 + dym1];
-				k = k / 4 - *src + 127;
-				break;
-			case FX_SHARPEN: /* Edge sharpen */
-				k = src[dym1] + src[dyp1] +
-					src[dxm1] + src[dxp1] - 4 * src[0];
-				k = *src - blur * k;
-				break;
-			case FX_SOFTEN: /* Edge soften */
-				k = src[dym1] + src[dyp1] +
-					src[dxm1] + src[dxp1] - 4 * src[0];
-				k = *src + (5 * k) / (125 - param);
-				break;
-			case FX_SOBEL: /* Another edge detector */
-				k = dist((src[dxp1] - src[dxm1]) * 2 +
-					src[dym1 + dxp1] - src[dym1 + dxm1] +
-					src[dyp1 + dxp1] - src[dyp1 + dxm1],
-					(src[dyp1] - src[dym1]) * 2 +
-					src[dyp1 + dxm1] + src[dyp1 + dxp1] -
-					src[dym1 + dxm1] - src[dym1 + dxp1]);
-				break;
-			case FX_PREWITT: /* Yet another edge detector */
+				k = x * 2;
+				dx = k + 1 < sw;
+				d[x] = (s0[k] + s0[k + dx] + s1[k] + s1[k + dx] +
+					2) >> 2;
+			}
+		}
+
+		/* Image gets weighted by alpha, if there is alpha */
+		s0 = src[CHN_IMAGE] + y * 2 * sw * 3;
+		s1 = s0 + dy * 3;
+		d = dest[CHN_IMAGE] + y * dw * 3;
+		if (!src[CHN_ALPHA])
+		{
+			for (x = x0; x < x1; x++)
+			{
+				k = x * 6;
+				dx = x * 2 + 1 < sw ? 3 : 0;
+				for (c = 0; c < 3; c++ , k++) d[x * 3 + c] =
+					(s0[k] + s0[k + dx] + s1[k] + s1[k + dx] +
+					2) >> 2;
+			}
+			continue;
+		}
+		a0 = src[CHN_ALPHA] + y * 2 * sw;
+		a1 = a0 + dy;
+		for (x = x0; x < x1; x++)
+		{
+			k = x * 2;
+			dx = k + 1 < sw;
+			ww[0] = a0[k]; ww[1] = a0[k + dx];
+			ww[2] = a1[k]; ww[3] = a1[k + dx];
+			ss = ww[0] + ww[1] + ww[2] + ww[3];
+			/* Fully transparent - use plain average */
+			if (!ss) ww[0] = ww[1] = ww[2] = ww[3] = 1 , ss = 4;
+			k *= 3; dx *= 3;
+			for (c = 0; c < 3; c++ , k++) d[x * 3 + c] =
+				(s0[k] * ww[0] + s0[k + dx] * ww[1] +
+				s1[k] * ww[2] + s1[k + dx] * ww[3] +
+				(ss >> 1)) / ss;
+		}
+	}
+}
+
+/* Get channels of level l, with the part from x0,y0 to x1,y1 (in image
+ * coordinates, exclusive) up to date; NULL if cannot */
+unsigned char **mip_get(image_info *image, int l, int x0, int y0, int x1, int y1)
+{
+	unsigned char **res = NULL;
+	mipmap *mp;
+	int i, tx, ty, tx0, tx1, ty1;
+	DEF_MUTEX(mip_lock); // Any render thread may be doing this
+
+	if ((l < 1) || (l > MIP_LEVELS) || (image->bpp != 3) ||
+		!image->img[CHN_IMAGE]) return (NULL);
+
+	/* Clip to image */
+	if (x0 < 0) x0 = 0;
+	if (y0 < 0) y0 = 0;
+	if (x1 > image->width) x1 = image->width;
+	if (y1 > image->height) y1 = image->height;
+	if ((x0 >= x1) || (y0 >= y1)) return (NULL);
+
+	LOCK_MUTEX(mip_lock);
+	/* Find image's mipmap, or a free slot for it */
+	for (mp = NULL , i = 0; i < MIP_MAX; i++)
+	{
+		if (!mips[i].valid)
+		{
+			if (!mp) mp = mips + i;
+			continue;
+		}
+		if (mips[i].base[CHN_IMAGE] != image->img[CHN_IMAGE]) continue;
+		mp = mips + i;
+		/* Same image, but something else changed */
+		if (memcmp(mp->base, image->img, sizeof(chanlist)) ||
+			(mp->w != image->width) || (mp->h != image->height))
+			mip_free(mp);
+		break;
+	}
+	if (mp && (mp->valid || mip_alloc(mp, image)))
+	{
+		tx0 = x0 / MIP_TILE;
+		tx1 = (x1 - 1) / MIP_TILE;
+		ty1 = (y1 - 1) / MIP_TILE;
+		for (ty = y0 / MIP_TILE; ty <= ty1; ty++)
+		for (tx = tx0; tx <= tx1; tx++)
+		{
+			unsigned char *v = mp->valid + ty * mp->tw + tx;
+
+			for (i = 1; i <= l; i++)
+			{
+				if (*v & (1 << i)) continue;
+				mip_tile(mp, i, tx, ty);
+				*v |= 1 << i;
+			}
+		}
+		res = mp->lvl[l - 1];
+	}
+	UNLOCK_MUTEX(mip_lock);
+
+	return (res);
+}
+
+/* Mark area as changed */
+void mip_update(image_info *image, int x, int y, int w, int h)
+{
+	mipmap *mp;
+	int i, tx, ty, tx1, ty1;
+
+	for (mp = mips , i = 0; i < MIP_MAX; i++ , mp++)
+	{
+		if (!mp->valid || (mp->base[CHN_IMAGE] != image->img[CHN_IMAGE]))
+			continue;
+		if (x < 0) w += x , x = 0;
+		if (y < 0) h += y , y = 0;
+		if (w > mp->w - x) w = mp->w - x;
+		if (h > mp->h - y) h = mp->h - y;
+		if ((w <= 0) || (h <= 0)) break;
+		tx1 = (x + w - 1) / MIP_TILE;
+		ty1 = (y + h - 1) / MIP_TILE;
+		for (ty = y / MIP_TILE; ty <= ty1; ty++)
+		for (tx = x / MIP_TILE; tx <= tx1; tx++)
+			mp->valid[ty * mp->tw + tx] = 0;
+		break;
+	}
+}
+
+/* Forget mipmaps of one image, or of all images if NULL */
+void mip_drop(image_info *image)
+{
+	int i;
+
+	for (i = 0; i < MIP_MAX; i++)
+	{
+		if (!mips[i].valid) continue;
+		if (image && (mips[i].base[CHN_IMAGE] != image->img[CHN_IMAGE]))
+			continue;
+		mip_free(mips + i);
+	}
+}
+
+
+////	EFFECTS
+
+static inline double dist(int n1, int n2)
+{
+	return (sqrt(n1 * n1 + n2 * n2));
+}
+
+typedef struct {
+	int type, param;
+	double blur;
+	unsigned char *mask;	// Mask & output row
+} effect_info;
+
+/* Apply effect to bytes J to J1-1 of a row */
+static void effect_bytes(effect_info *fx, unsigned char *src,
+	unsigned char *dest, int j, int j1, int ll, int bpp, int dym1, int dyp1)
+{
+	double blur = fx->blur;
+	int uninit_(k), k1, k2, dxp1, dxm1, type = fx->type, param = fx->param;
+
+	for (src += j , dest += j; j < j1; j++ , src++ , dest++)
+	{
+		dxp1 = j < ll - bpp ? bpp : -bpp;
+		dxm1 = j >= bpp ? -bpp : bpp;
+		if (ll == bpp) dxp1 = dxm1 = 0; // Single column
+		switch (type)
+		{
+		case FX_EDGE: /* Edge detect */
+			k = *src;
+			k = abs(k - src[dym1]) + abs(k - src[dyp1]) +
+				abs(k - src[dxm1]) + abs(k - src[dxp1]);
+			k += k >> 1;
+			break;
+		case FX_EMBOSS: /* Emboss */
+			k = src[dym1] + src[dxm1] +
+				src[dxm1 + dym1] + src[dxp1 + dym1];
+			k = k / 4 - *src + 127;
+			break;
+		case FX_SHARPEN: /* Edge sharpen */
+			k = src[dym1] + src[dyp1] +
+				src[dxm1] + src[dxp1] - 4 * src[0];
+			k = *src - blur * k;
+			break;
+		case FX_SOFTEN: /* Edge soften */
+			k = src[dym1] + src[dyp1] +
+				src[dxm1] + src[dxp1] - 4 * src[0];
+			k = *src + (5 * k) / (125 - param);
+			break;
+		case FX_SOBEL: /* Another edge detector */
+			k = dist((src[dxp1] - src[dxm1]) * 2 +
+				src[dym1 + dxp1] - src[dym1 + dxm1] +
+				src[dyp1 + dxp1] - src[dyp1 + dxm1],
+				(src[dyp1] - src[dym1]) * 2 +
+				src[dyp1 + dxm1] + src[dyp1 + dxp1] -
+				src[dym1 + dxm1] - src[dym1 + dxp1]);
+			break;
+		case FX_PREWITT: /* Yet another edge detector */
 /* Actually, the filter kernel used is "Robinson"; what is attributable to
  * Prewitt is "compass filtering", which can be done with other filter
  * kernels too - WJ */
-			case FX_KIRSCH: /* Compass detector with another kernel */
+		case FX_KIRSCH: /* Compass detector with another kernel */
 /* Optimized compass detection algorithm: I calculate three values (compass,
  * plus and minus) and then mix them according to filter type - WJ */
-				k = 0;
-				k1 = src[dyp1 + dxm1] - src[dxp1];
-				if (k < k1) k = k1;
-				k1 += src[dyp1] - src[dym1 + dxp1];
-				if (k < k1) k = k1;
-				k1 += src[dyp1 + dxp1] - src[dym1];
-				if (k < k1) k = k1;
-				k1 += src[dxp1] - src[dym1 + dxm1];
-				if (k < k1) k = k1;
-				k1 += src[dym1 + dxp1] - src[dxm1];
-				if (k < k1) k = k1;
-				k1 += src[dym1] - src[dyp1 + dxm1];
-				if (k < k1) k = k1;
-				k1 += src[dym1 + dxm1] - src[dyp1];
-				if (k < k1) k = k1;
-				k1 = src[dym1 + dxm1] + src[dym1] + src[dym1 + dxp1] +
-					src[dxm1] + src[dxp1];
-				k2 = src[dyp1 + dxm1] + src[dyp1] + src[dyp1 + dxp1];
-				if (type == FX_PREWITT)
-					k = k * 2 + k1 - k2 - src[0] * 2;
-				else /* if (type == FX_KIRSCH) */
-					k = (k * 8 + k1 * 3 - k2 * 5) / 4;
-					// Division is for equalizing weight of edge
-				break;
-			case FX_GRADIENT: /* Still another edge detector */
-				k = 4.0 * dist(src[dxp1] - src[0],
-					src[dyp1] - src[0]);
-				break;
-			case FX_ROBERTS: /* One more edge detector */
-				k = 4.0 * dist(src[dyp1 + dxp1] - src[0],
-					src[dxp1] - src[dyp1]);
-				break;
-			case FX_LAPLACE: /* The last edge detector... I hope */
-				k = src[dym1 + dxm1] + src[dym1] + src[dym1 + dxp1] +
-					src[dxm1] - 8 * src[0] + src[dxp1] +
-					src[dyp1 + dxm1] + src[dyp1] + src[dyp1 + dxp1];
-				break;
-			case FX_MORPHEDGE: /* Morphological edge detection */
-			case FX_ERODE: /* Greyscale erosion */
-				k = src[0];
-				if (k > src[dym1 + dxm1]) k = src[dym1 + dxm1];
-				if (k > src[dym1]) k = src[dym1];
-				if (k > src[dym1 + dxp1]) k = src[dym1 + dxp1];
-				if (k > src[dxm1]) k = src[dxm1];
-				if (k > src[dxp1]) k = src[dxp1];
-				if (k > src[dyp1 + dxm1]) k = src[dyp1 + dxm1];
-				if (k > src[dyp1]) k = src[dyp1];
-				if (k > src[dyp1 + dxp1]) k = src[dyp1 + dxp1];
-				if (type == FX_MORPHEDGE)
-					k = (src[0] - k) * 2;
-				break;
-			case FX_DILATE: /* Greyscale dilation */
-				k = src[0];
-				if (k < src[dym1 + dxm1]) k = src[dym1 + dxm1];
-				if (k < src[dym1]) k = src[dym1];
-				if (k < src[dym1 + dxp1]) k = src[dym1 + dxp1];
-				if (k < src[dxm1]) k = src[dxm1];
-				if (k < src[dxp1]) k = src[dxp1];
-				if (k < src[dyp1 + dxm1]) k = src[dyp1 + dxm1];
-				if (k < src[dyp1]) k = src[dyp1];
-				if (k < src[dyp1 + dxp1]) k = src[dyp1 + dxp1];
-				break;
+			k = 0;
+			k1 = src[dyp1 + dxm1] - src[dxp1];
+			if (k < k1) k = k1;
+			k1 += src[dyp1] - src[dym1 + dxp1];
+			if (k < k1) k = k1;
+			k1 += src[dyp1 + dxp1] - src[dym1];
+			if (k < k1) k = k1;
+			k1 += src[dxp1] - src[dym1 + dxm1];
+			if (k < k1) k = k1;
+			k1 += src[dym1 + dxp1] - src[dxm1];
+			if (k < k1) k = k1;
+			k1 += src[dym1] - src[dyp1 + dxm1];
+			if (k < k1) k = k1;
+			k1 += src[dym1 + dxm1] - src[dyp1];
+			if (k < k1) k = k1;
+			k1 = src[dym1 + dxm1] + src[dym1] + src[dym1 + dxp1] +
+				src[dxm1] + src[dxp1];
+			k2 = src[dyp1 + dxm1] + src[dyp1] + src[dyp1 + dxp1];
+			if (type == FX_PREWITT)
+				k = k * 2 + k1 - k2 - src[0] * 2;
+			else /* if (type == FX_KIRSCH) */
+				k = (k * 8 + k1 * 3 - k2 * 5) / 4;
+				// Division is for equalizing weight of edge
+			break;
+		case FX_GRADIENT: /* Still another edge detector */
+			k = 4.0 * dist(src[dxp1] - src[0],
+				src[dyp1] - src[0]);
+			break;
+		case FX_ROBERTS: /* One more edge detector */
+			k = 4.0 * dist(src[dyp1 + dxp1] - src[0],
+				src[dxp1] - src[dyp1]);
+			break;
+		case FX_LAPLACE: /* The last edge detector... I hope */
+			k = src[dym1 + dxm1] + src[dym1] + src[dym1 + dxp1] +
+				src[dxm1] - 8 * src[0] + src[dxp1] +
+				src[dyp1 + dxm1] + src[dyp1] + src[dyp1 + dxp1];
+			break;
+		case FX_MORPHEDGE: /* Morphological edge detection */
+		case FX_ERODE: /* Greyscale erosion */
+			k = src[0];
+			if (k > src[dym1 + dxm1]) k = src[dym1 + dxm1];
+			if (k > src[dym1]) k = src[dym1];
+			if (k > src[dym1 + dxp1]) k = src[dym1 + dxp1];
+			if (k > src[dxm1]) k = src[dxm1];
+			if (k > src[dxp1]) k = src[dxp1];
+			if (k > src[dyp1 + dxm1]) k = src[dyp1 + dxm1];
+			if (k > src[dyp1]) k = src[dyp1];
+			if (k > src[dyp1 + dxp1]) k = src[dyp1 + dxp1];
+			if (type == FX_MORPHEDGE)
+				k = (src[0] - k) * 2;
+			break;
+		case FX_DILATE: /* Greyscale dilation */
+			k = src[0];
+			if (k < src[dym1 + dxm1]) k = src[dym1 + dxm1];
+			if (k < src[dym1]) k = src[dym1];
+			if (k < src[dym1 + dxp1]) k = src[dym1 + dxp1];
+			if (k < src[dxm1]) k = src[dxm1];
+			if (k < src[dxp1]) k = src[dxp1];
+			if (k < src[dyp1 + dxm1]) k = src[dyp1 + dxm1];
+			if (k < src[dyp1]) k = src[dyp1];
+			if (k < src[dyp1 + dxp1]) k = src[dyp1 + dxp1];
+			break;
+		}
+		*dest = k < 0 ? 0 : k > 0xFF ? 0xFF : k;
+	}
+}
+
+#ifdef HAVE_X86_SIMD
+
+/* Same for 8 bytes at once, away from row ends; exact, as integer parts fit
+ * into 16 bits, and floating-point parts are done in doubles as before */
+static int effect_sse2(effect_info *fx, unsigned char *src,
+	unsigned char *dest, int j, int j1, int bpp, int dym1, int dyp1)
+{
+	__m128i z = _mm_setzero_si128(), k127 = _mm_set1_epi16(127);
+	__m128i c, u, d, l, r, ul, ur, dl, dr, k, k1, k2, t;
+	__m128d kd, d0, d1;
+	int type = fx->type;
+
+#define LD(O) _mm_unpacklo_epi8(_mm_loadl_epi64((__m128i *)(s + (O))), z)
+#define ABSD(A,B) _mm_max_epi16(_mm_sub_epi16(A, B), _mm_sub_epi16(B, A))
+#define ADD(A,B) _mm_add_epi16(A, B)
+#define SUB(A,B) _mm_sub_epi16(A, B)
+/* Low & high pairs of 4 ints, as doubles */
+#define PD0(V) _mm_cvtepi32_pd(V)
+#define PD1(V) _mm_cvtepi32_pd(_mm_srli_si128(V, 8))
+#define IPD(A,B) _mm_unpacklo_epi64(_mm_cvttpd_epi32(A), _mm_cvttpd_epi32(B))
+
+	if (type == FX_SHARPEN) kd = _mm_set1_pd(fx->blur);
+	else if (type == FX_SOFTEN) kd = _mm_set1_pd(125 - fx->param);
+	else kd = _mm_set1_pd(type == FX_SOBEL ? 1.0 : 4.0);
+
+	for (; j <= j1 - 8; j += 8)
+	{
+		unsigned char *s = src + j;
+
+		c = LD(0); u = LD(dym1); d = LD(dyp1); l = LD(-bpp); r = LD(bpp);
+		ul = LD(dym1 - bpp); ur = LD(dym1 + bpp);
+		dl = LD(dyp1 - bpp); dr = LD(dyp1 + bpp);
+		switch (type)
+		{
+		case FX_EDGE:
+			k = ADD(ADD(ABSD(c, u), ABSD(c, d)),
+				ADD(ABSD(c, l), ABSD(c, r)));
+			k = ADD(k, _mm_srai_epi16(k, 1));
+			break;
+		case FX_EMBOSS:
+			k = _mm_srli_epi16(ADD(ADD(u, l), ADD(ul, ur)), 2);
+			k = ADD(SUB(k, c), k127);
+			break;
+		case FX_SHARPEN:
+		case FX_SOFTEN:
+			k = SUB(ADD(ADD(u, d), ADD(l, r)), _mm_slli_epi16(c, 2));
+			if (type == FX_SOFTEN) k = ADD(k, _mm_slli_epi16(k, 2));
+			/* Widen to 32 bits */
+			t = _mm_srai_epi32(_mm_unpacklo_epi16(k, k), 16);
+			k = _mm_srai_epi32(_mm_unpackhi_epi16(k, k), 16);
+			k1 = _mm_unpacklo_epi16(c, z);
+			k2 = _mm_unpackhi_epi16(c, z);
+			if (type == FX_SHARPEN)
+			{
+				d0 = _mm_sub_pd(PD0(k1), _mm_mul_pd(kd, PD0(t)));
+				d1 = _mm_sub_pd(PD1(k1), _mm_mul_pd(kd, PD1(t)));
+				t = IPD(d0, d1);
+				d0 = _mm_sub_pd(PD0(k2), _mm_mul_pd(kd, PD0(k)));
+				d1 = _mm_sub_pd(PD1(k2), _mm_mul_pd(kd, PD1(k)));
+				k = IPD(d0, d1);
+			}
+			else
+			{
+				t = _mm_add_epi32(k1, IPD(_mm_div_pd(PD0(t), kd),
+					_mm_div_pd(PD1(t), kd)));
+				k = _mm_add_epi32(k2, IPD(_mm_div_pd(PD0(k), kd),
+					_mm_div_pd(PD1(k), kd)));
 			}
-			*dest = k < 0 ? 0 : k > 0xFF ? 0xFF : k;
+			k = _mm_packs_epi32(t, k);
+			break;
+		case FX_SOBEL:
+		case FX_GRADIENT:
+		case FX_ROBERTS:
+			if (type == FX_SOBEL)
+			{
+				k1 = ADD(_mm_slli_epi16(SUB(r, l), 1),
+					ADD(SUB(ur, ul), SUB(dr, dl)));
+				k2 = ADD(_mm_slli_epi16(SUB(d, u), 1),
+					SUB(ADD(dl, dr), ADD(ul, ur)));
+			}
+			else if (type == FX_GRADIENT)
+				k1 = SUB(r, c) , k2 = SUB(d, c);
+			else /* if (type == FX_ROBERTS) */
+				k1 = SUB(dr, c) , k2 = SUB(r, d);
+			/* Sums of squares */
+			t = _mm_unpacklo_epi16(k1, k2);
+			t = _mm_madd_epi16(t, t);
+			k = _mm_unpackhi_epi16(k1, k2);
+			k = _mm_madd_epi16(k, k);
+			t = IPD(_mm_mul_pd(kd, _mm_sqrt_pd(PD0(t))),
+				_mm_mul_pd(kd, _mm_sqrt_pd(PD1(t))));
+			k = IPD(_mm_mul_pd(kd, _mm_sqrt_pd(PD0(k))),
+				_mm_mul_pd(kd, _mm_sqrt_pd(PD1(k))));
+			k = _mm_packs_epi32(t, k);
+			break;
+		case FX_PREWITT:
+		case FX_KIRSCH:
+			k1 = SUB(dl, r);
+			k = _mm_max_epi16(z, k1);
+			k1 = ADD(k1, SUB(d, ur));
+			k = _mm_max_epi16(k, k1);
+			k1 = ADD(k1, SUB(dr, u));
+			k = _mm_max_epi16(k, k1);
+			k1 = ADD(k1, SUB(r, ul));
+			k = _mm_max_epi16(k, k1);
+			k1 = ADD(k1, SUB(ur, l));
+			k = _mm_max_epi16(k, k1);
+			k1 = ADD(k1, SUB(u, dl));
+			k = _mm_max_epi16(k, k1);
+			k1 = ADD(k1, SUB(ul, d));
+			k = _mm_max_epi16(k, k1);
+			k1 = ADD(ADD(ADD(ul, u), ADD(ur, l)), r);
+			k2 = ADD(ADD(dl, d), dr);
+			if (type == FX_PREWITT) k = SUB(ADD(_mm_slli_epi16(k, 1),
+				SUB(k1, k2)), _mm_slli_epi16(c, 1));
+			else /* if (type == FX_KIRSCH) */
+			{
+				k = ADD(_mm_slli_epi16(k, 3), SUB(ADD(k1,
+					_mm_slli_epi16(k1, 1)), ADD(k2,
+					_mm_slli_epi16(k2, 2))));
+				/* Divide by 4, rounding toward zero */
+				k = ADD(k, _mm_and_si128(_mm_srai_epi16(k, 15),
+					_mm_set1_epi16(3)));
+				k = _mm_srai_epi16(k, 2);
+			}
+			break;
+		case FX_LAPLACE:
+			k = ADD(ADD(ADD(ul, u), ADD(ur, l)),
+				ADD(ADD(r, dl), ADD(d, dr)));
+			k = SUB(k, _mm_slli_epi16(c, 3));
+			break;
+		case FX_MORPHEDGE:
+		case FX_ERODE:
+			k = _mm_min_epi16(_mm_min_epi16(_mm_min_epi16(c, ul),
+				_mm_min_epi16(u, ur)), _mm_min_epi16(
+				_mm_min_epi16(l, r), _mm_min_epi16(dl, d)));
+			k = _mm_min_epi16(k, dr);
+			if (type == FX_MORPHEDGE)
+				k = _mm_slli_epi16(SUB(c, k), 1);
+			break;
+		case FX_DILATE:
+			k = _mm_max_epi16(_mm_max_epi16(_mm_max_epi16(c, ul),
+				_mm_max_epi16(u, ur)), _mm_max_epi16(
+				_mm_max_epi16(l, r), _mm_max_epi16(dl, d)));
+			k = _mm_max_epi16(k, dr);
+			break;
+		default: return (j); // Unknown - leave it to scalar code
+		}
+		_mm_storel_epi64((__m128i *)(dest + j), _mm_packus_epi16(k, k));
+	}
+#undef LD
+#undef ABSD
+#undef ADD
+#undef SUB
+#undef PD0
+#undef PD1
+#undef IPD
+	return (j);
+}
+
+#endif
+
+static void do_effect_rows(tcb *thread)
+{
+	effect_info *fx = thread->data;
+	unsigned char *src, *row, *dest, *mask = fx->mask, *buf = mask + mem_width;
+	int i, j, ii, cnt = thread->nsteps, bpp = MEM_BPP, ll = mem_width * bpp;
+	int dyp1, dym1;
+
+	src = mem_undo_previous(mem_channel);
+	for (i = thread->step0 , ii = 0; ii < cnt; i++ , ii++)
+	{
+		row_protected(0, i, mem_width, mask);
+		dyp1 = i < mem_height - 1 ? ll : -ll;
+		dym1 = i ? -ll : ll;
+		if (mem_height == 1) dyp1 = dym1 = 0; // Single row
+		row = ROW_PTR(src, i, ll, 1);
+		j = 0;
+#ifdef HAVE_X86_SIMD
+		if (ll > bpp * 2) /* Do the middle with SIMD, the ends without */
+		{
+			effect_bytes(fx, row, buf, 0, bpp, ll, bpp, dym1, dyp1);
+			j = effect_sse2(fx, row, buf, bpp, ll - bpp, bpp,
+				dym1, dyp1);
 		}
-		dest = mem_img[mem_channel] + i * ll;
+#endif
+		effect_bytes(fx, row, buf, j, ll, ll, bpp, dym1, dyp1);
+		dest = ROW_PTR(mem_img[mem_channel], i, ll, 1);
 		process_img(0, 1, mem_width, mask, dest, dest, buf,
 			NULL, bpp, BLENDF_SET | BLENDF_INVM);
-		if ((i * 10) % mem_height >= mem_height - 10)
-			if (progress_update((float)(i + 1) / mem_height)) break;
+		if (thread_step(thread, ii + 1, cnt, 10)) break;
 	}
-	free(mask);
-	progress_end();
+	thread_done(thread);
+}
+
+void do_effect(int type, int param)
+{
+	effect_info fx;
+	threaddata *tdata;
+
+	fx.type = type;
+	fx.param = param;
+	fx.blur = (double)param / 200.0;
+	tdata = talloc(MA_ALIGN_DOUBLE, image_threads(mem_width, mem_height),
+		&fx, sizeof(fx),
+		NULL,
+		&fx.mask, mem_width * (MEM_BPP + 1),
+		NULL);
+	if (!tdata)
+	{
+		memory_errors(1);
+		return;
+	}
+	launch_threads(do_effect_rows, tdata, _("Applying Effect"), mem_height);
+	free(tdata);
 }
 
 /* Apply vertical filter */
@@ -7514,7 +9643,7 @@ static void vert_gauss(unsigned char *chan, int w, int h, int y, double *temp,
 	double gv = gaussY[0];
 	int j, k, mh2 = h > 1 ? h + h - 2 : 1;
 
-	src0 = chan + y * w;
+	src0 = ROW_PTR(chan, y, w, 1);
 	if (gcor) /* Gamma-correct RGB values */
 	{
 		for (j = 0; j < w; j++) temp[j] = gamma256[src0[j]] * gv;
@@ -7529,10 +9658,10 @@ static void vert_gauss(unsigned char *chan, int w, int h, int y, double *temp,
 
 		k = (y + j) % mh2;
 		if (k >= h) k = mh2 - k;
-		src0 = chan + k * w;
+		src0 = ROW_PTR(chan, k, w, 1);
 		k = abs(y - j) % mh2;
 		if (k >= h) k = mh2 - k;
-		src1 = chan + k * w;
+		src1 = ROW_PTR(chan, k, w, 1);
 		if (gcor) /* Gamma-correct */
 		{
 			for (k = 0; k < w; k++)
@@ -7551,6 +9680,257 @@ static void vert_gauss(unsigned char *chan, int w, int h, int y, double *temp,
 	}
 }
 
+/* Fast approximation for big kernels: Gaussian is least-squares fitted with
+ * a short cosine series over the same window, and each cosine term is kept as
+ * a running sum, updated in O(1) per pixel no matter the radius */
+
+#define FGAUSS_MAXK 8		/* Max cosine terms past the constant one */
+#define FGAUSS_MINR 32		/* Direct kernel is faster below this */
+#define FGAUSS_TOL (0.01 / 255.0)	/* Max L1 error of fitted kernel */
+
+/* Doubles needed for running sums of "n" values */
+#define FGAUSS_SIZE(k, n) ((k) ? (n) * ((k) * 2 + 4) : 0)
+
+typedef struct {
+	int r, k;	// Window radius, and number of terms; 0 if not used
+	double t;	// Base frequency
+	double a[FGAUSS_MAXK + 1];	// Weights of terms
+	double cw[FGAUSS_MAXK + 1], sw[FGAUSS_MAXK + 1]; // Shift by 1
+	double pr[FGAUSS_MAXK + 1], pi[FGAUSS_MAXK + 1]; // Shift by r + 1
+} fgauss;
+
+static int fgauss_fit(fgauss *fg, double radius, int len)
+{
+	double m[FGAUSS_MAXK + 1][FGAUSS_MAXK + 2], a[FGAUSS_MAXK + 1];
+	double exk, ws, g, d, cv, t;
+	int i, j, k, l, r = len - 1;
+
+	fg->k = 0;
+	if (!fast_gauss || (r < FGAUSS_MINR)) return (0);
+
+	/* Same kernel as in init_gauss() */
+	exk = -log(255.0) / ((radius + 1.0) * (radius + 1.0));
+	for (ws = 1.0 , j = 1; j <= r; j++) ws += 2.0 * exp((double)(j * j) * exk);
+	/* Period a bit longer than window makes for a much better fit */
+	fg->t = t = M_PI / ((r + 1) * 1.25);
+
+	for (k = 1; k <= FGAUSS_MAXK; k++)
+	{
+		/* Build normal equations */
+		memset(m, 0, sizeof(m));
+		for (j = 0; j <= r; j++)
+		{
+			g = exp((double)(j * j) * exk) / ws;
+			for (i = 0; i <= k; i++)
+			{
+				cv = cos(t * i * j) * (j ? 2.0 : 1.0);
+				for (l = 0; l <= k; l++) m[i][l] += cv * cos(t * l * j);
+				m[i][k + 1] += cv * g;
+			}
+		}
+		/* Solve them */
+		for (i = 0; i <= k; i++)
+		{
+			for (l = i , j = i + 1; j <= k; j++)
+				if (fabs(m[j][i]) > fabs(m[l][i])) l = j;
+			if (l != i) for (j = i; j <= k + 1; j++)
+			{
+				d = m[i][j]; m[i][j] = m[l][j]; m[l][j] = d;
+			}
+			if (m[i][i] == 0.0) return (0);
+			for (j = 0; j <= k; j++)
+			{
+				if (j == i) continue;
+				d = m[j][i] / m[i][i];
+				for (l = i; l <= k + 1; l++) m[j][l] -= d * m[i][l];
+			}
+		}
+		for (i = 0; i <= k; i++) a[i] = m[i][k + 1] / m[i][i];
+
+		/* Make the weights sum to 1, to leave flat areas alone */
+		for (d = 0.0 , j = -r; j <= r; j++)
+			for (i = 0; i <= k; i++) d += a[i] * cos(t * i * j);
+		a[0] += (1.0 - d) / (r + r + 1);
+
+		/* Measure the error */
+		for (d = 0.0 , j = 0; j <= r; j++)
+		{
+			g = exp((double)(j * j) * exk) / ws;
+			for (i = 0; i <= k; i++) g -= a[i] * cos(t * i * j);
+			d += fabs(g) * (j ? 2.0 : 1.0);
+		}
+		if (d < FGAUSS_TOL) break;
+	}
+	if (k > FGAUSS_MAXK) return (0);
+
+	fg->r = r;
+	for (i = 0; i <= k; i++)
+	{
+		fg->a[i] = a[i];
+		fg->cw[i] = cos(t * i);
+		fg->sw[i] = sin(t * i);
+		fg->pr[i] = cos(t * i * (r + 1));
+		fg->pi[i] = sin(t * i * (r + 1));
+	}
+	return (fg->k = k);
+}
+
+/* Load a row for vertical filter, assuming mirror boundary; in RGBA mode, it
+ * gets split into RGB, RGB * alpha, and alpha parts */
+static void fgauss_load(double *dest, unsigned char *chan, unsigned char *alpha,
+	int w, int bpp, int h, int y, int gcor)
+{
+	unsigned char *src;
+	double tv, *tmpa, *atmp;
+	int j, jj, mh2 = h > 1 ? h + h - 2 : 1;
+
+	y = abs(y) % mh2;
+	if (y >= h) y = mh2 - y;
+	src = ROW_PTR(chan, y, w, bpp);
+	if (!alpha)
+	{
+		w *= bpp;
+		if (gcor) for (j = 0; j < w; j++) dest[j] = gamma256[src[j]];
+		else for (j = 0; j < w; j++) dest[j] = src[j];
+		return;
+	}
+	alpha += y * w;
+	tmpa = dest + w * 3;
+	atmp = tmpa + w * 3;
+	for (j = jj = 0; j < w; j++)
+	{
+		atmp[j] = alpha[j];
+		dest[jj] = tv = gcor ? gamma256[src[jj]] : src[jj];
+		tmpa[jj++] = tv * alpha[j];
+		dest[jj] = tv = gcor ? gamma256[src[jj]] : src[jj];
+		tmpa[jj++] = tv * alpha[j];
+		dest[jj] = tv = gcor ? gamma256[src[jj]] : src[jj];
+		tmpa[jj++] = tv * alpha[j];
+	}
+}
+
+/* Apply fast vertical filter; "zs" holds running sums, which get initialized
+ * on the "first" row and then advanced to the next one */
+static void fgauss_vert(fgauss *fg, double *zs, int first, double *dest,
+	unsigned char *chan, unsigned char *alpha, int w, int bpp, int h, int y,
+	int gcor)
+{
+	double *buf, *buf2, *zr, *zi;
+	int i, j, l, n, k = fg->k, r = fg->r;
+
+	n = alpha ? w * 7 : w * bpp;
+	buf = zs;
+	buf2 = zs + n;
+	zs += n * 2;
+
+	if (first) /* Sum up the window */
+	{
+		memset(zs, 0, n * (k + 1) * 2 * sizeof(double));
+		for (j = -r; j <= r; j++)
+		{
+			fgauss_load(buf, chan, alpha, w, bpp, h, y + j, gcor);
+			for (i = 0; i <= k; i++)
+			{
+				double cv = cos(fg->t * i * j), sv = sin(fg->t * i * j);
+
+				zr = zs + n * 2 * i;
+				zi = zr + n;
+				for (l = 0; l < n; l++)
+				{
+					zr[l] += buf[l] * cv;
+					zi[l] += buf[l] * sv;
+				}
+			}
+		}
+	}
+
+	/* Combine the terms */
+	for (l = 0; l < n; l++) dest[l] = zs[l] * fg->a[0];
+	for (i = 1; i <= k; i++)
+	{
+		double av = fg->a[i];
+
+		zr = zs + n * 2 * i;
+		for (l = 0; l < n; l++) dest[l] += zr[l] * av;
+	}
+
+	/* Shift the window */
+	fgauss_load(buf, chan, alpha, w, bpp, h, y - r, gcor);
+	fgauss_load(buf2, chan, alpha, w, bpp, h, y + r + 1, gcor);
+	for (i = 0; i <= k; i++)
+	{
+		double cw = fg->cw[i], sw = fg->sw[i], pr = fg->pr[i], pi = fg->pi[i];
+
+		zr = zs + n * 2 * i;
+		zi = zr + n;
+		for (l = 0; l < n; l++)
+		{
+			double tr = zr[l] + buf2[l] * pr, ti = zi[l] + buf2[l] * pi;
+
+			zr[l] = tr * cw + ti * sw - buf[l] * pr;
+			zi[l] = ti * cw - tr * sw + buf[l] * pi;
+		}
+	}
+}
+
+/* Apply fast horizontal filter to extended row; the result is stored shifted
+ * left by window radius, same as hor_gauss3() does */
+static void fgauss_hor(double *temp, int w, int bpp, fgauss *fg)
+{
+	double zr[(FGAUSS_MAXK + 1) * 3], zi[(FGAUSS_MAXK + 1) * 3];
+	double sum, *src;
+	int i, j, c, l = w * bpp, k = fg->k, r = fg->r;
+
+	/* Sum up the window */
+	memset(zr, 0, sizeof(zr));
+	memset(zi, 0, sizeof(zi));
+	for (i = 0; i <= k; i++)
+	{
+		double cv = cos(fg->t * i * r), sv = -sin(fg->t * i * r), tv;
+
+		src = temp - r * bpp;
+		for (j = -r; j <= r; j++ , src += bpp)
+		{
+			for (c = 0; c < bpp; c++)
+			{
+				zr[i * 3 + c] += src[c] * cv;
+				zi[i * 3 + c] += src[c] * sv;
+			}
+			tv = cv * fg->cw[i] - sv * fg->sw[i];
+			sv = sv * fg->cw[i] + cv * fg->sw[i];
+			cv = tv;
+		}
+	}
+
+	/* Run it along the row */
+	src = temp - r * bpp;
+	for (j = 0; j < l; j += bpp , src += bpp)
+	{
+		for (c = 0; c < bpp; c++)
+		{
+			double xo, xi, *z0 = zr + c, *z1 = zi + c;
+
+			for (sum = 0.0 , i = 0; i <= k; i++) sum += z0[i * 3] * fg->a[i];
+			if (j + bpp < l)
+			{
+				xo = src[c];
+				xi = src[c + (r + r + 1) * bpp];
+				for (i = 0; i <= k; i++ , z0 += 3 , z1 += 3)
+				{
+					double tr = *z0 + xi * fg->pr[i],
+						ti = *z1 + xi * fg->pi[i];
+
+					*z0 = tr * fg->cw[i] + ti * fg->sw[i] -
+						xo * fg->pr[i];
+					*z1 = ti * fg->cw[i] - tr * fg->sw[i] +
+						xo * fg->pi[i];
+				}
+			}
+			src[c] = sum;
+		}
+	}
+}
+
 typedef struct {
 	double *gaussX, *gaussY, *temp;
 	unsigned char *mask;
@@ -7560,6 +9940,9 @@ typedef struct {
 	// For unsharp mask
 	int threshold;
 	double amount;
+	// For fast mode
+	fgauss fgX, fgY;
+	double *fgbuf;
 } gaussd;
 
 /* Extend horizontal array, using precomputed indices */
@@ -7600,16 +9983,43 @@ static void hor_gauss3(double *temp, int w, double *gaussX, int lenX,
 		x1 = x2 = j;
 		for (k = 1; k < lenX; k++)
 		{
-			double gv = gaussX[k];
-			x1 -= 3; x2 += 3;
-			sum0 += (temp[x1] + temp[x2]) * gv;
-			sum1 += (temp[x1 + 1] + temp[x2 + 1]) * gv;
-			sum2 += (temp[x1 + 2] + temp[x2 + 2]) * gv;
+			double gv = gaussX[k];
+			x1 -= 3; x2 += 3;
+			sum0 += (temp[x1] + temp[x2]) * gv;
+			sum1 += (temp[x1 + 1] + temp[x2 + 1]) * gv;
+			sum2 += (temp[x1 + 2] + temp[x2 + 2]) * gv;
+		}
+		temp[x1] = sum0;
+		temp[x1 + 1] = sum1;
+		temp[x1 + 2] = sum2;
+	}
+}
+
+/* Apply horizontal filter of either kind to extended row, return where the
+ * result is; mask is only used to skip pixels */
+static double *hor_blur(double *temp, int w, int bpp, double *gauss, int len,
+	fgauss *fg, unsigned char *mask)
+{
+	double sum;
+	int j, k;
+
+	if (fg->k)
+	{
+		fgauss_hor(temp, w, bpp, fg);
+		return (temp - fg->r * bpp);
+	}
+	if (bpp == 3) hor_gauss3(temp, w, gauss, len, mask);
+	else for (j = 0; j < w; j++)
+	{
+		if (mask[j] == 255) continue;
+		sum = temp[j] * gauss[0];
+		for (k = 1; k < len; k++)
+		{
+			sum += (temp[j - k] + temp[j + k]) * gauss[k];
 		}
-		temp[x1] = sum0;
-		temp[x1 + 1] = sum1;
-		temp[x1 + 2] = sum2;
+		temp[j - len + 1] = sum;
 	}
+	return (temp - (len - 1) * bpp);
 }
 
 // !!! Will need extra checks if used for out-of-range values
@@ -7679,26 +10089,36 @@ static void gauss_filter(tcb *thread)
 	temp = gd->temp + (lenX - 1) * bpp;
 	for (i = thread->step0 , ii = 0; ii < cnt; i++ , ii++)
 	{
-		vert_gauss(chan, wid, mem_height, i, temp, gd->gaussY, gd->lenY, gcor);
+		if (gd->fgY.k) fgauss_vert(&gd->fgY, gd->fgbuf, !ii, temp,
+			chan, NULL, mem_width, bpp, mem_height, i, gcor);
+		else vert_gauss(chan, wid, mem_height, i, temp,
+			gd->gaussY, gd->lenY, gcor);
 		gauss_extend(gd, temp, mem_width, bpp);
 		row_protected(0, i, mem_width, mask);
-		dest = mem_img[channel] + i * wid;
+		dest = ROW_PTR(mem_img[channel], i, wid, 1);
 		if (bpp == 3) /* Run 3-bpp horizontal filter */
 		{
-			hor_gauss3(temp, mem_width, gaussX, lenX, mask);
+			if (gd->fgX.k) fgauss_hor(temp, mem_width, 3, &gd->fgX);
+			else hor_gauss3(temp, mem_width, gaussX, lenX, mask);
 			pack_row3(dest, gd->temp, mem_width, gcor, mask);
 		}
 		else /* Run 1-bpp horizontal filter - no gamma here */
 		{
 			int j, k, k0;
 
+			if (gd->fgX.k) fgauss_hor(temp, mem_width, 1, &gd->fgX);
 			for (j = 0; j < mem_width; j++)
 			{
 				if (mask[j] == 255) continue;
-				sum = temp[j] * gaussX[0];
-				for (k = 1; k < lenX; k++)
+				if (gd->fgX.k) sum = gd->temp[j];
+				else
 				{
-					sum += (temp[j - k] + temp[j + k]) * gaussX[k];
+					sum = temp[j] * gaussX[0];
+					for (k = 1; k < lenX; k++)
+					{
+						sum += (temp[j - k] + temp[j + k]) *
+							gaussX[k];
+					}
 				}
 				k0 = rint(sum);
 				k0 = k0 * 255 + (dest[j] - k0) * mask[j];
@@ -7732,14 +10152,27 @@ static void gauss_filter_rgba(tcb *thread)
 	atmp = tmpa + mem_width * 3 + (lenX - 1) * (3 + 1);
 	for (i = thread->step0 , ii = 0; ii < cnt; i++ , ii++)
 	{
-		/* Apply vertical filter */
+		if (gd->fgY.k) /* Apply fast vertical filter */
+		{
+			double *vbuf = gd->fgbuf +
+				FGAUSS_SIZE(gd->fgY.k, mem_width * 7);
+
+			fgauss_vert(&gd->fgY, gd->fgbuf, !ii, vbuf, chan, alpha,
+				mem_width, 3, mem_height, i, gcor);
+			memcpy(temp, vbuf, mem_width * 3 * sizeof(double));
+			memcpy(tmpa, vbuf + mem_width * 3,
+				mem_width * 3 * sizeof(double));
+			memcpy(atmp, vbuf + mem_width * 6,
+				mem_width * sizeof(double));
+		}
+		else /* Apply vertical filter */
 		{
 			unsigned char *srcc, *src0, *src1;
 			unsigned char *alff, *alf0, *alf1;
 			int j, k;
 
-			alff = alpha + i * mem_width;
-			srcc = chan + i * mem_width * 3;
+			alff = ROW_PTR(alpha, i, mem_width, 1);
+			srcc = ROW_PTR(chan, i, mem_width, 3);
 			if (gcor) /* Gamma correct */
 			{
 				double gk = gaussY[0];
@@ -7782,12 +10215,12 @@ static void gauss_filter_rgba(tcb *thread)
 
 				k = (i + j) % mh2;
 				if (k >= mem_height) k = mh2 - k;
-				alf0 = alpha + k * mem_width;
-				src0 = chan + k * mem_width * 3;
+				alf0 = ROW_PTR(alpha, k, mem_width, 1);
+				src0 = ROW_PTR(chan, k, mem_width, 3);
 				k = abs(i - j) % mh2;
 				if (k >= mem_height) k = mh2 - k;
-				alf1 = alpha + k * mem_width;
-				src1 = chan + k * mem_width * 3;
+				alf1 = ROW_PTR(alpha, k, mem_width, 1);
+				src1 = ROW_PTR(chan, k, mem_width, 3);
 				if (gcor) /* Gamma correct */
 				{
 					int k, kk;
@@ -7844,9 +10277,44 @@ static void gauss_filter_rgba(tcb *thread)
 		gauss_extend(gd, tmpa, mem_width, 3);
 		gauss_extend(gd, atmp, mem_width, 1);
 		row_protected(0, i, mem_width, mask);
-		dest = mem_img[CHN_IMAGE] + i * mem_width * 3;
-		dsta = mem_img[CHN_ALPHA] + i * mem_width;
-		/* Horizontal RGBA filter */
+		dest = ROW_PTR(mem_img[CHN_IMAGE], i, mem_width, 3);
+		dsta = ROW_PTR(mem_img[CHN_ALPHA], i, mem_width, 1);
+		if (gd->fgX.k) /* Fast horizontal RGBA filter */
+		{
+			double *tmpao, *atmpo;
+			int j, jj, k, kk;
+
+			fgauss_hor(temp, mem_width, 3, &gd->fgX);
+			fgauss_hor(tmpa, mem_width, 3, &gd->fgX);
+			fgauss_hor(atmp, mem_width, 1, &gd->fgX);
+			/* Results are where the rows' extensions were */
+			tmpao = tmpa - (lenX - 1) * 3;
+			atmpo = atmp - (lenX - 1);
+			for (j = jj = 0; j < mem_width; j++ , jj += 3)
+			{
+				if (mask[j] == 255) continue;
+
+				sum = atmpo[j];
+				k = rint(sum);
+				src = gd->temp;
+				mult = 1.0;
+				if (k)
+				{
+					src = tmpao;
+					mult /= sum;
+				}
+				kk = mask[j];
+				k = k * 255 + (dsta[j] - k) * kk;
+				if (k) mask[j] = (255 * kk * dsta[j]) / k;
+				dsta[j] = (k + (k >> 8) + 1) >> 8;
+
+				gd->temp[jj] = src[jj] * mult;
+				gd->temp[jj + 1] = src[jj + 1] * mult;
+				gd->temp[jj + 2] = src[jj + 2] * mult;
+			}
+			pack_row3(dest, gd->temp, mem_width, gcor, mask);
+		}
+		else /* Horizontal RGBA filter */
 		{
 			int j, jj, k, kk, x1, x2;
 
@@ -7899,7 +10367,7 @@ static void gauss_filter_rgba(tcb *thread)
 static threaddata *init_gauss(gaussd *gd, double radiusX, double radiusY, int mode)
 {
 	threaddata *tdata;
-	int i, j, k, l, lenX, lenY, w, bpp = MEM_BPP;
+	int i, j, k, l, lenX, lenY, w, fw, bpp = MEM_BPP;
 	double sum, exkX, exkY, *gauss;
 
 
@@ -7909,6 +10377,10 @@ static threaddata *init_gauss(gaussd *gd, double radiusX, double radiusY, int mo
 	exkX = -log(255.0) / ((radiusX + 1.0) * (radiusX + 1.0));
 	exkY = -log(255.0) / ((radiusY + 1.0) * (radiusY + 1.0));
 
+	/* Prepare fast filters where they'd help */
+	fgauss_fit(&gd->fgX, radiusX, lenX);
+	fgauss_fit(&gd->fgY, radiusY, lenY);
+
 	/* Allocate memory */
 	if (mode == 1) i = 7;			/* Extra linebuffer for RGBA */
 	else if (mode == 2) i = bpp + bpp;	/* Extra buffer in DoG mode */
@@ -7916,6 +10388,12 @@ static threaddata *init_gauss(gaussd *gd, double radiusX, double radiusY, int mo
 	l = 2 * (lenX - 1);
 	w = mem_width + l;
 
+	/* Running sums for fast vertical filter */
+	fw = mem_width * (mode == 1 ? 7 : bpp);
+	j = FGAUSS_SIZE(gd->fgY.k, fw);
+	if (mode == 1) j += j ? fw : 0; /* Extra linebuffer for RGBA */
+	if (mode == 2) j += FGAUSS_SIZE(gd->fgX.k, fw); /* Both run vertical */
+
 	tdata = talloc(MA_ALIGN_DOUBLE,
 		image_threads(mem_width, mem_height),
 		gd, sizeof(gaussd),
@@ -7925,6 +10403,7 @@ static threaddata *init_gauss(gaussd *gd, double radiusX, double radiusY, int mo
 		NULL, 
 		&gd->temp, i * w * sizeof(double),
 		&gd->mask, mem_width,
+		&gd->fgbuf, j * sizeof(double),
 		NULL);
 	if (!tdata) return (NULL);
 
@@ -8031,15 +10510,19 @@ static void unsharp_filter(tcb *thread)
 	temp = gd->temp + (lenX - 1) * bpp;
 	for (i = thread->step0 , ii = 0; ii < cnt; i++ , ii++)
 	{
-		vert_gauss(chan, wid, mem_height, i, temp, gd->gaussY, gd->lenY, gcor);
+		if (gd->fgY.k) fgauss_vert(&gd->fgY, gd->fgbuf, !ii, temp,
+			chan, NULL, mem_width, bpp, mem_height, i, gcor);
+		else vert_gauss(chan, wid, mem_height, i, temp,
+			gd->gaussY, gd->lenY, gcor);
 		gauss_extend(gd, temp, mem_width, bpp);
 		row_protected(0, i, mem_width, mask);
-		dest = mem_img[channel] + i * wid;
+		dest = ROW_PTR(mem_img[channel], i, wid, 1);
 		if (bpp == 3) /* Run 3-bpp horizontal filter */
 		{
 			int j, jj, k, k1, k2;
 
-			hor_gauss3(temp, mem_width, gaussX, lenX, mask);
+			if (gd->fgX.k) fgauss_hor(temp, mem_width, 3, &gd->fgX);
+			else hor_gauss3(temp, mem_width, gaussX, lenX, mask);
 			/* Threshold to mask */
 			if (threshold) for (j = jj = 0; jj < mem_width; jj++ , j += 3)
 			{
@@ -8082,13 +10565,19 @@ static void unsharp_filter(tcb *thread)
 		{
 			int j, k;
 
+			if (gd->fgX.k) fgauss_hor(temp, mem_width, 1, &gd->fgX);
 			for (j = 0; j < mem_width; j++)
 			{
 				if (mask[j] == 255) continue;
-				sum = temp[j] * gaussX[0];
-				for (k = 1; k < lenX; k++)
+				if (gd->fgX.k) sum = gt[j];
+				else
 				{
-					sum += (temp[j - k] + temp[j + k]) * gaussX[k];
+					sum = temp[j] * gaussX[0];
+					for (k = 1; k < lenX; k++)
+					{
+						sum += (temp[j - k] + temp[j + k]) *
+							gaussX[k];
+					}
 				}
 				k = rint(sum);
 				/* Threshold */
@@ -8172,12 +10661,39 @@ static void dog_filter(tcb *thread)
 	tmp2 = tmp1 + wid + (lenW - 1) * bpp * 2;
 	for (i = thread->step0 , ii = 0; ii < cnt; i++ , ii++)
 	{
-		vert_gauss(chan, wid, mem_height, i, tmp1, gaussW, lenW, gcor);
-		vert_gauss(chan, wid, mem_height, i, tmp2, gaussN, lenN, gcor);
+		if (gd->fgX.k) fgauss_vert(&gd->fgX, gd->fgbuf +
+			FGAUSS_SIZE(gd->fgY.k, wid), !ii, tmp1, chan, NULL,
+			mem_width, bpp, mem_height, i, gcor);
+		else vert_gauss(chan, wid, mem_height, i, tmp1, gaussW, lenW, gcor);
+		if (gd->fgY.k) fgauss_vert(&gd->fgY, gd->fgbuf, !ii, tmp2,
+			chan, NULL, mem_width, bpp, mem_height, i, gcor);
+		else vert_gauss(chan, wid, mem_height, i, tmp2, gaussN, lenN, gcor);
 		gauss_extend(gd, tmp1, mem_width, bpp);
 		gauss_extend(gd, tmp2, mem_width, bpp);
-		dest = mem_img[channel] + i * wid;
-		if (bpp == 3) /* Run 3-bpp horizontal filter */
+		dest = ROW_PTR(mem_img[channel], i, wid, 1);
+		if (gd->fgX.k || gd->fgY.k) /* Filter rows one by one */
+		{
+			double *res1, *res2;
+			int j, k;
+
+			res1 = hor_blur(tmp1, mem_width, bpp, gaussW, lenW,
+				&gd->fgX, gd->mask);
+			res2 = hor_blur(tmp2, mem_width, bpp, gaussN, lenN,
+				&gd->fgY, gd->mask);
+			/* Same conversion as the direct filters below */
+			for (j = 0; j < wid; j++)
+			{
+				sum = res1[j] - res2[j];
+				if (gcor && (bpp == 3)) k = UNGAMMA256X(sum);
+				else
+				{
+					k = rint(sum);
+					k = k < 0 ? 0 : k;
+				}
+				dest[j] = k;
+			}
+		}
+		else if (bpp == 3) /* Run 3-bpp horizontal filter */
 		{
 			int j, jj, k, k1, k2;
 
@@ -8312,139 +10828,153 @@ void mem_dog(double radiusW, double radiusN, int norm, int gcor)
 }
 
 
-/* !!! Kuwahara-Nagao filter's radius is limited to 255, to use byte offsets */
+/* Kuwahara-Nagao filter picks, for each pixel, the minimum-variance square
+ * among all (r+1)x(r+1) squares containing it. Square sums are taken from a
+ * row of summed-area table, built from running column sums, and the minimum
+ * search uses monotonic queues - first along the row, then down each column;
+ * so per-pixel cost doesn't depend on radius */
+typedef struct {
+	double v;	// Variance
+	int y;		// Bottom row
+	unsigned char rgb[3];	// Average color
+} kuwahara_square;
+
 typedef struct {
 	int *idx;	// Index array
-	double *rs;	// Sum of gamma-corrected RGB if using gamma
-	int *avg;	// Sum of pixel values (for average)
-	int *dis;	// Sum of pixel values squared (for variance)
-	unsigned char *min;	// Offset to minimum-variance square
+	int *cs;	// Column sums of RGB & RGB squared
+	double *gs;	// Column sums of gamma-corrected RGB
+	unsigned int *sat;	// Summed-area table row for RGB & RGB squared
+	double *gsat;	// Same for gamma-corrected RGB
+	double *var;	// Variances of squares ending on the row
+	unsigned char *rgb;	// Average colors of same
+	int *hq;	// Queue of row's squares
+	kuwahara_square *vq;	// Queues of minimum squares, per column
+	int *vh;	// Queue heads & lengths
+	unsigned char *mask, *timg;	// Mask & output rows buffer
 	double r2i;	// 1/r^2 to multiply things with
 	int w, r;	// Row width & filter radius
 	int gcor;	// Gamma correction toggle
-	int l, rl;	// Row array lengths
+	int detail;	// Details protection toggle
 } kuwahara_info;
 
-/* This function uses running sums, which gives x87 FPU's "precision jitter"
- * a chance to accumulate; to avoid, reduced-precision gamma is used - WJ */
-static void kuwahara_row(unsigned char *src, int base, int add, kuwahara_info *info)
+/* Add or subtract a row to/from column sums; these are running sums, which
+ * gives x87 FPU's "precision jitter" a chance to accumulate, so reduced-
+ * precision gamma is used to avoid it */
+static void kuwahara_cols(unsigned char *src, int add, kuwahara_info *info)
 {
-	double rs0 = 0.0, rs1 = 0.0, rs2 = 0.0;
-	int avg[3] = { 0, 0, 0 }, dis[3] = { 0, 0, 0 };
-	int i, w, r = info->r, gc = info->gcor, *idx = info->idx;
+	double *gs = info->gs;
+	int i, l = info->w + info->r * 2, *cs = info->cs, *idx = info->idx;
+	int d = add ? 1 : -1;
 
-	w = info->w + r++;
-	for (i = -r; i < w; i++)
+	for (i = 0; i < l; i++ , cs += 4)
 	{
-		unsigned char *tvv;
-		int tv, i3, *iavg, *idis;
+		unsigned char *tvv = src + idx[i];
+		int v0 = tvv[0], v1 = tvv[1], v2 = tvv[2];
 
-		tvv = src + idx[i];
-		avg[0] += (tv = tvv[0]);
-		dis[0] += tv * tv;
-		avg[1] += (tv = tvv[1]);
-		dis[1] += tv * tv;
-		avg[2] += (tv = tvv[2]);
-		dis[2] += tv * tv;
-		if (gc)
-		{
-			rs0 += Fgamma256[tvv[0]];
-			rs1 += Fgamma256[tvv[1]];
-			rs2 += Fgamma256[tvv[2]];
-		}
-		if (i < 0) continue;
-
-		tvv = src + idx[i - r];
-		avg[0] -= (tv = tvv[0]);
-		dis[0] -= tv * tv;
-		avg[1] -= (tv = tvv[1]);
-		dis[1] -= tv * tv;
-		avg[2] -= (tv = tvv[2]);
-		dis[2] -= tv * tv;
-		i3 = (base + i) * 3;
-		iavg = info->avg + i3;
-		idis = info->dis + i3;
-		if (add)
-		{
-			iavg[0] += avg[0];
-			iavg[1] += avg[1];
-			iavg[2] += avg[2];
-			idis[0] += dis[0];
-			idis[1] += dis[1];
-			idis[2] += dis[2];
-		}
-		else
-		{
-			iavg[0] -= avg[0];
-			iavg[1] -= avg[1];
-			iavg[2] -= avg[2];
-			idis[0] -= dis[0];
-			idis[1] -= dis[1];
-			idis[2] -= dis[2];
-		}
-		if (gc)
-		{
-			double *irs = info->rs + i3;
+		cs[0] += v0 * d;
+		cs[1] += v1 * d;
+		cs[2] += v2 * d;
+		cs[3] += (v0 * v0 + v1 * v1 + v2 * v2) * d;
+	}
+	if (!info->gcor) return;
+	for (i = 0; i < l; i++ , gs += 3)
+	{
+		unsigned char *tvv = src + idx[i];
 
-			rs0 -= Fgamma256[tvv[0]];
-			rs1 -= Fgamma256[tvv[1]];
-			rs2 -= Fgamma256[tvv[2]];
-			if (add)
-			{
-				irs[0] += rs0;
-				irs[1] += rs1;
-				irs[2] += rs2;
-			}
-			else
-			{
-				irs[0] -= rs0;
-				irs[1] -= rs1;
-				irs[2] -= rs2;
-			}
-		}
+		gs[0] += Fgamma256[tvv[0]] * d;
+		gs[1] += Fgamma256[tvv[1]] * d;
+		gs[2] += Fgamma256[tvv[2]] * d;
 	}
 }
 
-static void kuwahara_copy(int dest, int src, kuwahara_info *info)
+/* Calculate variances & averages for all squares ending on current row */
+static void kuwahara_squares(kuwahara_info *info)
 {
-	src *= 3; dest *= 3;
-	memcpy(info->rs + dest, info->rs + src, info->rl * 3 * sizeof(double));
-	memcpy(info->avg + dest, info->avg + src, info->l * 3 * sizeof(int));
-	memcpy(info->dis + dest, info->dis + src, info->l * 3 * sizeof(int));
-}
+	unsigned int *sat = info->sat;
+	unsigned char *rgb = info->rgb;
+	double *gsat = info->gsat, r2i = info->r2i;
+	int i, l = info->w + info->r * 2, r4 = (info->r + 1) * 4, *cs = info->cs;
 
-static double kuwahara_square(int idx, kuwahara_info *info)
-{
-	double r2i = info->r2i;
-	int *dp = info->dis + idx * 3, *ap = info->avg + idx * 3;
-	// !!! Multiplication is done this way to avoid integer overflow
-	return (dp[0] + dp[1] + dp[2] - ((r2i * ap[0]) * ap[0] +
-		(r2i * ap[1]) * ap[1] + (r2i * ap[2]) * ap[2]));
+	/* Build the summed-area row; unsigned, so wraparound is harmless */
+	sat[0] = sat[1] = sat[2] = sat[3] = 0;
+	for (i = 0; i < l * 4; i++) sat[i + 4] = sat[i] + cs[i];
+	if (info->gcor)
+	{
+		double *gs = info->gs;
+
+		gsat[0] = gsat[1] = gsat[2] = 0.0;
+		for (i = 0; i < l * 3; i++) gsat[i + 3] = gsat[i] + gs[i];
+	}
+
+	/* Take the squares from it */
+	l = info->w + info->r;
+	for (i = 0; i < l; i++ , sat += 4 , rgb += 3)
+	{
+		int a0 = sat[r4 + 0] - sat[0], a1 = sat[r4 + 1] - sat[1],
+			a2 = sat[r4 + 2] - sat[2];
+		unsigned int d = sat[r4 + 3] - sat[3];
+
+		// !!! Multiplication is done this way to avoid integer overflow
+		info->var[i] = d - ((r2i * a0) * a0 + (r2i * a1) * a1 +
+			(r2i * a2) * a2);
+		if (info->gcor)
+		{
+			double *g0 = gsat + i * 3, *g1 = g0 + (r4 / 4) * 3;
+			rgb[0] = UNGAMMA256((g1[0] - g0[0]) * r2i);
+			rgb[1] = UNGAMMA256((g1[1] - g0[1]) * r2i);
+			rgb[2] = UNGAMMA256((g1[2] - g0[2]) * r2i);
+		}
+		else
+		{
+			rgb[0] = rint(a0 * r2i);
+			rgb[1] = rint(a1 * r2i);
+			rgb[2] = rint(a2 * r2i);
+		}
+	}
 }
 
-/* For each X, locate the square with minimum variance & store its offset */
-static void kuwahara_min(int base, kuwahara_info *info)
+/* For each X, queue up the minimum-variance square of those ending on row Y;
+ * then if given a buffer, store there the colors of minimum-variance squares
+ * among those ending on rows Y-r to Y */
+static void kuwahara_min(int y, unsigned char *dest, kuwahara_info *info)
 {
-	double da[256];
-	int i, j, j1, w = info->w, r = info->r, min = -1;
+	kuwahara_square *q, *p;
+	double v, *var = info->var;
+	int i, j, k, h, t, vh0, n, w = info->w, r = info->r, r1 = r + 1;
+	int yk = y % r1, *hq = info->hq, *vh = info->vh;
 
-	for (i = 0; i < r; i++) da[i] = kuwahara_square(base + i, info);
-	for (i = 0; i < w; i++)
+	for (i = j = h = t = 0; i < w; i++ , vh += 2)
 	{
-		j1 = (i + r) & 255;
-		da[j1] = kuwahara_square(base + (i + r), info);
-		if (min > i) // Old minimum still valid
+		/* The rightmost of equal minimums wins */
+		for (; j <= i + r; j++)
 		{
-			if (da[j1] <= da[min & 255]) min = i + r;
+			while ((t > h) && (var[hq[t - 1]] >= var[j])) t--;
+			hq[t++] = j;
 		}
-		else // Forced to find a new one
+		if (hq[h] < i) h++;
+		v = var[k = hq[h]];
+
+		/* Of equal minimums in column, the one with lowest Y % (r+1)
+		 * wins, as it did when squares were kept in a ring buffer */
+		q = info->vq + i * r1;
+		vh0 = vh[0]; n = vh[1];
+		if (n && (q[vh0].y <= y - r1)) // Outgoing
+		{
+			if (++vh0 >= r1) vh0 = 0;
+			n--;
+		}
+		for (; n; n--)
 		{
-			min = i;
-			for (j = 1; j <= r; j++)
-				if (da[(i + j) & 255] <= da[min & 255])
-					min = i + j;
+			p = q + (vh0 + n - 1) % r1;
+			if ((p->v < v) || ((p->v == v) && (p->y % r1 < yk))) break;
 		}
-		info->min[base + i] = min - i;
+		p = q + (vh0 + n++) % r1;
+		p->v = v;
+		p->y = y;
+		memcpy(p->rgb, info->rgb + k * 3, 3);
+		vh[0] = vh0; vh[1] = n;
+
+		if (dest) memcpy(dest + i * 3, q[vh0].rgb, 3);
 	}
 }
 
@@ -8528,167 +11058,136 @@ static int idx2row(int idx)
 	return (j);
 }
 
-/* RGB only - cannot be generalized without speed loss */
-void mem_kuwahara(int r, int gcor, int detail)
+static void kuwahara_rows(tcb *thread)
 {
-	kuwahara_info info;
-	unsigned char *mem, *src, *buf, *mask, *tmp, *timg, *tx;
-	int i, j, k, l, ir, len, rl, r1 = r + 1;
-	int w = mem_width * 3, wbuf = w + 3 * 2, ch = mem_channel;
-	double r2i = 1.0 / (double)(r1 * r1);
-
-
-	if (mem_img_bpp != 3) return; // Sanity check
-
-	len = mem_width + r + r + 1;
-	info.l = l = mem_width + r;
-	info.rl = rl = gcor ? l : 0;
-	mem = multialloc(MA_ALIGN_DOUBLE,
-		&info.rs, rl * r1 * 3 * sizeof(double),
-		&info.avg, l * r1 * 3 * sizeof(int),
-		&info.dis, l * r1 * 3 * sizeof(int),
-		&info.idx, len * sizeof(int),
-		&info.min, l * r1,
-		&mask, mem_width,
-		&timg, wbuf * 3,
-		NULL);
-	if (!mem)
-	{
-		memory_errors(1);
-		return;
-	}
-	info.r2i = r2i; info.w = mem_width; info.r = r; info.gcor = gcor;
-
-	progress_init(_("Kuwahara-Nagao Filter"), 1);
-	info.idx += r1;
-	if (mem_width > 1) // All indices remain zero otherwise
-	{
-		k = mem_width + mem_width - 2;
-		for (i = -(r + 1); i < mem_width + r; i++)
-		{
-			j = abs(i) % k;
-			if (j >= mem_width) j = k - j;
-			info.idx[i] = j * 3;
-		}
-	}
+	kuwahara_info *info = thread->data;
+	unsigned char *src, *buf, *tmp, *tx, *mask = info->mask, *timg = info->timg;
+	int i, y, y0, y1, f0, f1, r = info->r, detail = info->detail;
+	int w = mem_width * 3, wbuf = w + 3 * 2, cnt = thread->nsteps;
 
-	mem_channel = CHN_IMAGE; // For row_protected()
 	src = mem_undo_previous(CHN_IMAGE);
-	/* Initialize the bottom sum */
-	for (i = -r; i <= 0; i++)
-		kuwahara_row(src + idx2row(i) * w, 0, TRUE, &info);
-	kuwahara_min(0, &info);
-	/* Initialize the rest of sums */
-	for (i = 1; i <= r; i++)
-	{
-		int j = l * i;
-		kuwahara_copy(j, j - l, &info);
-		kuwahara_row(src + idx2row(i - r1) * w, j, FALSE, &info);
-		kuwahara_row(src + idx2row(i) * w, j, TRUE, &info);
-		kuwahara_min(j, &info);
-	}
-	/* Actually process image */
-	ir = i = 0;
-	while (TRUE)
-	{
-		int j, k, jp;
+	/* Detail mode needs Kuwahara'ed rows above & below as well */
+	f0 = (y0 = thread->step0) - detail;
+	if (f0 < 0) f0 = 0;
+	f1 = (y1 = y0 + cnt) + detail;
+	if (f1 > mem_height) f1 = mem_height;
 
-		if ((i * 10) % mem_height >= mem_height - 10)
-			if (progress_update((float)(i + 1) / mem_height)) break;
+	/* Initialize column sums */
+	for (y = f0 - r; y < f0; y++)
+		kuwahara_cols(src + idx2row(y) * w, TRUE, info);
 
-		/* Process a pixel row */
-		if (!detail) row_protected(0, i, mem_width, mask);
-		tmp = buf = timg + wbuf * (i % 3);
-		for (j = 0; j < mem_width; j++)
-		{
-			double dis;
-			int jj, jk;
+	for (y = f0; y < f1 + r; y++)
+	{
+		/* Move column sums down */
+		kuwahara_cols(src + idx2row(y) * w, TRUE, info);
+		if (y > f0) kuwahara_cols(src + idx2row(y - r - 1) * w, FALSE, info);
+		kuwahara_squares(info);
 
-			tmp += 3;
-			if (!detail && (mask[j] == 255)) continue;
-			/* Select minimum variance square from covered rows */
-			jj = j + l;
-			jk = j + info.min[j];
-			dis = kuwahara_square(jk, &info);
-// !!! Only the all-or-nothing mode for now - weighted mode not implemented yet
-			for (k = 1; k < r1; k++ , jj += l)
-			{
-				int jv = jj + info.min[jj];
-				double dv = kuwahara_square(jv, &info);
-				if (dv < dis) jk = jv , dis = dv;
-			}
-			/* Calculate & store new RGB */
-			jk *= 3;
-			if (gcor)
-			{
-				double *wr = info.rs + jk;
-				tmp[0] = UNGAMMA256(wr[0] * r2i);
-				tmp[1] = UNGAMMA256(wr[1] * r2i);
-				tmp[2] = UNGAMMA256(wr[2] * r2i);
-			}
-			else
-			{
-				int *ar = info.avg + jk;
-				tmp[0] = rint(*ar++ * r2i);
-				tmp[1] = rint(*ar++ * r2i);
-				tmp[2] = rint(*ar * r2i);
-			}
-		}
+		/* Row I has all its squares now */
+		i = y - r;
+		buf = i < f0 ? NULL : timg + wbuf * (i % 3);
+		kuwahara_min(y, buf ? buf + 3 : NULL, info);
+		if (!buf) continue;
 
 		if (detail)
 		{
 			/* Copy-extend the row on both ends */
 			memcpy(buf, buf + 3, 3);
-			memcpy(tmp + 3, tmp, 3);
+			memcpy(buf + w + 3, buf + w, 3);
 			/* Copy-extend the top row */
 			if (!i) memcpy(timg + wbuf * 2, buf, wbuf);
-			else /* Build and mask-merge the previous row */
-			{
-				// Overwrite outgoing pixels of outgoing row
-				tx = timg + wbuf * ((i + 1) % 3);
-				kuwahara_detailed(timg, mask, tx, i - 1, gcor);
-				tmp = mem_img[CHN_IMAGE] + (i - 1) * w;
-				process_img(0, 1, mem_width, mask, tmp, tmp, tx,
-					NULL, 3, BLENDF_SET | BLENDF_INVM);
-			}
+			if (i <= y0) continue;
+			/* Build and mask-merge the previous row */
+			// Overwrite outgoing pixels of outgoing row
+			tx = timg + wbuf * ((i + 1) % 3);
+			kuwahara_detailed(timg, mask, tx, i - 1, info->gcor);
+			tmp = mem_img[CHN_IMAGE] + (i - 1) * w;
+			process_img(0, 1, mem_width, mask, tmp, tmp, tx,
+				NULL, 3, BLENDF_SET | BLENDF_INVM);
+			i--;
 		}
 		else
 		{
 			/* Mask-merge current row */
+			row_protected(0, i, mem_width, mask);
 			tmp = mem_img[CHN_IMAGE] + i * w;
 			process_img(0, 1, mem_width, mask, tmp, tmp, buf + 3,
 				NULL, 3, BLENDF_SET | BLENDF_INVM);
 		}
+		if (thread_step(thread, i - y0 + 1, cnt, 10)) break;
+	}
 
-		if (++i < mem_height)
-		{
-			/* Update sums for a new row */
-			jp = ir * l;
-			kuwahara_copy(jp, ((ir + r) % r1) * l, &info);
-			kuwahara_row(src + idx2row(i - 1) * w, jp, FALSE, &info);
-			kuwahara_row(src + idx2row(i + r) * w, jp, TRUE, &info);
-			kuwahara_min(jp, &info);
-			ir = (ir + 1) % r1;
-			continue;
-		}
+	if (detail && (y1 == mem_height) && (y == f1 + r))
+	{
+		/* Copy-extend the bottom row */
+		i = mem_height;
+		memcpy(timg + wbuf * (i % 3), timg + wbuf * ((i - 1) % 3), wbuf);
+		/* Build and mask-merge it */
+		kuwahara_detailed(timg, mask, timg, i - 1, info->gcor);
+		tmp = mem_img[CHN_IMAGE] + (i - 1) * w;
+		process_img(0, 1, mem_width, mask, tmp, tmp, timg,
+			NULL, 3, BLENDF_SET | BLENDF_INVM);
+	}
+	thread_done(thread);
+}
 
-		if (detail)
+/* RGB only - cannot be generalized without speed loss */
+void mem_kuwahara(int r, int gcor, int detail)
+{
+	kuwahara_info info;
+	threaddata *tdata;
+	int i, j, k, l, len, ch = mem_channel;
+	int w = mem_width * 3, wbuf = w + 3 * 2;
+
+
+	if (mem_img_bpp != 3) return; // Sanity check
+
+	memset(&info, 0, sizeof(info));
+	info.r2i = 1.0 / (double)((r + 1) * (r + 1));
+	info.w = mem_width; info.r = r;
+	info.gcor = gcor; info.detail = !!detail;
+	len = mem_width + r + r;
+	l = mem_width + r;
+	tdata = talloc(MA_ALIGN_DOUBLE, image_threads(mem_width, mem_height),
+		&info, sizeof(info),
+		&info.idx, len * sizeof(int),
+		NULL,
+		&info.gs, gcor ? len * 3 * sizeof(double) : 0,
+		&info.gsat, gcor ? (len + 1) * 3 * sizeof(double) : 0,
+		&info.var, l * sizeof(double),
+		&info.vq, mem_width * (r + 1) * sizeof(kuwahara_square),
+		&info.cs, len * 4 * sizeof(int),
+		&info.sat, (len + 1) * 4 * sizeof(int),
+		&info.hq, l * sizeof(int),
+		&info.vh, mem_width * 2 * sizeof(int),
+		&info.rgb, l * 3,
+		&info.mask, mem_width,
+		&info.timg, wbuf * 3,
+		NULL);
+	if (!tdata)
+	{
+		memory_errors(1);
+		return;
+	}
+
+	/* Prepare horizontal indices, assuming mirror boundary */
+	if (mem_width > 1) // All indices remain zero otherwise
+	{
+		k = mem_width + mem_width - 2;
+		for (i = -r; i < mem_width + r; i++)
 		{
-			/* Copy-extend the bottom row */
-			memcpy(timg + wbuf * (i % 3), buf, wbuf);
-			/* Build and mask-merge it */
-			kuwahara_detailed(timg, mask, timg, i - 1, gcor);
-			tmp = mem_img[CHN_IMAGE] + (i - 1) * w;
-			process_img(0, 1, mem_width, mask, tmp, tmp, timg,
-				NULL, 3, BLENDF_SET | BLENDF_INVM);
+			j = abs(i) % k;
+			if (j >= mem_width) j = k - j;
+			info.idx[i + r] = j * 3;
 		}
-		break;
 	}
 
+	mem_channel = CHN_IMAGE; // For row_protected()
+	launch_threads(kuwahara_rows, tdata, _("Kuwahara-Nagao Filter"),
+		mem_height);
 	mem_channel = ch;
 
-	progress_end();
-	free(mem);
+	free(tdata);
 }
 
 ///	CLIPBOARD MASK
@@ -8757,7 +11256,7 @@ void mem_clip_mask_set(unsigned char val)		// (un)Mask colours A and B on the cl
 
 void mem_clip_mask_clear()		// Clear/remove the clipboard mask
 {
-	free(mem_clip_mask);
+	mem_chan_free(mem_clip_mask);
 	mem_clip_mask = NULL;
 }
 
@@ -9820,7 +12319,7 @@ static void skew_fill_util(double *buf, double *filler,
 	memset(buf + k, 0, l * sizeof(double));
 
 	/* Collect pixels */
-	dest = buf + xl * 3;
+	dest = buf + xl;
 	for (j = xl; j < xr; j++)
 	{
 		unsigned char *img;
@@ -9847,65 +12346,69 @@ static void skew_fill_util(double *buf, double *filler,
 	}
 }
 
-/* !!! This works, after a fashion - but remains 2.5 times slower than a smooth
- * free-rotate if using 6-tap filter, or 1.5 times if using 2-tap one. Which,
- * while still being several times faster than anything else, is rather bad
- * for a high-quality tool like mtPaint. Needs improvement. - WJ */
-static void mem_skew_filt(chanlist old_img, chanlist new_img, int ow, int oh,
-	int nw, int nh, double xskew, double yskew, int mode, int gcor,
-	int dis_a, int silent)
-{
-	void *xmem, *ymem, *tmem;
+typedef struct {
+	unsigned char **src, **dest;
+	int ow, oh, nw, nh, bpp, gcor, progress;
+	int xfsz, yfsz, wbsz, step, rgba, passes;
 	double *xfilt, *yfilt, *wbuf, *rbuf;
 	int *dxx, *dyy;
-	double x0, y0, d, Kh, Kv, XX[4], YY[4], filler[7];
-	int i, cc, /*fw2, fh2,*/ xfsz, yfsz, wbsz, rgba, step, ny, nr;
+	double x0, y0, d, Kh, Kv, xskew, yskew, XX[4], YY[4], filler[7];
+	void *xmem, *ymem;	// Filter memory blocks
+} skew_context;
 
+/* Calculate clipping parallelogram's corners, extending original dimensions
+ * by "ext" on the left and top, and by (ext - 0.5) on the right and bottom */
+static void skew_clip(skew_context *ctx, double ext)
+{
+	double *XX = ctx->XX, *YY = ctx->YY;
+	int i;
 
-	/* Create temp data */
-	step = (rgba = new_img[CHN_ALPHA] && !dis_a) ? 7 : 3;
-	xmem = make_skew_filter(&xfilt, &dxx, &xfsz, oh, (nw - ow) * 0.5, xskew, mode);
-	ymem = make_skew_filter(&yfilt, &dyy, &yfsz, nw, (nh - oh) * 0.5, yskew, mode);
-//	fw2 = xfsz >> 1; fh2 = yfsz >> 1;
-
-	wbsz = nw * step;
-	tmem = multialloc(MA_ALIGN_DOUBLE, &wbuf, wbsz * yfsz * sizeof(double),
-		&rbuf, wbsz * sizeof(double), NULL);
-	if (!xmem || !ymem || !tmem) goto fail;
-	x0 = 0.5 * (nw - 1); y0 = 0.5 * (nh - 1);
-
-	/* Calculate clipping parallelogram's corners */
-	// To avoid corner cases, we add an extra pixel to original dimensions
-	XX[1] = XX[3] = (XX[0] = XX[2] = 0.5 * (nw - ow) - 1) + ow + 1;
-	YY[2] = YY[3] = (YY[0] = YY[1] = 0.5 * (nh - oh) - 1) + oh + 1;
+	ctx->x0 = 0.5 * (ctx->nw - 1); ctx->y0 = 0.5 * (ctx->nh - 1);
+	XX[1] = XX[3] = (XX[0] = XX[2] = 0.5 * (ctx->nw - ctx->ow) - ext) +
+		ctx->ow + (ext + ext - 1);
+	YY[2] = YY[3] = (YY[0] = YY[1] = 0.5 * (ctx->nh - ctx->oh) - ext) +
+		ctx->oh + (ext + ext - 1);
 	for (i = 0; i < 4; i++)
 	{
-		XX[i] += (YY[i] - y0) * xskew;
-		YY[i] += (XX[i] - x0) * yskew;
+		XX[i] += (YY[i] - ctx->y0) * ctx->xskew;
+		YY[i] += (XX[i] - ctx->x0) * ctx->yskew;
 	}
-	d = 1.0 + xskew * yskew;
-	Kv = d ? xskew / d : 0.0; // for left & right
-	Kh = yskew ? 1.0 / yskew : 0.0; // for top & bottom
+	ctx->d = 1.0 + ctx->xskew * ctx->yskew;
+	ctx->Kv = ctx->d ? ctx->xskew / ctx->d : 0.0; // for left & right
+	ctx->Kh = ctx->yskew ? 1.0 / ctx->yskew : 0.0; // for top & bottom
+}
 
-	/* Init filler */
-	memset(filler, 0, sizeof(filler));
-	if (gcor)
-	{
-		filler[0] = gamma256[mem_col_A24.red];
-		filler[1] = gamma256[mem_col_A24.green];
-		filler[2] = gamma256[mem_col_A24.blue];
-	}
-	else
-	{
-		filler[0] = mem_col_A24.red;
-		filler[1] = mem_col_A24.green;
-		filler[2] = mem_col_A24.blue;
-	}
+/* Clip target row */
+static void skew_row_clip(skew_context *ctx, int i, int *xl, int *xr)
+{
+	double *XX = ctx->XX, *YY = ctx->YY, Kh = ctx->Kh, Kv = ctx->Kv;
+
+	if (i <= YY[0]) *xl = ceil(XX[0] + (i - YY[0]) * Kh);
+	else if (i <= YY[2]) *xl = ceil(XX[2] + (i - YY[2]) * Kv);
+	else /* if (i <= YY[3]) */ *xl = ceil(XX[2] + (i - YY[2]) * Kh);
+	if (i <= YY[1]) *xr = ceil(XX[1] + (i - YY[1]) * Kh);
+	else if (i <= YY[3]) *xr = ceil(XX[3] + (i - YY[3]) * Kv);
+	else /* if (i <= YY[2]) */ *xr = ceil(XX[3] + (i - YY[3]) * Kh);
+	if (*xl < 0) *xl = 0;
+	if (*xr > ctx->nw) *xr = ctx->nw; // Right boundary is exclusive
+}
+
+/* Each thread does its own stripe of rows, with its own ring of row buffers
+ * which it first fills with the rows above the stripe; as results depend only
+ * on source rows, they are the same as for one single stripe */
+static void do_skew_filt(tcb *thread)
+{
+	skew_context *ctx = thread->data;
+	unsigned char **old_img = ctx->src, **new_img = ctx->dest;
+	double *wbuf = ctx->wbuf, *rbuf = ctx->rbuf, *yfilt = ctx->yfilt;
+	int cc, np, ii, cnt = thread->nsteps, i0 = thread->step0;
+	int ow = ctx->ow, oh = ctx->oh, nw = ctx->nw, gcor = ctx->gcor;
+	int xfsz = ctx->xfsz, yfsz = ctx->yfsz, wbsz = ctx->wbsz;
+	int step = ctx->step, rgba = ctx->rgba;
+	int *dxx = ctx->dxx, *dyy = ctx->dyy;
 
 	/* Process image channels */
-	for (nr = cc = 0; cc < NUM_CHANNELS; cc++) nr += !!new_img[cc];
-	nr = (nr - rgba) * (nh + yfsz - 1);
-	for (ny = cc = 0; cc < NUM_CHANNELS; cc++)
+	for (np = cc = 0; cc < NUM_CHANNELS; cc++)
 	{
 		int ring_l[FILT_MAX], ring_r[FILT_MAX];
 		int i, idx, bpp = cc == CHN_IMAGE ? step : 1;
@@ -9918,14 +12421,12 @@ static void mem_skew_filt(chanlist old_img, chanlist new_img, int ow, int oh,
 		for (i = 0; i < yfsz; i++) ring_l[i] = 0 , ring_r[i] = nw;
 
 		/* Row loop */
-		for (i = 1 - yfsz , idx = 0; i < nh; i++ , ++idx >= yfsz ? idx = 0 : 0)
+		for (i = i0 + 1 - yfsz , idx = 0 , ii = 1 - yfsz; ii < cnt;
+			i++ , ii++ , ++idx >= yfsz ? idx = 0 : 0)
 		{
 			double *filt0, *thatbuf, *thisbuf = wbuf + idx * wbsz;
 			int j, k, y0, xl, xr, len, ofs, lfx = -xfsz;
 
-			if (!silent && ((++ny * 10) % nr >= nr - 10))
-				progress_update((float)ny / nr);
-
 			/* Locate source row */
 			y0 = i + yfsz - 1; // Effective Y offset
 
@@ -9954,25 +12455,18 @@ static void mem_skew_filt(chanlist old_img, chanlist new_img, int ow, int oh,
 			/* Read in a new row */
 			(cc != CHN_IMAGE ? skew_fill_util : rgba ?
 				skew_fill_rgba : skew_fill_rgb)(thisbuf,
-				filler, old_img[cc], old_img[CHN_ALPHA],
+				ctx->filler, old_img[cc], old_img[CHN_ALPHA],
 				y0, ow, xl, xr, ring_l[idx], ring_r[idx],
-				xfsz, xfilt, dxx, dyy, gcor);
+				xfsz, ctx->xfilt, dxx, dyy, gcor);
 
 			if (xl >= xr) xl = nw , xr = 0;
 			ring_l[idx] = xl;
 			ring_r[idx] = xr;
 
-			if (i < 0) continue; // Initialization phase
+			if (ii < 0) continue; // Initialization phase
 
 			/* Clip target row */
-			if (i <= YY[0]) xl = ceil(XX[0] + (i - YY[0]) * Kh);
-			else if (i <= YY[2]) xl = ceil(XX[2] + (i - YY[2]) * Kv);
-			else /* if (i <= YY[3]) */ xl = ceil(XX[2] + (i - YY[2]) * Kh);
-			if (i <= YY[1]) xr = ceil(XX[1] + (i - YY[1]) * Kh);
-			else if (i <= YY[3]) xr = ceil(XX[3] + (i - YY[3]) * Kv);
-			else /* if (i <= YY[2]) */ xr = ceil(XX[3] + (i - YY[3]) * Kh);
-			if (xl < 0) xl = 0;
-			if (xr > nw) xr = nw; // Right boundary is exclusive
+			skew_row_clip(ctx, i, &xl, &xr);
 
 			/* Run vertical filter over the row buffers */
 			thisbuf = rbuf + xl * bpp;
@@ -10070,50 +12564,100 @@ static void mem_skew_filt(chanlist old_img, chanlist new_img, int ow, int oh,
 					*dest++ = n < 0 ? 0 : n > 0xFF ? 0xFF : n;
 				}
 			}
+
+			if (ctx->progress && thread_step(thread,
+				(np * cnt + ii + 1) / ctx->passes, cnt, 10))
+				goto stop;
 		}
+		np++;
 	}
-
-fail:	free(xmem);
-	free(ymem);
-	free(tmem);
+stop:	thread_done(thread);
 }
 
-static void mem_skew_nn(chanlist old_img, chanlist new_img, int ow, int oh,
-	int nw, int nh, int bpp, double xskew, double yskew, int silent)
+/* !!! This works, after a fashion - but remains 2.5 times slower than a smooth
+ * free-rotate if using 6-tap filter, or 1.5 times if using 2-tap one. Which,
+ * while still being several times faster than anything else, is rather bad
+ * for a high-quality tool like mtPaint. Needs improvement. - WJ */
+static threaddata *skew_filt_prepare(chanlist img, int ow, int oh, int nw,
+	int nh, double xskew, double yskew, int mode, int gcor, int dis_a,
+	int silent)
 {
-	double x0, y0, d, Kh, Kv, XX[4], YY[4];
-	int i, ny;
+	skew_context ctx;
+	void *xmem, *ymem;
+	threaddata *tdata = NULL;
+	int cc, nt;
+
+
+	/* Create temp data */
+	ctx.src = ctx.dest = NULL;
+	ctx.ow = ow; ctx.oh = oh;
+	ctx.nw = nw; ctx.nh = nh;
+	ctx.xskew = xskew; ctx.yskew = yskew;
+	ctx.gcor = gcor;
+	ctx.progress = !silent;
+	ctx.step = (ctx.rgba = img[CHN_ALPHA] && !dis_a) ? 7 : 3;
+	xmem = make_skew_filter(&ctx.xfilt, &ctx.dxx, &ctx.xfsz, oh,
+		(nw - ow) * 0.5, xskew, mode);
+	ymem = make_skew_filter(&ctx.yfilt, &ctx.dyy, &ctx.yfsz, nw,
+		(nh - oh) * 0.5, yskew, mode);
+	if (!xmem || !ymem) goto fail;
 
 	/* Calculate clipping parallelogram's corners */
-	x0 = 0.5 * (nw - 1); y0 = 0.5 * (nh - 1);
-	XX[1] = XX[3] = (XX[0] = XX[2] = 0.5 * (nw - ow - 1)) + ow;
-	YY[2] = YY[3] = (YY[0] = YY[1] = 0.5 * (nh - oh - 1)) + oh;
-	for (i = 0; i < 4; i++)
+	// To avoid corner cases, we add an extra pixel to original dimensions
+	skew_clip(&ctx, 1.0);
+
+	/* Init filler */
+	memset(ctx.filler, 0, sizeof(ctx.filler));
+	if (gcor)
+	{
+		ctx.filler[0] = gamma256[mem_col_A24.red];
+		ctx.filler[1] = gamma256[mem_col_A24.green];
+		ctx.filler[2] = gamma256[mem_col_A24.blue];
+	}
+	else
 	{
-		XX[i] += (YY[i] - y0) * xskew;
-		YY[i] += (XX[i] - x0) * yskew;
+		ctx.filler[0] = mem_col_A24.red;
+		ctx.filler[1] = mem_col_A24.green;
+		ctx.filler[2] = mem_col_A24.blue;
 	}
-	d = 1.0 + xskew * yskew;
-	Kv = d ? xskew / d : 0.0; // for left & right
-	Kh = yskew ? 1.0 / yskew : 0.0; // for top & bottom
+
+	/* Count passes for progressbar */
+	for (ctx.passes = cc = 0; cc < NUM_CHANNELS; cc++)
+		ctx.passes += !!img[cc];
+	ctx.passes -= ctx.rgba;
+
+	/* Each thread refills the ring for its first row, so keep stripes tall */
+	nt = image_threads(nw, nh);
+	if (nt > nh / (ctx.yfsz * 2)) nt = nh / (ctx.yfsz * 2);
+
+	ctx.wbsz = nw * ctx.step;
+	ctx.xmem = xmem; ctx.ymem = ymem;
+	tdata = talloc(MA_ALIGN_DOUBLE, nt, &ctx, sizeof(ctx), NULL,
+		&ctx.wbuf, ctx.wbsz * ctx.yfsz * sizeof(double),
+		&ctx.rbuf, ctx.wbsz * sizeof(double), NULL);
+	if (tdata) return (tdata);
+
+fail:	free(xmem);
+	free(ymem);
+	return (NULL);
+}
+
+static void do_skew_nn(tcb *thread)
+{
+	skew_context *ctx = thread->data;
+	unsigned char **old_img = ctx->src, **new_img = ctx->dest;
+	int ow = ctx->ow, oh = ctx->oh, nw = ctx->nw, nh = ctx->nh;
+	int ny, ii, cnt = thread->nsteps, bpp = ctx->bpp;
+	double x0 = ctx->x0, y0 = ctx->y0, d = ctx->d;
+	double xskew = ctx->xskew, yskew = ctx->yskew;
 
 	/* Process image row by row */
-	for (ny = 0; ny < nh; ny++)
+	for (ny = thread->step0 , ii = 0; ii < cnt; ny++ , ii++)
 	{
 		int cc, xl, xr;
 
-		if (!silent && ((ny * 10) % nh >= nh - 10))
-			progress_update((float)ny / nh);
-
 		/* Clip row */
-		if (ny <= YY[0]) xl = ceil(XX[0] + (ny - YY[0]) * Kh);
-		else if (ny <= YY[2]) xl = ceil(XX[2] + (ny - YY[2]) * Kv);
-		else /* if (ny <= YY[3]) */ xl = ceil(XX[2] + (ny - YY[2]) * Kh);
-		if (ny <= YY[1]) xr = ceil(XX[1] + (ny - YY[1]) * Kh);
-		else if (ny <= YY[3]) xr = ceil(XX[3] + (ny - YY[3]) * Kv);
-		else /* if (ny <= YY[2]) */ xr = ceil(XX[3] + (ny - YY[3]) * Kh);
-		if (xl < 0) xl = 0;
-		if (xr > nw) xr = nw; // Right boundary is exclusive
+		skew_row_clip(ctx, ny, &xl, &xr);
 
 		for (cc = 0; cc < NUM_CHANNELS; cc++)
 		{
@@ -10156,7 +12700,47 @@ static void mem_skew_nn(chanlist old_img, chanlist new_img, int ow, int oh,
 				}
 			}
 		}
+		if (ctx->progress && thread_step(thread, ii + 1, cnt, 10)) break;
+	}
+	thread_done(thread);
+}
+
+static threaddata *skew_nn_prepare(int ow, int oh, int nw, int nh, int bpp,
+	double xskew, double yskew, int silent)
+{
+	skew_context ctx;
+
+	ctx.src = ctx.dest = NULL;
+	ctx.xmem = ctx.ymem = NULL;
+	ctx.ow = ow; ctx.oh = oh;
+	ctx.nw = nw; ctx.nh = nh;
+	ctx.bpp = bpp;
+	ctx.xskew = xskew; ctx.yskew = yskew;
+	ctx.progress = !silent;
+
+	/* Calculate clipping parallelogram's corners */
+	skew_clip(&ctx, 0.5);
+
+	return (talloc(0, image_threads(nw, nh), &ctx, sizeof(ctx), NULL, NULL));
+}
+
+/* Run prepared skew, and free its data */
+static void skew_run(threaddata *tdata, thread_func func, chanlist old_img,
+	chanlist new_img)
+{
+	skew_context *tc, *ctx = tdata->threads[0]->data;
+	int i;
+
+	for (i = 0; i < tdata->count; i++)
+	{
+		tc = tdata->threads[i]->data;
+		tc->src = old_img;
+		tc->dest = new_img;
 	}
+	launch_threads(func, tdata, NULL, ctx->nh);
+	free(ctx->xmem);
+	free(ctx->ymem);
+	free(tdata);
 }
 
 /* Skew geometry calculation is far nastier than same for rotation, and worse,
@@ -10209,6 +12793,8 @@ static void mem_skew_geometry(int ow, int oh, double xskew, double yskew,
 int mem_skew(double xskew, double yskew, int type, int gcor)
 {
 	chanlist old_img, new_img;
+	threaddata *tdata;
+	thread_func func;
 	int ow, oh, nw, nh, res, bpp;
 
 	ow = mem_width;
@@ -10219,17 +12805,35 @@ int mem_skew(double xskew, double yskew, int type, int gcor)
 
 	if ((nw > MAX_WIDTH) || (nh > MAX_HEIGHT)) return (-5);
 
+	/* Allocate before changing anything, to have nothing to roll back */
+	if (!type || (bpp == 1))
+	{
+		tdata = skew_nn_prepare(ow, oh, nw, nh, bpp, xskew, yskew, FALSE);
+		func = do_skew_nn;
+	}
+	else
+	{
+		tdata = skew_filt_prepare(mem_img, ow, oh, nw, nh, xskew, yskew,
+			type, gcor, channel_dis[CHN_ALPHA], FALSE);
+		func = do_skew_filt;
+	}
+	if (!tdata) return (1);		// Not enough memory
+
 	memcpy(old_img, mem_img, sizeof(chanlist));
 	res = undo_next_core(UC_NOCOPY, nw, nh, bpp, CMASK_ALL);
-	if (res) return (res);		// No undo space
+	if (res)
+	{
+		skew_context *ctx = tdata->threads[0]->data;
+		free(ctx->xmem);
+		free(ctx->ymem);
+		free(tdata);
+		return (res);	// No undo space
+	}
 	memcpy(new_img, mem_img, sizeof(chanlist));
 	progress_init(_("Skew"), 0);
 
 	mem_clear_img(new_img, nw, nh, bpp);
-	if (!type || (mem_img_bpp == 1)) mem_skew_nn(old_img, new_img,
-		ow, oh, nw, nh, bpp, xskew, yskew, FALSE);
-	else mem_skew_filt(old_img, new_img, ow, oh, nw, nh, xskew, yskew,
-		type, gcor, channel_dis[CHN_ALPHA], FALSE);
+	skew_run(tdata, func, old_img, new_img);
 
 	progress_end();
 
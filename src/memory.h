@@ -30,6 +30,9 @@
  * !!! will have to be modified to use size_t instead */
 #define MAX_DIM (MAX_WIDTH > MAX_HEIGHT ? MAX_WIDTH : MAX_HEIGHT)
 
+/* Row address in a channel, with offset computed in size_t */
+#define ROW_PTR(C,Y,W,BPP) ((C) + (size_t)(Y) * (size_t)(W) * (BPP))
+
 #define DEFAULT_WIDTH 640
 #define DEFAULT_HEIGHT 480
 
@@ -145,7 +148,8 @@ typedef struct {
 	png_color *pal_;
 	unsigned char *tileptr;
 	undo_data *dataptr;
-	size_t size;
+	unsigned char *spool;	// Disk copy of data, if moved there
+	size_t size, spool_size;
 	int width, height, flags;
 	short cols, bpp, trans;
 } undo_item;
@@ -263,6 +267,7 @@ int mem_unmask;
 int mem_gradient;
 
 int paint_gamma;
+int fast_gauss;			// Approximate big Gaussian kernels
 
 /// BLEND MODE
 
@@ -407,6 +412,8 @@ int mem_nudge;				// Nudge pixels per SHIFT+Arrow key during selection/paste
 int mem_undo_limit;		// Max MB memory allocation limit
 int mem_undo_common;		// Percent of undo space in common arena
 int mem_undo_opacity;		// Use previous image for opacity calculations?
+int mem_bigchan_mb;		// Min MB size for file-backed channels, 0 = never
+int mem_undo_disk;		// Max MB of undo data spilled to disk, 0 = none
 
 int mem_undo_fail;		// Undo space shortfall
 
@@ -613,6 +620,8 @@ void mem_file_modified(char *fname);	// Label file's frames in current layer as
 int init_undo(undo_stack *ustack, int depth);	// Create new undo stack of a given depth
 void update_undo_depth();	// Resize all undo stacks
 
+void *mem_chan_alloc(size_t l);	// Allocate channel memory, file-backed if big
+void mem_chan_free(void *chan);	// Free memory allocated by either way
 void mem_free_chanlist(chanlist img);
 int cmask_from(chanlist img);	// Chanlist to cmask
 
@@ -640,6 +649,21 @@ int mem_alloc_image(int mode, image_info *image, int w, int h, int bpp,
 	int cmask, image_info *src);
 //	Allocate space for new image, removing old if needed
 int mem_new( int width, int height, int bpp, int cmask );
+
+/* Mipmaps go down to 1/8; with MIN_ZOOM being 1/10, a 1/16 level would never
+ * get used - other zooms subsample the largest level dividing them */
+#define MIP_LEVELS 3
+#define MIP_TILE 256	/* Mipmap validity is tracked in tiles of this size */
+#define MIP_MAX 8	/* Max images to keep mipmaps for */
+
+//	Largest mipmap level usable at given decimation factor
+int mip_level(int zoom);
+//	Get level's channels, with given image area up to date in it
+unsigned char **mip_get(image_info *image, int l, int x0, int y0, int x1, int y1);
+//	Mark image area as changed
+void mip_update(image_info *image, int x, int y, int w, int h);
+//	Forget mipmaps of image, or of all images if NULL
+void mip_drop(image_info *image);
 //	Allocate new clipboard, removing or preserving old as needed
 int mem_clip_new(int width, int height, int bpp, int cmask, chanlist backup);
 
@@ -797,6 +821,7 @@ void mem_smudge(int ox, int oy, int nx, int ny);
 //	Apply colour transform
 void do_transform(int start, int step, int cnt, unsigned char *mask,
 	unsigned char *imgr, unsigned char *img0, int m0);
+int mem_transform_image(unsigned char *mask0);
 
 void mem_flip_v(char *mem, char *tmp, int w, int h, int bpp);	// Flip image vertically
 void mem_flip_h( char *mem, int w, int h, int bpp );		// Flip image horizontally
@@ -807,7 +832,7 @@ int mem_image_rot( int dir );					// Rotate canvas 90 degrees
 void mem_rotate_geometry(int ow, int oh, double angle, int *nw, int *nh);
 //	Rotate canvas or clipboard by any angle (degrees)
 int mem_rotate_free(double angle, int type, int gcor, int clipboard);
-void mem_rotate_free_real(chanlist old_img, chanlist new_img, int ow, int oh,
+int mem_rotate_free_real(chanlist old_img, chanlist new_img, int ow, int oh,
 	int nw, int nh, int bpp, double angle, int mode, int gcor, int dis_a,
 	int silent);
 
@@ -815,6 +840,14 @@ void mem_rotate_free_real(chanlist old_img, chanlist new_img, int ow, int oh,
 #define BOUND_TILE   1 /* Tiled image beyond edges */
 #define BOUND_VOID   2 /* Transparency beyond edges */
 
+#define SCALE_SIMD_OFF    0 /* Scalar code only */
+#define SCALE_SIMD_DOUBLE 1 /* Vectorized code, double accumulators */
+#define SCALE_SIMD_FLOAT  2 /* Vectorized code, float accumulators */
+
+int scale_simd;		// Vectorized scaling mode, if CPU allows
+int scale_check;	// Compare vectorized scaling results to scalar code
+int scale_tolerance;	// Max difference to be deemed acceptable
+
 //	Scale image
 int mem_image_scale(int nw, int nh, int type, int gcor, int sharp, int bound);
 int mem_image_scale_real(chanlist old_img, int ow, int oh, int bpp,
@@ -671,9 +671,6 @@ static void brcosa_moved(brcosa_dd *dt, void **wdata, int what, void **where)
 
 static void brcosa_btn(brcosa_dd *dt, void **wdata, int what)
 {
-	unsigned char *mask, *mask0, *tmp, *xbuf;
-	int i;
-
 	mem_pal_copy(mem_pal, dt->pal);
 
 	if (what == op_EVT_CANCEL); 
@@ -685,26 +682,9 @@ static void brcosa_btn(brcosa_dd *dt, void **wdata, int what)
 		run_query(wdata); // This may modify palette if preview active
 
 		brcosa_preview(dt, NULL); // This definitely modifies it
-		while (mem_preview && (mem_img_bpp == 3)) // This modifies image
-		{
-			mask = malloc(mem_width * 4);
-			if (!mask) break;
-			xbuf = mask + mem_width;
-			mask0 = NULL;
-			if (!channel_dis[CHN_MASK]) mask0 = mem_img[CHN_MASK];
-			tmp = mem_img[CHN_IMAGE];
-			for (i = 0; i < mem_height; i++)
-			{
-				prep_mask(0, 1, mem_width, mask, mask0, tmp);
-				do_transform(0, 1, mem_width, mask, xbuf, tmp, 255);
-				process_img(0, 1, mem_width, mask, tmp, tmp, xbuf,
-					NULL, 3, BLENDF_SET | BLENDF_INVM);
-				if (mask0) mask0 += mem_width;
-				tmp += mem_width * 3;
-			}
-			free(mask);
-			break;
-		}
+		if (mem_preview && (mem_img_bpp == 3)) // This modifies image
+			mem_transform_image(channel_dis[CHN_MASK] ? NULL :
+				mem_img[CHN_MASK]);
 		if (mem_preview_clip && (mem_img_bpp == 3) && (mem_clip_bpp == 3))
 		{
 			// This modifies clipboard
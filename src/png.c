@@ -74,6 +74,24 @@
 #include "spawn.h"
 #include "thread.h"
 
+/* Frame waiting to be written out, when exploding frames */
+typedef struct {
+	ls_settings set;	// Owns its image channels
+	png_color pal[256];
+	char name[PATHBUF + 32];
+	int res, done;
+} frame_job;
+
+/* Frames go from reader to writer threads through a ring buffer */
+typedef struct {
+	frame_job *jobs;
+	int size;		// Ring buffer capacity
+	int head, next, tail;	// Next frame to queue, to write, to retire
+	int fail;		// First frame which failed to write
+	int done;		// Reader is finished
+	int res;		// Reader's result
+} frame_queue;
+
 /* All-in-one transport container for animation save/load */
 typedef struct {
 	frameset fset;
@@ -83,6 +101,7 @@ typedef struct {
 	int desttype;
 	int error, miss, cnt;
 	char *destdir;
+	frame_queue *queue;	// Writer threads, if any
 } ani_settings;
 
 int silence_limit, jpeg_quality, png_compression;
@@ -304,7 +323,7 @@ static int allocate_image(ls_settings *settings, int cmask)
 		{
 			if (!(cmask & CMASK_FOR(i))) continue;
 			l = i == CHN_IMAGE ? sz * settings->bpp : sz;
-			settings->img[i] = j ? malloc(l) : mem_try_malloc(l);
+			settings->img[i] = j ? mem_chan_alloc(l) : mem_try_malloc(l);
 			if (!settings->img[i]) return (FILE_MEM_ERROR);
 		}
 		break;
@@ -370,7 +389,7 @@ static void deallocate_image(ls_settings *settings, int cmask)
 		if (!(cmask & CMASK_FOR(i))) continue;
 		if (!settings->img[i]) continue;
 
-		free(settings->img[i]);
+		mem_chan_free(settings->img[i]);
 		settings->img[i] = NULL;
 
 		/* Clipboard */
@@ -828,8 +847,9 @@ static int load_png(char *file_name, ls_settings *settings, memFILE *mf)
 				{
 					png_read_rows(png_ptr, &row_pointers[0], NULL, 1);
 					src = row_pointers[0];
-					dest = settings->img[CHN_IMAGE] + (i * width + x0) * 3;
-					dsta = settings->img[CHN_ALPHA] + i * width;
+					dest = ROW_PTR(settings->img[CHN_IMAGE], i,
+						width, 3) + x0 * 3;
+					dsta = ROW_PTR(settings->img[CHN_ALPHA], i, width, 1);
 					for (j = x0; j < width; j += dx)
 					{
 						dest[0] = src[0];
@@ -848,7 +868,8 @@ static int load_png(char *file_name, ls_settings *settings, memFILE *mf)
 			png_set_strip_alpha(png_ptr);
 			for (i = 0; i < height; i++)
 			{
-				row_pointers[i] = settings->img[CHN_IMAGE] + i * width * 3;
+				row_pointers[i] = ROW_PTR(settings->img[CHN_IMAGE],
+					i, width, 3);
 			}
 			png_read_image(png_ptr, row_pointers);
 		}
@@ -874,7 +895,8 @@ static int load_png(char *file_name, ls_settings *settings, memFILE *mf)
 			png_set_expand_gray_1_2_4_to_8(png_ptr);
 		for (i = 0; i < height; i++)
 		{
-			row_pointers[i] = settings->img[CHN_IMAGE] + i * width;
+			row_pointers[i] = ROW_PTR(settings->img[CHN_IMAGE],
+				i, width, 1);
 		}
 		png_read_image(png_ptr, row_pointers);
 	}
@@ -946,6 +968,239 @@ fail:	if (fp) fclose(fp);
 #define PNG_AFTER_IDAT 8
 #endif
 
+/* Big images get compressed by several threads, pigz-style: each stripe of
+ * rows is deflated on its own, with the tail of the previous stripe for a
+ * dictionary, and ends with a sync flush; concatenated, the stripes make one
+ * valid zlib stream */
+
+#define PNG_STRIPE (1024 * 1024) /* Filtered bytes per stripe */
+#define PNG_WINDOW 32768 /* Deflate window */
+#define PNG_PARALLEL (4 * 1024 * 1024) /* Min image size for threading */
+
+typedef struct {
+	ls_settings *settings;
+	int bpp, rowbytes;
+	int srows, nwin;	// Rows in stripe, rows in dictionary
+	int base, level;	// First stripe of batch, compression level
+	int outsz;		// Output buffer size per stripe
+	unsigned char *out;	// Output buffers, for whole batch
+	int *len;		// Compressed sizes, -1 if failed
+	uLong *adler;		// Adler-32 sums of stripes' filtered data
+	unsigned char *rgba;	// Two rows for RGBA conversion
+	unsigned char *buf;	// Filter choices, zero row, dictionary
+} png_stripes;
+
+/* Choose filter the way libpng does: the least sum of absolute values wins */
+static unsigned char *png_filter_row(unsigned char *buf, unsigned char *row,
+	unsigned char *prev, int len, int bpp)
+{
+	unsigned char *dest, *best = buf;
+	int i, a, b, c, p, pa, pb, pc, k, sum, bsum = INT_MAX;
+
+	buf[0] = PNG_FILTER_VALUE_NONE;
+	memcpy(buf + 1, row, len);
+	/* Paletted images go unfiltered, again same as libpng */
+	if (bpp == 1) return (buf);
+
+	for (k = PNG_FILTER_VALUE_NONE; k <= PNG_FILTER_VALUE_PAETH; k++)
+	{
+		dest = buf + k * (len + 1);
+		*dest++ = k;
+		switch (k)
+		{
+		case PNG_FILTER_VALUE_SUB:
+			memcpy(dest, row, bpp);
+			for (i = bpp; i < len; i++)
+				dest[i] = row[i] - row[i - bpp];
+			break;
+		case PNG_FILTER_VALUE_UP:
+			for (i = 0; i < len; i++) dest[i] = row[i] - prev[i];
+			break;
+		case PNG_FILTER_VALUE_AVG:
+			for (i = 0; i < bpp; i++) dest[i] = row[i] - (prev[i] >> 1);
+			for (; i < len; i++)
+				dest[i] = row[i] - ((row[i - bpp] + prev[i]) >> 1);
+			break;
+		case PNG_FILTER_VALUE_PAETH:
+			for (i = 0; i < bpp; i++) dest[i] = row[i] - prev[i];
+			for (; i < len; i++)
+			{
+				a = row[i - bpp]; b = prev[i]; c = prev[i - bpp];
+				p = b - c; pc = a - c;
+				pa = abs(p); pb = abs(pc); pc = abs(p + pc);
+				p = (pa <= pb) && (pa <= pc) ? a : pb <= pc ? b : c;
+				dest[i] = row[i] - p;
+			}
+			break;
+		}
+		/* Bytes count as signed; stop as soon as this one loses */
+		for (sum = i = 0; (i < len) && (sum < bsum); i++)
+			sum += dest[i] < 128 ? dest[i] : 256 - dest[i];
+		if (sum < bsum) bsum = sum , best = dest - 1;
+	}
+	return (best);
+}
+
+static unsigned char *png_stripe_row(png_stripes *ps, int y)
+{
+	return (prepare_row(ps->rgba ? ps->rgba + (y & 1) * ps->rowbytes :
+		NULL, ps->settings, ps->bpp, y));
+}
+
+static void do_png_stripes(tcb *thread)
+{
+	png_stripes *ps = thread->data;
+	z_stream zs;
+	unsigned char *row, *prev, *tmp, *zero, *win;
+	uLong adler;
+	int rb = ps->rowbytes, l = rb + 1, h = ps->settings->height;
+	int i, k, y, y0, y1, yw, last, n = thread->step0 + thread->nsteps;
+
+	zero = ps->buf + l * (PNG_FILTER_VALUE_PAETH + 1);
+	win = zero + rb;
+	for (i = thread->step0; i < n; i++)
+	{
+		ps->len[i] = -1;
+		k = ps->base + i;
+		y0 = k * ps->srows;
+		y1 = y0 + ps->srows;
+		if (y1 > h) y1 = h;
+		last = y1 >= h;
+
+		memset(&zs, 0, sizeof(zs));
+		/* Raw deflate, with libpng's default settings */
+		if (deflateInit2(&zs, ps->level, Z_DEFLATED, -15, 8,
+			ps->bpp == 1 ? Z_DEFAULT_STRATEGY : Z_FILTERED) != Z_OK)
+			continue;
+
+		/* Refilter preceding rows to get the same dictionary that
+		 * sequential compression would have had */
+		prev = zero;
+		if (y0)
+		{
+			yw = y0 - ps->nwin;
+			if (yw < 0) yw = 0;
+			if (yw) prev = png_stripe_row(ps, yw - 1);
+			for (y = yw; y < y0; y++ , prev = row)
+			{
+				row = png_stripe_row(ps, y);
+				tmp = png_filter_row(ps->buf, row, prev, rb, ps->bpp);
+				memcpy(win + (y - yw) * l, tmp, l);
+			}
+			y = (y0 - yw) * l;
+			yw = y > PNG_WINDOW ? PNG_WINDOW : y;
+			deflateSetDictionary(&zs, win + y - yw, yw);
+		}
+
+		zs.next_out = ps->out + i * ps->outsz;
+		zs.avail_out = ps->outsz;
+		adler = adler32(0L, Z_NULL, 0);
+		for (y = y0; y < y1; y++ , prev = row)
+		{
+			row = png_stripe_row(ps, y);
+			tmp = png_filter_row(ps->buf, row, prev, rb, ps->bpp);
+			adler = adler32(adler, tmp, l);
+			zs.next_in = tmp;
+			zs.avail_in = l;
+			if (y < y1 - 1) k = deflate(&zs, Z_NO_FLUSH);
+			else if (!last) k = deflate(&zs, Z_SYNC_FLUSH);
+			else k = deflate(&zs, Z_FINISH) == Z_STREAM_END ?
+				Z_OK : Z_BUF_ERROR;
+			/* Output buffer has room to spare, so all must fit */
+			if ((k != Z_OK) || zs.avail_in || !zs.avail_out) break;
+		}
+		if (y >= y1)
+		{
+			ps->len[i] = ps->outsz - zs.avail_out;
+			ps->adler[i] = adler;
+		}
+		deflateEnd(&zs);
+	}
+}
+
+static int save_png_stripes(png_structp png_ptr, ls_settings *settings,
+	int bpp)
+{
+	png_stripes ps;
+	threaddata *tdata;
+	unsigned char buf[4];
+	uLong adler = adler32(0L, Z_NULL, 0);
+	int i, k, l, n, cnt, y, last, nt, h = settings->height;
+
+
+	memset(&ps, 0, sizeof(ps));
+	ps.settings = settings;
+	ps.bpp = bpp;
+	ps.rowbytes = settings->width * bpp;
+	ps.level = settings->png_compression;
+	l = ps.rowbytes + 1;
+	ps.srows = (PNG_STRIPE + l - 1) / l;
+	ps.nwin = (PNG_WINDOW + l - 1) / l;
+	ps.outsz = ps.srows * l;
+	/* Same margin as with compress2() below, plus room for a flush */
+	ps.outsz += (ps.outsz >> 8) + 64;
+	cnt = (h + ps.srows - 1) / ps.srows;
+
+	/* Do stripes in batches, to keep the output buffers small */
+	nt = helper_threads() * 2;
+	if (nt > cnt) nt = cnt;
+	tdata = talloc(MA_SKIP_ZEROSIZE, nt, &ps, sizeof(ps),
+		&ps.out, nt * ps.outsz,
+		&ps.len, nt * sizeof(int),
+		&ps.adler, nt * sizeof(uLong),
+		NULL,
+		&ps.rgba, bpp == 4 ? ps.rowbytes * 2 : 0,
+		&ps.buf, l * (PNG_FILTER_VALUE_PAETH + 1 + ps.nwin) + ps.rowbytes,
+		NULL);
+	if (!tdata) return (-1);
+	tdata->silent = TRUE;
+
+	for (k = 0; k < cnt; k += n)
+	{
+		n = cnt - k;
+		if (n > nt) n = nt;
+		for (i = 0; i < tdata->count; i++)
+			((png_stripes *)tdata->threads[i]->data)->base = k;
+		launch_threads(do_png_stripes, tdata, NULL, n);
+
+		for (i = 0; i < n; i++)
+		{
+			if (ps.len[i] < 0) goto fail;
+			y = (k + i) * ps.srows;
+			last = y + ps.srows >= h;
+			png_write_chunk_start(png_ptr, (png_bytep)"IDAT",
+				ps.len[i] + (k + i ? 0 : 2) + (last ? 4 : 0));
+			if (!(k + i)) /* zlib header */
+			{
+				buf[0] = 0x78; // Deflate, 32K window
+				/* Compression level flags, as zlib sets them */
+				buf[1] = ps.level < 2 ? 0x00 : ps.level < 6 ? 0x40 :
+					ps.level == 6 ? 0x80 : 0xC0;
+				buf[1] += 31 - (buf[0] * 256 + buf[1]) % 31;
+				png_write_chunk_data(png_ptr, buf, 2);
+			}
+			png_write_chunk_data(png_ptr, ps.out + i * ps.outsz,
+				ps.len[i]);
+			adler = adler32_combine(adler, ps.adler[i],
+				(last ? h - y : ps.srows) * l);
+			if (last) /* zlib trailer */
+			{
+				buf[0] = adler >> 24; buf[1] = adler >> 16;
+				buf[2] = adler >> 8; buf[3] = adler;
+				png_write_chunk_data(png_ptr, buf, 4);
+			}
+			png_write_chunk_end(png_ptr);
+		}
+		if (!settings->silent)
+			progress_update((float)(k + n) / cnt);
+	}
+	free(tdata);
+	return (0);
+
+fail:	free(tdata);
+	return (-1);
+}
+
 static int save_png(char *file_name, ls_settings *settings, memFILE *mf)
 {
 	png_unknown_chunk unknown0;
@@ -953,7 +1208,7 @@ static int save_png(char *file_name, ls_settings *settings, memFILE *mf)
 	png_infop info_ptr;
 	FILE *fp = NULL;
 	int h = settings->height, w = settings->width, bpp = settings->bpp;
-	int i, j, res = -1;
+	int i, j, parallel, res = -1;
 	long uninit_(dest_len), res_len;
 	char *mess = NULL;
 	unsigned char trans[256], *tmp, *rgba_row = NULL;
@@ -1041,7 +1296,15 @@ static int save_png(char *file_name, ls_settings *settings, memFILE *mf)
 
 	if (mess) ls_init(mess, 1);
 
-	for (j = 0; j < h; j++)
+	/* Write IDAT by own means if worth it, and if the pool is not busy
+	 * already (as when exploding frames); then libpng's png_write_end()
+	 * would refuse to work, so other chunks must be written directly too */
+	if ((parallel = (helper_threads() > 1) && !thread_pool_busy() &&
+		(w * h * bpp >= PNG_PARALLEL)))
+	{
+		if ((res = save_png_stripes(png_ptr, settings, bpp))) goto exit3;
+	}
+	else for (j = 0; j < h; j++)
 	{
 		tmp = prepare_row(rgba_row, settings, bpp, j);
 		png_write_row(png_ptr, (png_bytep)tmp);
@@ -1074,6 +1337,12 @@ static int save_png(char *file_name, ls_settings *settings, memFILE *mf)
 		res_len = dest_len;
 		if (compress2(tmp, &res_len, settings->img[i], w,
 			settings->png_compression) != Z_OK) continue;
+		if (parallel)
+		{
+			png_write_chunk(png_ptr, (png_bytep)chunk_names[i],
+				tmp, res_len);
+			continue;
+		}
 		strncpy(unknown0.name, chunk_names[i], 5);
 		unknown0.data = tmp;
 		unknown0.size = res_len;
@@ -1085,9 +1354,10 @@ static int save_png(char *file_name, ls_settings *settings, memFILE *mf)
 #endif
 	}
 	free(tmp);
-	png_write_end(png_ptr, info_ptr);
+	if (parallel) png_write_chunk(png_ptr, (png_bytep)"IEND", NULL, 0);
+	else png_write_end(png_ptr, info_ptr);
 
-	if (mess) progress_end();
+exit3:	if (mess) progress_end();
 
 	/* Tidy up */
 exit2:	png_destroy_write_struct(&png_ptr, &info_ptr);
@@ -1923,6 +2193,105 @@ static void cmyk2rgb(unsigned char *dest, unsigned char *src, int cnt,
 	}
 }
 
+/* Row sink: loaders which get rows in a format other than the image's own
+ * pass them here one by one, to be converted and stored into the channels
+ * right away - with no whole-image buffer in between, and no extra pass over
+ * the image after loading */
+
+typedef struct {
+	ls_settings *settings;
+	unsigned char *img;	// Image rows go here
+	int w, bpp;		// Row width, bytes per source pixel
+	int cmyk;		// Source is CMYK: 1 normal, 2 inverted
+	int defa;		// Alpha value not needing a channel, or -1
+#ifdef U_LCMS
+	cmsHTRANSFORM icc;	// Color profile to apply
+#endif
+} ls_sink;
+
+#ifdef U_LCMS
+static cmsHTRANSFORM icc_transform(ls_settings *settings);
+#endif
+
+static void sink_init(ls_sink *sink, ls_settings *settings, unsigned char *img,
+	int w, int bpp, int cmyk, int defa)
+{
+	memset(sink, 0, sizeof(ls_sink));
+	sink->settings = settings;
+	sink->img = img;
+	sink->w = w;
+	sink->bpp = bpp;
+	sink->cmyk = cmyk;
+	sink->defa = defa;
+#ifdef U_LCMS
+	/* Apply color profile on the fly, if image will need it applied;
+	 * only single images get it, frames never do */
+	if (settings->icc_apply && (settings->icc_size > 0) &&
+		(settings->bpp == 3) && (img == settings->img[CHN_IMAGE]))
+	{
+		sink->icc = icc_transform(settings);
+		settings->icc_size = -1; // Done with it
+	}
+#endif
+}
+
+static int sink_row(ls_sink *sink, unsigned char *src, int y)
+{
+	ls_settings *settings = sink->settings;
+	unsigned char *dest, *alpha;
+	int i, w = sink->w, bpp = sink->bpp;
+
+	/* Alpha goes first, as RGB may be getting converted in place */
+	if ((bpp == 4) && !sink->cmyk)
+	{
+		/* Add alpha channel once it proves to be needed */
+		if ((sink->defa >= 0) && !settings->img[CHN_ALPHA])
+		{
+			for (i = 0; (i < w) && (src[i * 4 + 3] == sink->defa); i++);
+			if (i < w)
+			{
+				if (allocate_image(settings, CMASK_ALPHA))
+					return (FILE_MEM_ERROR);
+				if (settings->img[CHN_ALPHA])
+					memset(settings->img[CHN_ALPHA], sink->defa,
+						(size_t)w * settings->height);
+				sink->defa = -1;
+			}
+		}
+		if ((alpha = settings->img[CHN_ALPHA]))
+		{
+			alpha += (size_t)w * y;
+			for (i = 0; i < w; i++) alpha[i] = src[i * 4 + 3];
+		}
+	}
+
+	dest = sink->img + (size_t)w * y * settings->bpp;
+	if (sink->cmyk) cmyk2rgb(dest, src, w, sink->cmyk > 1, settings);
+	else if (bpp == settings->bpp)
+	{
+		if (dest != src) memcpy(dest, src, w * bpp);
+	}
+	else for (i = 0; i < w; i++ , dest += 3 , src += bpp)
+	{
+		dest[0] = src[0];
+		dest[1] = src[1];
+		dest[2] = src[2];
+	}
+#ifdef U_LCMS
+	dest = sink->img + (size_t)w * y * 3;
+	if (sink->icc) cmsDoTransform(sink->icc, dest, dest, w);
+#endif
+	return (0);
+}
+
+static void sink_done(ls_sink *sink)
+{
+#ifdef U_LCMS
+	if (sink->icc) cmsDeleteTransform(sink->icc);
+	sink->icc = NULL;
+#endif
+}
+
 #ifdef U_JPEG
 struct my_error_mgr
 {
@@ -1939,13 +2308,30 @@ METHODDEF(void) my_error_exit (j_common_ptr cinfo)
 }
 struct my_error_mgr jerr;
 
+/* Size request for a raster image, with aspect ratio kept if only one side
+ * is given; FALSE if there is none */
+static int req_size(ls_settings *settings, int w, int h, int *rw, int *rh)
+{
+	int nw = settings->req_w, nh = settings->req_h;
+
+	if ((nw <= 0) && (nh <= 0)) return (FALSE);
+	if (nw <= 0) nw = (w * (double)nh) / h + 0.5;
+	if (nh <= 0) nh = (h * (double)nw) / w + 0.5;
+	*rw = nw < 1 ? 1 : nw > MAX_WIDTH ? MAX_WIDTH : nw;
+	*rh = nh < 1 ? 1 : nh > MAX_HEIGHT ? MAX_HEIGHT : nh;
+	return (TRUE);
+}
+
 static int load_jpeg(char *file_name, ls_settings *settings)
 {
-	static int pr;
+	/* These get changed after setjmp(), and are needed after longjmp() */
+	static unsigned char *memx, *mems;
+	static ls_sink sink;
+	static int pr, width, height, bpp, rw, rh;
 	struct jpeg_decompress_struct cinfo;
-	unsigned char *memp, *memx = NULL;
+	unsigned char *memp;
 	FILE *fp;
-	int i, width, height, bpp, res = -1, inv = 0;
+	int i, res = -1, inv = 0;
 #ifdef U_LCMS
 	unsigned char *icc = NULL;
 #endif
@@ -1953,6 +2339,9 @@ static int load_jpeg(char *file_name, ls_settings *settings)
 	if ((fp = fopen(file_name, "rb")) == NULL) return (-1);
 
 	pr = 0;
+	memx = mems = NULL;
+	rw = rh = 0;
+	memset(&sink, 0, sizeof(sink));
 	jpeg_create_decompress(&cinfo);
 	cinfo.err = jpeg_std_error(&jerr.pub);
 	jerr.pub.error_exit = my_error_exit;
@@ -1970,6 +2359,20 @@ static int load_jpeg(char *file_name, ls_settings *settings)
 #endif
 
 	jpeg_read_header(&cinfo, TRUE);
+	/* If asked for a smaller image, let libjpeg do most of the reduction
+	 * in DCT domain, decoding at 1/2, 1/4 or 1/8 of full size */
+	if ((settings->mode != FS_CHANNEL_LOAD) && req_size(settings,
+		cinfo.image_width, cinfo.image_height, &rw, &rh))
+	{
+		for (i = 8; i > 1; i >>= 1)
+		{
+			if ((cinfo.image_width + i - 1) / i < rw) continue;
+			if ((cinfo.image_height + i - 1) / i < rh) continue;
+			cinfo.scale_num = 1;
+			cinfo.scale_denom = i;
+			break;
+		}
+	}
 	jpeg_start_decompress(&cinfo);
 
 	bpp = 3;
@@ -1992,6 +2395,17 @@ static int load_jpeg(char *file_name, ls_settings *settings)
 	settings->width = width = cinfo.output_width;
 	settings->height = height = cinfo.output_height;
 	settings->bpp = bpp;
+	/* Decode into a buffer, and scale from it the rest of the way */
+	if (rw && ((rw != width) || (rh != height)))
+	{
+		settings->width = rw;
+		settings->height = rh;
+		if (!(mems = malloc((size_t)width * height * bpp)))
+		{
+			res = FILE_MEM_ERROR;
+			goto fail;
+		}
+	}
 	if ((res = allocate_image(settings, CMASK_IMAGE))) goto fail;
 	res = -1;
 	pr = !settings->silent;
@@ -2048,11 +2462,13 @@ static int load_jpeg(char *file_name, ls_settings *settings)
 
 	if (pr) ls_init("JPEG", 0);
 
+	sink_init(&sink, settings, mems ? mems : settings->img[CHN_IMAGE],
+		width, memx ? 4 : bpp, memx ? inv + 1 : 0, -1);
 	for (i = 0; i < height; i++)
 	{
-		memp = settings->img[CHN_IMAGE] + width * i * bpp;
+		memp = sink.img + width * i * bpp;
 		jpeg_read_scanlines(&cinfo, memx ? &memx : &memp, 1);
-		if (memx) cmyk2rgb(memp, memx, width, inv, settings);
+		sink_row(&sink, memx ? memx : memp, i);
 		ls_progress(settings, i, 20);
 	}
 	done_cmyk2rgb(settings);
@@ -2060,14 +2476,31 @@ static int load_jpeg(char *file_name, ls_settings *settings)
 	res = 1;
 
 fail:	if (pr) progress_end();
+	sink_done(&sink);
+	/* Scale whatever got decoded, even if not all of it */
+	if (mems && settings->img[CHN_IMAGE] && ((res == 1) ||
+		(res == FILE_LIB_ERROR)))
+	{
+		chanlist old_img, new_img;
+
+		memset(old_img, 0, sizeof(chanlist));
+		memset(new_img, 0, sizeof(chanlist));
+		old_img[CHN_IMAGE] = mems;
+		new_img[CHN_IMAGE] = settings->img[CHN_IMAGE];
+		if (mem_image_scale_real(old_img, width, height, bpp,
+			new_img, rw, rh, bpp == 3, FALSE, FALSE))
+			res = FILE_MEM_ERROR;
+	}
 	jpeg_destroy_decompress(&cinfo);
 	fclose(fp);
 	free(memx);
+	free(mems);
 	return (res);
 }
 
 static int save_jpeg(char *file_name, ls_settings *settings)
 {
+	struct my_error_mgr jerr; // Own one, as frames get saved in parallel
 	struct jpeg_compress_struct cinfo;
 	JSAMPROW row_pointer;
 	FILE *fp;
@@ -2968,37 +3401,64 @@ static int load_tiff_frame(TIFF *tif, ls_settings *settings)
 	/* Read it as ARGB if can't understand it ourselves */
 	if (argb)
 	{
-		/* libtiff is too much of a moving target if finer control is
-		 * needed, so let's trade memory for stability */
-		raster = (uint32 *)_TIFFmalloc(width * height * sizeof(uint32));
-		res = FILE_MEM_ERROR;
-		if (!raster) goto fail2;
-		res = FILE_LIB_ERROR;
-		if (!TIFFReadRGBAImage(tif, width, height, raster, 0)) goto fail2;
-		res = -1;
+		TIFFRGBAImage img;
+		ls_sink sink;
+		uint32 y, n, k, l;
 
-		/* Parse the RGB part only - alpha might be eaten by bugs */
-		tr = raster;
-		for (i = height - 1; i >= 0; i--)
+		res = FILE_LIB_ERROR;
+		if (!TIFFRGBAImageBegin(&img, tif, 0, cbuf)) goto fail2;
+
+		/* Get image from libtiff by strips or rows of tiles, to store
+		 * and forget them one by one */
+		img.req_orientation = ORIENTATION_TOPLEFT;
+		n = tw ? th : rps;
+		if (!n || (n > height)) n = height;
+		raster = (uint32 *)_TIFFmalloc(width * n * sizeof(uint32));
+		if (!raster) res = FILE_MEM_ERROR;
+		else
 		{
-			tmp = settings->img[CHN_IMAGE] + width * i * bpp;
-			j = width;
-			while (j--)
+			/* Parse the RGB part only - alpha might be eaten by bugs */
+			sink_init(&sink, settings, settings->img[CHN_IMAGE],
+				width, 4, 0, -1);
+			for (y = 0; y < height; y += k)
 			{
-				tmp[0] = TIFFGetR(*tr);
-				tmp[1] = TIFFGetG(*tr);
-				tmp[2] = TIFFGetB(*tr);
-				tmp += 3; tr++;
+				k = height - y < n ? height - y : n;
+				img.row_offset = y;
+				img.col_offset = 0;
+				if (!TIFFRGBAImageGet(&img, raster, width, k)) break;
+				/* A bottom-up image gets flipped by pieces */
+				switch (img.orientation)
+				{
+				case ORIENTATION_BOTRIGHT:
+				case ORIENTATION_BOTLEFT:
+				case ORIENTATION_RIGHTBOT:
+				case ORIENTATION_LEFTBOT:
+					l = height - y - k; break;
+				default: l = y; break;
+				}
+				for (i = 0; i < k; i++)
+				{
+					tr = raster + i * width;
+					tmp = (unsigned char *)tr;
+					for (j = 0; j < width; j++ , tmp += 4)
+					{
+						uint32 v = tr[j];
+
+						tmp[0] = TIFFGetR(v);
+						tmp[1] = TIFFGetG(v);
+						tmp[2] = TIFFGetB(v);
+						tmp[3] = TIFFGetA(v);
+					}
+					sink_row(&sink, (unsigned char *)tr, l + i);
+					ls_progress(settings, y + i, 10);
+				}
 			}
-			ls_progress(settings, height - i, 10);
+			sink_done(&sink);
+			if (y >= height) res = 1;
 		}
-
-		_TIFFfree(raster);
-		raster = NULL;
+		TIFFRGBAImageEnd(&img);
 
 /* !!! Now it would be good to read in alpha ourselves - but not yet... */
-
-		res = 1;
 	}
 
 	/* Read & interpret it ourselves */
@@ -3068,7 +3528,7 @@ static int load_tiff_frame(TIFF *tif, ls_settings *settings)
 		{
 			unsigned char *tmp, *tmpa;
 			uint32 x, y, w, h, l;
-			int i, k, dx, dxa, dy, dys;
+			int k, dx, dxa, dy, dys;
 
 			/* Read one piece */
 			if (tw)
@@ -3109,8 +3569,7 @@ static int load_tiff_frame(TIFF *tif, ls_settings *settings)
 
 			/* Prepare pointers */
 			dx = dxa = 1; dy = width;
-			i = y * width + x;
-			tmp = tmpa = settings->img[CHN_ALPHA] + i;
+			tmp = tmpa = ROW_PTR(settings->img[CHN_ALPHA], y, width, 1) + x;
 			if (plane >= wbpp); // Alpha
 			else if (tbuf) // CMYK
 			{
@@ -3120,7 +3579,8 @@ static int load_tiff_frame(TIFF *tif, ls_settings *settings)
 			else // RGB/indexed
 			{
 				dx = bpp;
-				tmp = settings->img[CHN_IMAGE] + plane + i * bpp;
+				tmp = ROW_PTR(settings->img[CHN_IMAGE], y, width, bpp) +
+					x * bpp + plane;
 			}
 			dy *= dx; dys = bpr;
 			src = buf;
@@ -3166,7 +3626,7 @@ static int load_tiff_frame(TIFF *tif, ls_settings *settings)
 				do_xlate(xtable, tbuf, w * h * 4);
 			cmyk2rgb(tbuf, tbuf, w * h, FALSE, settings);
 			src = tbuf;
-			tmp = settings->img[CHN_IMAGE] + (y * width + x) * 3;
+			tmp = ROW_PTR(settings->img[CHN_IMAGE], y, width, 3) + x * 3;
 			w *= 3;
 			for (l = 0; l < h; l++ , tmp += width * 3 , src += w)
 				memcpy(tmp, src, w);
@@ -6732,8 +7192,8 @@ static int load_svg(char *file_name, ls_settings *settings)
 	GdkPixbuf *pbuf;
 	GError *err = NULL;
 	guchar *src;
-	unsigned char *dest, *dsta;
-	int i, j, w, h, bpp, cmask, skip, res = -1;
+	ls_sink sink;
+	int i, w, h, bpp, stride, res = -1;
 
 
 #if (GDK_PIXBUF_MAJOR == 2) && (GDK_PIXBUF_MINOR < 8)
@@ -6763,30 +7223,20 @@ static int load_svg(char *file_name, ls_settings *settings)
 	if (gdk_pixbuf_get_bits_per_sample(pbuf) != 8) goto fail;
 
 	bpp = gdk_pixbuf_get_n_channels(pbuf);
-	if (bpp == 4) cmask = CMASK_RGBA;
-	else if (bpp == 3) cmask = CMASK_IMAGE;
-	else goto fail;
+	if ((bpp != 3) && (bpp != 4)) goto fail;
 	settings->width = w = gdk_pixbuf_get_width(pbuf);
 	settings->height = h = gdk_pixbuf_get_height(pbuf);
 	settings->bpp = 3;
-	if ((res = allocate_image(settings, cmask))) goto fail;
+	if ((res = allocate_image(settings, CMASK_IMAGE))) goto fail;
 
-	skip = gdk_pixbuf_get_rowstride(pbuf) - w * bpp;
+	/* All-set "alpha" needs no channel */
+	stride = gdk_pixbuf_get_rowstride(pbuf);
 	src = gdk_pixbuf_get_pixels(pbuf);
-	dest = settings->img[CHN_IMAGE];
-	dsta = settings->img[CHN_ALPHA];
-	for (i = 0; i < h; i++ , src += skip)
-	for (j = 0; j < w; j++ , src += bpp , dest += 3)
-	{
-		dest[0] = src[0];
-		dest[1] = src[1];
-		dest[2] = src[2];
-		if (dsta) *dsta++ = src[3];
-	}
-	res = 1;
-
-	/* Delete all-set "alpha" */
-	delete_alpha(settings, 255);
+	sink_init(&sink, settings, settings->img[CHN_IMAGE], w, bpp, 0, 255);
+	for (i = 0; (i < h) && !(res = sink_row(&sink, src, i)); i++)
+		src += stride;
+	sink_done(&sink);
+	if (!res) res = 1;
 
 fail:	g_object_unref(pbuf);
 	return (res);
@@ -7066,50 +7516,57 @@ int save_mem_image(unsigned char **buf, int *len, ls_settings *settings)
 	return (res);
 }
 
+#ifdef U_LCMS
+/* Prepare transform from image's ICC profile to sRGB, if any is needed */
+static cmsHTRANSFORM icc_transform(ls_settings *settings)
+{
+	cmsHPROFILE from, to;
+	cmsHTRANSFORM how = NULL;
+	int l = settings->icc_size - sizeof(icHeader);
+	unsigned char *iccdata = settings->icc + sizeof(icHeader);
+
+	/* Do nothing if the profile seems to be the default sRGB one */
+	if ((l == 3016) && (hashf(HASHSEED, iccdata, l) == 0xBA0A8E52UL) &&
+		(hashf(HASH_RND(HASHSEED), iccdata, l) == 0x94C42C77UL))
+		return (NULL);
+
+	from = cmsOpenProfileFromMem((void *)settings->icc, settings->icc_size);
+	to = cmsCreate_sRGBProfile();
+	if (from && (cmsGetColorSpace(from) == icSigRgbData))
+		how = cmsCreateTransform(from, TYPE_RGB_8,
+			to, TYPE_RGB_8, INTENT_PERCEPTUAL, 0);
+	if (from) cmsCloseProfile(from);
+	cmsCloseProfile(to);
+	return (how);
+}
+#endif
+
 static void store_image_extras(image_info *image, image_state *state,
 	ls_settings *settings)
 {
 #if U_LCMS
-	/* Apply ICC profile */
-	while ((settings->icc_size > 0) && (settings->bpp == 3))
-	{
-		cmsHPROFILE from, to;
-		cmsHTRANSFORM how = NULL;
-		int l = settings->icc_size - sizeof(icHeader);
-		unsigned char *iccdata = settings->icc + sizeof(icHeader);
-
-		/* Do nothing if the profile seems to be the default sRGB one */
-		if ((l == 3016) && (hashf(HASHSEED, iccdata, l) == 0xBA0A8E52UL) &&
-			(hashf(HASH_RND(HASHSEED), iccdata, l) == 0x94C42C77UL)) break;
-
-		from = cmsOpenProfileFromMem((void *)settings->icc,
-			settings->icc_size);
-		to = cmsCreate_sRGBProfile();
-		if (from && (cmsGetColorSpace(from) == icSigRgbData))
-			how = cmsCreateTransform(from, TYPE_RGB_8,
-				to, TYPE_RGB_8, INTENT_PERCEPTUAL, 0);
-		if (how)
-		{
-			unsigned char *img = settings->img[CHN_IMAGE];
-			size_t l = settings->width, sz = l * settings->height;
-			int i, j;
-
-			if (!settings->silent)
-				progress_init(_("Applying colour profile"), 1);
-			else if (sz < UINT_MAX) l = sz;
-			j = sz / l;
-			for (i = 0; i < j; i++ , img += l * 3)
-			{
-				if (!settings->silent && ((i * 20) % j >= j - 20))
-					if (progress_update((float)i / j)) break;
-				cmsDoTransform(how, img, img, l);
-			}
-			progress_end();
-			cmsDeleteTransform(how);
+	cmsHTRANSFORM how;
+
+	/* Apply ICC profile, if the loader didn't */
+	if ((settings->icc_size > 0) && (settings->bpp == 3) &&
+		(how = icc_transform(settings)))
+	{
+		unsigned char *img = settings->img[CHN_IMAGE];
+		size_t l = settings->width, sz = l * settings->height;
+		int i, j;
+
+		if (!settings->silent)
+			progress_init(_("Applying colour profile"), 1);
+		else if (sz < UINT_MAX) l = sz;
+		j = sz / l;
+		for (i = 0; i < j; i++ , img += l * 3)
+		{
+			if (!settings->silent && ((i * 20) % j >= j - 20))
+				if (progress_update((float)i / j)) break;
+			cmsDoTransform(how, img, img, l);
 		}
-		if (from) cmsCloseProfile(from);
-		cmsCloseProfile(to);
-		break;
+		progress_end();
+		cmsDeleteTransform(how);
 	}
 #endif
 // !!! Changing any values is frequently harmful in this mode, so don't do it
@@ -7165,6 +7622,8 @@ static int load_image_x(char *file_name, memFILE *mf, int mode, int ftype,
 	if (!apply_icc || ((mode == FS_CHANNEL_LOAD) ? (MEM_BPP != 3) :
 		(mode != FS_PNG_LOAD) && (mode != FS_LAYER_LOAD)))
 		settings.icc_size = -1;
+	/* Otherwise, row sink may apply it on the fly */
+	else settings.icc_apply = TRUE;
 #endif
 	/* 0th layer load is just an image load */
 	if ((mode == FS_LAYER_LOAD) && !layers_total) mode = FS_PNG_LOAD;
@@ -7314,7 +7773,7 @@ static int load_image_x(char *file_name, memFILE *mf, int mode, int ftype,
 			mem_undo_prepare();
 		}
 		/* Failure */
-		else free(settings.img[CHN_IMAGE]);
+		else mem_chan_free(settings.img[CHN_IMAGE]);
 		break;
 	case FS_LAYER_LOAD: /* Layer */
 		/* Success - commit load */
@@ -7333,7 +7792,7 @@ static int load_image_x(char *file_name, memFILE *mf, int mode, int ftype,
 		/* Success - rebuild patterns */
 		if ((res == 1) && (settings.colors == 2))
 			set_patterns(settings.img[CHN_IMAGE]);
-		free(settings.img[CHN_IMAGE]);
+		mem_chan_free(settings.img[CHN_IMAGE]);
 		break;
 	case FS_PALETTE_LOAD:
 	case FS_PALETTE_DEF:
@@ -7451,6 +7910,104 @@ int load_frameset(frameset *frames, int ani_mode, char *file_name, int mode,
 	return (res);
 }
 
+/* With helper threads, frames are queued to be written out in parallel, and
+ * the reader only waits when the queue is full; helpers never allocate or free
+ * anything, so the reader retires written frames itself, in sequence order */
+
+#define FRAMES_QUEUE 2 /* Frames queued per thread */
+
+/* Write out the next queued frame; call with mutex locked */
+static int write_next_frame(frame_queue *q)
+{
+	frame_job *job;
+	int res = -1;
+
+	if (q->next >= q->head) return (FALSE);
+	job = q->jobs + q->next++ % q->size;
+	thread_unlock();
+	/* No use writing anything after a failure */
+	if (q->fail < 0) res = save_image(job->name, &job->set);
+	thread_lock();
+	job->res = res;
+	job->done = TRUE;
+	thread_wake();
+	return (TRUE);
+}
+
+/* Account for written frames, and free them; call with mutex locked */
+static void retire_frames(ani_settings *ani)
+{
+	frame_queue *q = ani->queue;
+	frame_job *job;
+
+	while (q->tail < q->head)
+	{
+		job = q->jobs + q->tail % q->size;
+		if (!job->done) break;
+		if (q->fail >= 0) // Only frames before the failed one stay
+		{
+			if (!job->res) unlink(job->name);
+		}
+		else if (job->res) ani->error = job->res , q->fail = q->tail;
+		mem_free_chanlist(job->set.img);
+		job->done = FALSE;
+		q->tail++;
+	}
+}
+
+static int queue_frame(ani_settings *ani, char *name, ls_settings *w_set,
+	ls_settings *f_set, image_frame *frame)
+{
+	frame_queue *q = ani->queue;
+	frame_job *job;
+	chanlist img;
+	size_t l;
+	int i;
+
+	/* Take over the image, or copy it if loader still needs it */
+	memcpy(img, w_set->img, sizeof(chanlist));
+	if (f_set) memset(f_set->img, 0, sizeof(chanlist));
+	else for (i = 0; i < NUM_CHANNELS; i++)
+	{
+		if (!img[i]) continue;
+		l = (size_t)frame->width * frame->height *
+			(i == CHN_IMAGE ? frame->bpp : 1);
+		if (!(img[i] = malloc(l)))
+		{
+			while (--i >= 0) mem_chan_free(img[i]);
+			return (FILE_MEM_ERROR);
+		}
+		memcpy(img[i], w_set->img[i], l);
+	}
+
+	thread_lock();
+	while (TRUE)
+	{
+		retire_frames(ani);
+		if (q->fail >= 0) break;
+		if (q->head - q->tail < q->size) break;
+		/* Queue is full - help write it out, or wait */
+		if (!write_next_frame(q)) thread_wait();
+	}
+	if (q->fail < 0)
+	{
+		job = q->jobs + q->head++ % q->size;
+		job->set = *w_set;
+		memcpy(job->set.img, img, sizeof(chanlist));
+		if (w_set->pal) // Loader will reuse its palette
+			mem_pal_copy(job->set.pal = job->pal, w_set->pal);
+		strncpy0(job->name, name, sizeof(job->name));
+		ani->cnt++;
+		thread_wake();
+		memset(img, 0, sizeof(chanlist));
+	}
+	thread_unlock();
+	mem_free_chanlist(img);
+
+	if (!f_set) frame->flags |= FM_NUKE; // Set for deletion
+	return (q->fail < 0 ? 0 : ani->error);
+}
+
 /* Write out the last frame to indexed sequence, and delete it */
 static int write_out_frame(char *file_name, ani_settings *ani, ls_settings *f_set)
 {
@@ -7493,6 +8050,8 @@ static int write_out_frame(char *file_name, ani_settings *ani, ls_settings *f_se
 	}
 	w_set.mode = ani->mode; // Only FS_EXPLODE_FRAMES for now
 
+	if (ani->queue) return (queue_frame(ani, new_name, &w_set, f_set, frame));
+
 	res = ani->error = save_image(new_name, &w_set);
 	if (!res) ani->cnt++;
 
@@ -7515,20 +8074,82 @@ static void warn_miss(int miss, int total, int ftype)
 	g_free(txt);
 }
 
+typedef struct {
+	ani_settings *ani;
+	char *file_name;
+	int ani_mode, ftype;
+} explode_context;
+
+static void do_explode(tcb *thread)
+{
+	explode_context *ctx = thread->data;
+	ani_settings *ani = ctx->ani;
+	frame_queue *q = ani->queue;
+
+	/* Helpers write frames till reader is done and queue is empty */
+	if (thread->index)
+	{
+		thread_lock();
+		while (!q->done || (q->next < q->head))
+			if (!write_next_frame(q)) thread_wait();
+		thread_unlock();
+		return;
+	}
+
+	/* Main thread reads frames, then helps finish writing them */
+	q->res = load_frames_x(ani, ctx->ani_mode, ctx->file_name,
+		FS_EXPLODE_FRAMES, ctx->ftype);
+	thread_lock();
+	q->done = TRUE;
+	thread_wake();
+	while (TRUE)
+	{
+		retire_frames(ani);
+		if (q->tail >= q->head) break;
+		if (!write_next_frame(q)) thread_wait();
+	}
+	thread_unlock();
+	if (q->fail >= 0) ani->cnt = q->fail;
+}
+
 int explode_frames(char *dest_path, int ani_mode, char *file_name, int ftype,
 	int desttype)
 {
+	explode_context ctx = { NULL, file_name, ani_mode, ftype };
 	ani_settings ani;
-	int res;
+	frame_queue q;
+	threaddata *tdata = NULL;
+	int res, nt = helper_threads();
 
 
 	memset(&ani, 0, sizeof(ani_settings));
 	ani.desttype = desttype;
 	ani.destdir = dest_path;
 
+	/* Prepare a pipeline if there are threads to run it */
+	memset(&q, 0, sizeof(q));
+	q.fail = -1;
+	if ((nt > 1) && (q.jobs = calloc(q.size = nt * FRAMES_QUEUE,
+		sizeof(frame_job))))
+	{
+		ctx.ani = &ani;
+		tdata = talloc(0, nt, &ctx, sizeof(ctx), NULL, NULL);
+	}
+
 	progress_init(_("Explode frames"), 0);
 	progress_update(0.0);
-	res = load_frames_x(&ani, ani_mode, file_name, FS_EXPLODE_FRAMES, ftype);
+	if (tdata)
+	{
+		ani.queue = &q;
+		tdata->silent = TRUE; // Progress is shown by reader
+		launch_threads(do_explode, tdata, NULL, tdata->count);
+		res = q.res;
+		ani.queue = NULL;
+	}
+	else res = load_frames_x(&ani, ani_mode, file_name,
+		FS_EXPLODE_FRAMES, ftype);
+	free(tdata);
+	free(q.jobs);
 	progress_update(1.0);
 	if (res == 1); // Everything went OK
 	else if (res == FILE_MEM_ERROR); // Report memory problem
@@ -134,7 +134,7 @@ typedef struct {
 	int mode, ftype;
 	int xpm_trans;
 	int hot_x, hot_y;
-	int req_w, req_h; // Size request for scalable formats
+	int req_w, req_h; // Size request for scalable formats & JPEG
 	int jpeg_quality;
 	int png_compression;
 	int lzma_preset;
@@ -152,6 +152,7 @@ typedef struct {
 	/* Extra data */
 	int icc_size;
 	char *icc;
+	int icc_apply;	// Color profile may get applied while loading
 } ls_settings;
 
 int silence_limit, jpeg_quality, png_compression;
@@ -141,6 +141,13 @@ static int tablet_preview(pref_dd *dt, void **wdata, int what, void **where,
 
 ///	V-CODE
 
+/* No spoolfiles on Windows, so no disk-backed undo or channels there */
+#ifdef WIN32
+#define DISK_PREFS 0
+#else
+#define DISK_PREFS 2
+#endif
+
 #define WBbase pref_dd
 static void *pref_code[] = {
 	WINDOW(_("Preferences")), // nonmodal
@@ -156,19 +163,28 @@ static void *pref_code[] = {
 ///	---- TAB1 - GENERAL
 	PAGE(_("General")), GROUPN,
 #ifdef U_THREADS
-	TABLE2(5),
+	TABLE2(5 + DISK_PREFS),
 	TSPINv(_("Max threads (0 to autodetect)"), maxthreads, 0, 256),
 	TSPINv(_("Min kpixels per render thread"), kpix_threads,
 		16, (MAX_WIDTH * MAX_HEIGHT + 1023) / 1024),
 #else
-	TABLE2(3),
+	TABLE2(3 + DISK_PREFS),
 #endif
 	TSPINv(_("Max memory used for undo (MB)"), mem_undo_limit, 1, 2048),
+#ifndef WIN32
+	TSPINv(_("Max disk space used for undo (MB, 0=none)"), mem_undo_disk,
+		0, 1048576),
+#endif
 	TSPINa(_("Max undo levels"), undo_depth),
 	TSPINv(_("Communal layer undo space (%)"), mem_undo_common, 0, 100),
+#ifndef WIN32
+	TSPINv(_("Disk-backed channels from (MB, 0=never)"), mem_bigchan_mb,
+		0, 65536),
+#endif
 	WDONE,
 	CHECKv(_("Use gamma correction by default"), use_gamma),
 	CHECKv(_("Use gamma correction when painting"), paint_gamma),
+	CHECKv(_("Fast approximate Gaussian blur"), fast_gauss),
 	/* !!! Only processing is scriptable, interface is not */
 	UNLESSx(script, 1),
 	CHECKv(_("Optimize alpha chequers"), chequers_optimize),
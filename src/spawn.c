@@ -53,6 +53,24 @@ static char *get_tempdir()
 	return (env);
 }
 
+/* Create an unnamed temp file for spooling data; returns fd or -1 */
+int open_spoolfile()
+{
+#ifdef WIN32 /* No unlinking of open files */
+	return (-1);
+#else
+	char *buf;
+	int fd;
+
+	buf = file_in_dir(NULL, get_tempdir(), "mtspoolXXXXXX", PATHBUF);
+	if (!buf) return (-1);
+	fd = mkstemp(buf);
+	if (fd >= 0) unlink(buf); // Will vanish when closed
+	free(buf);
+	return (fd);
+#endif
+}
+
 static char *new_temp_dir()
 {
 	char *buf, *base = get_tempdir();
@@ -34,6 +34,7 @@ void init_factions();					// Initialize file action menu
 
 int get_tempname(char *buf, char *f, int type);		// Create tempfile for name
 void spawn_quit();	// Delete temp files
+int open_spoolfile();	// Create unnamed tempfile, return its fd
 
 // Default action codes
 enum {
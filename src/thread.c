@@ -27,6 +27,7 @@
 
 
 int maxthreads;
+int thread_stats;
 
 #ifdef U_THREADS
 
@@ -35,7 +36,6 @@ int maxthreads;
 #if GTK_MAJOR_VERSION == 1
 #ifdef G_THREADS_IMPL_POSIX
 #include <pthread.h>
-#include <sched.h>
 #else
 #error "Non-POSIX threads not supported with GTK+1"
 #endif
@@ -234,13 +234,107 @@ int thread_progress(tcb *thread)
 	tcb **tp = thread->tdata->threads;
 	int i, j, n = thread->count;
 
+	/* Silent jobs, including ones run inline, leave progressbar alone */
+	if (thread->tdata->silent) return (thread->stop);
 	for (i = j = 0; i < n; i++) j += tp[i]->progress;
 	if (!progress_update((float)j / thread->tsteps)) return (FALSE);
 
 	for (i = 0; i < n; i++) tp[i]->stop = TRUE;
+	/* Let threads sleeping in thread_wait() see the stop */
+	thread_lock();
+	thread_wake();
+	thread_unlock();
 	return (TRUE);
 }
 
+/* Work-stealing deque keeps [low, high) range of steps in one 64-bit value,
+ * to update both bounds in one atomic operation */
+
+#define RANGE(L,H) (((guint64)(H) << 32) + (guint32)(L))
+#define RANGE_L(R) ((int)((R) & 0xFFFFFFFFU))
+#define RANGE_H(R) ((int)((R) >> 32))
+
+#if defined(HAVE__SFA) && (GLIB_SIZEOF_VOID_P >= 8)
+#define thread_cas64(A,O,N) __sync_bool_compare_and_swap((A), (O), (N))
+#else
+static int thread_cas64(volatile guint64 *var, guint64 old, guint64 new)
+{
+	DEF_MUTEX(cas_lock);
+	int res;
+
+	LOCK_MUTEX(cas_lock);
+	if ((res = (*var == old))) *var = new;
+	UNLOCK_MUTEX(cas_lock);
+	return (res);
+}
+#endif
+
+/* Take a piece off the low end of own range; pieces shrink as it runs out */
+static int steal_own(tcb *thread)
+{
+	guint64 r;
+	int l, h, n;
+
+	while (TRUE)
+	{
+		r = thread->range;
+		l = RANGE_L(r);
+		h = RANGE_H(r);
+		if (l >= h) return (FALSE);
+		n = (h - l + 3) >> 2;
+		if (thread_cas64(&thread->range, r, RANGE(l + n, h))) break;
+	}
+	thread->step0 = l;
+	thread->nsteps = n;
+	return (TRUE);
+}
+
+/* Move upper half of the largest remaining range into own empty one */
+static int steal_other(tcb *thread)
+{
+	threaddata *tdata = thread->tdata;
+	tcb *tp;
+	guint64 r;
+	int i, l, h, n;
+
+	while (TRUE)
+	{
+		for (i = n = 0 , tp = NULL; i < tdata->count; i++)
+		{
+			r = tdata->threads[i]->range;
+			l = RANGE_H(r) - RANGE_L(r);
+			if (l > n) n = l , tp = tdata->threads[i];
+		}
+		if (!tp) return (FALSE); // All work is taken
+		r = tp->range;
+		l = RANGE_L(r);
+		h = RANGE_H(r);
+		if (l >= h) continue;
+		n = (h - l + 1) >> 1;
+		if (thread_cas64(&tp->range, r, RANGE(l, h - n))) break;
+	}
+	/* Nobody steals from an empty range, but a torn write could be seen */
+	while (!thread_cas64(&thread->range, r = thread->range, RANGE(h - n, h)));
+	return (TRUE);
+}
+
+static void thread_steal(tcb *thread)
+{
+	thread_func tf = thread->tdata->what;
+
+	while (TRUE)
+	{
+		if (!steal_own(thread))
+		{
+			if (!steal_other(thread)) break;
+			continue;
+		}
+		tf(thread);
+		if (thread->stop || thread->stopped) break;
+	}
+	thread_done(thread);
+}
+
 static void thread_chunk(tcb *thread)
 {
 	threaddata *tdata = thread->tdata;
@@ -259,24 +353,304 @@ static void thread_chunk(tcb *thread)
 	thread_done(thread);
 }
 
-int threads_running;
+/* Helper threads are launched once and then sleep between jobs, waiting for
+ * work on a condition variable; slot 0 stands for main thread and is unused */
 
-int launch_threads(thread_func thread, threaddata *tdata, char *title, int total)
+typedef struct {
+	tcb *job;		// Work to do, NULL if idle
+	thread_func func;	// Function to run on it
+} pool_slot;
+
+static pool_slot *pool;
+static int pool_size, pool_max;
+
+#define POOL_WAIT_MS 20 /* Poll interval for progressbar & cancellation */
+
+#if GTK_MAJOR_VERSION == 1
+
+static pthread_mutex_t pool_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t pool_wake = PTHREAD_COND_INITIALIZER,
+	pool_idle = PTHREAD_COND_INITIALIZER,
+	pool_queue = PTHREAD_COND_INITIALIZER;
+
+#define POOL_LOCK() pthread_mutex_lock(&pool_mutex)
+#define POOL_UNLOCK() pthread_mutex_unlock(&pool_mutex)
+#define POOL_WAIT(C) pthread_cond_wait(&(C), &pool_mutex)
+#define POOL_SIGNAL(C) pthread_cond_broadcast(&(C))
+
+#else
+
+static GMutex *pool_mutex;
+static GCond *pool_wake, *pool_idle, *pool_queue;
+
+#define POOL_LOCK() g_mutex_lock(pool_mutex)
+#define POOL_UNLOCK() g_mutex_unlock(pool_mutex)
+#define POOL_WAIT(C) g_cond_wait((C), pool_mutex)
+#define POOL_SIGNAL(C) g_cond_broadcast(C)
+
+#endif
+
+/* Wait on idle condition, but no longer than POOL_WAIT_MS */
+static void pool_timed_wait()
 {
+	GTimeVal tv;
+
+	g_get_current_time(&tv);
+	tv.tv_usec += POOL_WAIT_MS * 1000;
+	tv.tv_sec += tv.tv_usec / 1000000;
+	tv.tv_usec %= 1000000;
+#if GTK_MAJOR_VERSION == 1
+	{
+		struct timespec ts;
+
+		ts.tv_sec = tv.tv_sec;
+		ts.tv_nsec = tv.tv_usec * 1000;
+		pthread_cond_timedwait(&pool_idle, &pool_mutex, &ts);
+	}
+#else
+	g_cond_timed_wait(pool_idle, pool_mutex, &tv);
+#endif
+}
+
+static double thread_time()
+{
+	GTimeVal tv;
+
+	g_get_current_time(&tv);
+	return (tv.tv_sec + tv.tv_usec * 0.000001);
+}
+
+static void *pool_worker(void *data)
+{
+	int n = (int)(size_t)data;
+	thread_func tf;
 	tcb *tp;
-	clock_t uninit_(before), now;
-	int i, j, n0, n1, flag = FALSE;
+	double t0;
+
+	POOL_LOCK();
+	while (TRUE)
+	{
+		if (!(tp = pool[n].job))
+		{
+			POOL_WAIT(pool_wake);
+			continue;
+		}
+		tf = pool[n].func;
+		POOL_UNLOCK();
+		t0 = thread_time();
+		tf(tp);
+		tp->busy = thread_time() - t0;
+		POOL_LOCK();
+		pool[n].job = NULL;
+		POOL_SIGNAL(pool_idle);
+	}
+	return (NULL);
+}
+
+/* Make sure there are (n - 1) helper threads in pool, if possible */
+static void pool_grow(int n)
+{
+	pool_slot *tmp;
 #if GTK_MAJOR_VERSION == 1
 	pthread_t tid;
 	pthread_attr_t attr;
-	int attr_failed;
 
-	attr_failed = pthread_attr_init(&attr) ||
+	if (n <= pool_size) return;
+	if (pthread_attr_init(&attr) ||
 #ifdef PTHREAD_SCOPE_SYSTEM
 		pthread_attr_setscope(&attr, PTHREAD_SCOPE_SYSTEM) ||
 #endif
-		pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+		pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED))
+		return;
+#else
+	if (n <= pool_size) return;
+	if (!pool_mutex)
+	{
+		pool_mutex = g_mutex_new();
+		pool_wake = g_cond_new();
+		pool_idle = g_cond_new();
+		pool_queue = g_cond_new();
+	}
+#endif
+
+	POOL_LOCK();
+	while (n > pool_max)
+	{
+		tmp = realloc(pool, n * sizeof(pool_slot));
+		if (!tmp) n = pool_max; // Make do with what we have
+		else pool = tmp , pool_max = n;
+	}
+	if (!pool_size) pool_size = 1; // Slot for main thread
+	while (pool_size < n)
+	{
+		pool[pool_size].job = NULL;
+#if GTK_MAJOR_VERSION == 1
+		if (pthread_create(&tid, &attr, pool_worker,
+			(void *)(size_t)pool_size)) break;
+#else
+		if (!g_thread_create((GThreadFunc)pool_worker,
+			(void *)(size_t)pool_size, FALSE, NULL)) break;
+#endif
+		pool_size++;
+	}
+	POOL_UNLOCK();
+#if GTK_MAJOR_VERSION == 1
+	pthread_attr_destroy(&attr);
 #endif
+}
+
+void init_threads()
+{
+	pool_grow(helper_threads());
+}
+
+/* Background thread is a separate one, for jobs the main thread does not wait
+ * on - it gets started on first use, and shares the pool's mutex & conditions */
+
+static thread_bgfunc volatile bg_func;
+static void *bg_data;
+static int bg_state; // 0 = not started, 1 = running, -1 = failed to start
+
+static void *bg_worker(void *data)
+{
+	thread_bgfunc tf;
+
+	POOL_LOCK();
+	while (TRUE)
+	{
+		if (!(tf = bg_func))
+		{
+			POOL_WAIT(pool_wake);
+			continue;
+		}
+		POOL_UNLOCK();
+		tf(bg_data);
+		POOL_LOCK();
+		bg_func = NULL;
+		POOL_SIGNAL(pool_idle);
+	}
+	return (NULL);
+}
+
+static int bg_start()
+{
+#if GTK_MAJOR_VERSION == 1
+	pthread_t tid;
+	pthread_attr_t attr;
+
+	bg_state = -1;
+	if (pthread_attr_init(&attr)) return (FALSE);
+	if (!pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED) &&
+		!pthread_create(&tid, &attr, bg_worker, NULL)) bg_state = 1;
+	pthread_attr_destroy(&attr);
+#else
+	bg_state = -1;
+	pool_grow(1); // Create mutex & conditions
+	if (g_thread_create((GThreadFunc)bg_worker, NULL, FALSE, NULL))
+		bg_state = 1;
+#endif
+	return (bg_state > 0);
+}
+
+int thread_bg_run(thread_bgfunc func, void *data)
+{
+	if (!bg_state) bg_start();
+	if (bg_state < 0) return (FALSE);
+	thread_bg_wait(); // One job at a time
+	POOL_LOCK();
+	bg_data = data;
+	bg_func = func;
+	POOL_SIGNAL(pool_wake);
+	POOL_UNLOCK();
+	return (TRUE);
+}
+
+void thread_bg_wait()
+{
+	if (bg_state <= 0) return;
+	POOL_LOCK();
+	while (bg_func) POOL_WAIT(pool_idle);
+	POOL_UNLOCK();
+}
+
+int thread_bg_busy()
+{
+	return (bg_func != NULL);
+}
+
+/* Threads of a running job can pass data between them, pipeline fashion,
+ * under the pool's mutex and using a condition of their own */
+
+void thread_lock()
+{
+	POOL_LOCK();
+}
+
+void thread_unlock()
+{
+	POOL_UNLOCK();
+}
+
+void thread_wait()
+{
+	POOL_WAIT(pool_queue);
+}
+
+void thread_wake()
+{
+	POOL_SIGNAL(pool_queue);
+}
+
+int threads_running;
+
+/* Pool runs one job at a time; set while it does */
+static volatile int pool_busy;
+
+int thread_pool_busy()
+{
+	return (pool_busy);
+}
+
+/* Run a job wholly in the calling thread, silently - for jobs launched while
+ * the pool is busy, be it from the pool's own threads or from elsewhere */
+static void launch_inline(thread_func thread, threaddata *tdata, int total)
+{
+	tcb *tp;
+	int i, silent = tdata->silent;
+
+	tdata->threads[0]->tsteps = tdata->total = tdata->done = total;
+	tdata->what = thread;
+	if (tdata->chunks == THREAD_STEAL) thread = thread_steal;
+	else if (tdata->chunks >= 0) thread = thread_chunk;
+	for (i = 0; i < tdata->count; i++)
+	{
+		tp = tdata->threads[i];
+		tp->stop = tp->stopped = !!i; // Only the first one runs
+		tp->progress = 0;
+		tp->step0 = i ? total : 0;
+		tp->nsteps = i ? 0 : total;
+		tp->range = i ? 0 : RANGE(0, total);
+		tp->busy = tp->idle = 0.0;
+	}
+	tdata->silent = TRUE;
+	thread(tdata->threads[0]);
+	tdata->silent = silent;
+}
+
+int launch_threads(thread_func thread, threaddata *tdata, char *title, int total)
+{
+	tcb *tp;
+	time_t uninit_(before);
+	double t0, t1;
+	int i, j, n0, n1, flag = FALSE;
+
+	/* Nested or concurrent launch - leave the pool & its state alone */
+	if (thread_xadd(&pool_busy, 1))
+	{
+		thread_xadd(&pool_busy, -1);
+		launch_inline(thread, tdata, total);
+		return (0);
+	}
 
 	/* Prepare chunking */
 	tdata->threads[0]->tsteps = tdata->total = total;
@@ -285,9 +659,13 @@ int launch_threads(thread_func thread, threaddata *tdata, char *title, int total
 	if ((i > 1) && (j > 1))	j *= i , total = ((total + j - 1) / j) * i;
 	tdata->done = n1 = total;
 
-	/* Launch aux threads */
+	/* Wake up aux threads, adding more if needed */
 	tdata->what = thread;
-	if (tdata->chunks >= 0) thread = thread_chunk;
+	if (tdata->chunks == THREAD_STEAL) thread = thread_steal;
+	else if (tdata->chunks >= 0) thread = thread_chunk;
+	pool_grow(i);
+	t0 = thread_time();
+	POOL_LOCK();
 	threads_running = TRUE;
 	for (i -= 1; i > 0; i--)
 	{
@@ -298,19 +676,24 @@ int launch_threads(thread_func thread, threaddata *tdata, char *title, int total
 		/* Allocate work to thread */
 		tp->step0 = n0 = (n1 * i) / (i + 1);
 		tp->nsteps = n1 - n0;
-#if GTK_MAJOR_VERSION == 1
-		if (attr_failed || pthread_create(&tid, &attr,
-			(void *(*)(void *))thread, tp))
-#else 
-		if (!g_thread_create((GThreadFunc)thread, tp, FALSE, NULL))
-#endif
+		tp->range = 0;
+		tp->busy = 0.0;
+		/* Not launched, or still hung from a previous job */
+		if ((i >= pool_size) || pool[i].job)
 			tp->stop = TRUE , tp->stopped = TRUE; // Failed to launch
-		else n1 = n0 , flag = TRUE; // Success - work is now being done
+		else // Success - work is now being done
+		{
+			tp->range = RANGE(n0, n1);
+			pool[i].job = tp;
+			pool[i].func = thread;
+			n1 = n0 , flag = TRUE;
+		}
 	}
+	/* Main thread's range must be there before others try stealing it */
+	tdata->threads[0]->range = RANGE(0, n1);
 	threads_running = flag;
-#if GTK_MAJOR_VERSION == 1
-	pthread_attr_destroy(&attr);
-#endif
+	if (flag) POOL_SIGNAL(pool_wake);
+	POOL_UNLOCK();
 
 	/* Put main thread to work */
 	tp = tdata->threads[0];
@@ -320,40 +703,50 @@ int launch_threads(thread_func thread, threaddata *tdata, char *title, int total
 	tp->nsteps = n1;
 	if (title) progress_init(title, 1); /* Let init/end be done outside */
 	thread(tp);
+	tp->busy = thread_time() - t0;
 
 	/* Wait for aux threads to finish, or user to cancel the job */
 	flag = 0;
+	POOL_LOCK();
 	while (TRUE)
 	{
 		for (i = j = 1; i < tdata->count; i++)
-			j += tdata->threads[i]->stopped;
+			j += (i >= pool_size) || (pool[i].job != tdata->threads[i]);
 		if (j >= tdata->count) break; // All threads finished
 		if (tdata->threads[0]->stop) // Cancellation requested
 		{
-			if (!flag) before = clock();
-			else
+			if (!flag) before = time(NULL);
+			else if (time(NULL) - before >= 5)
 			{
-				now = clock();
-				if (now - before >= 5 * CLOCKS_PER_SEC)
-				{
 				/* Major catastrophe - hung thread(s) */
-					flag = 2;
-					break;
-				}
+				flag = 2;
+				break;
 			}
 			flag |= 1;
 		}
-		if (!tdata->silent) thread_progress(tdata->threads[0]);
-		/* Let 'em run */
-#if GTK_MAJOR_VERSION == 1
-		sched_yield();
-#else
-		g_thread_yield();
-#endif
+		/* Sleep till some thread is done, or it's time to poll */
+		if (tdata->silent && !flag) POOL_WAIT(pool_idle);
+		else pool_timed_wait();
+		if (tdata->silent) continue;
+		POOL_UNLOCK();
+		thread_progress(tdata->threads[0]);
+		POOL_LOCK();
 	}
+	POOL_UNLOCK();
 	threads_running = FALSE;
+	thread_xadd(&pool_busy, -1);
 	if (title) progress_end();
 
+	/* Report how well the load was balanced */
+	t1 = thread_time() - t0;
+	for (i = 0; i < tdata->count; i++)
+	{
+		tp = tdata->threads[i];
+		tp->idle = t1 - tp->busy;
+		if (thread_stats) g_printerr("Thread %d/%d: busy %.6f s, idle %.6f s\n",
+			i, tdata->count, tp->busy, tp->idle);
+	}
+
 /* !!! Even with OS threading, killing a thread is not supported on some systems,
  * and if a thread needs killing, it likely has corrupted some data already - WJ */
 	if (flag <= 1) return (0); // All OK
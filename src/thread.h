@@ -22,6 +22,8 @@ typedef struct threaddata threaddata;
 
 //	Thread function type
 typedef void (*thread_func)(tcb *thread);
+//	Background job function type
+typedef void (*thread_bgfunc)(void *data);
 
 //	Thread control block
 struct tcb {
@@ -32,6 +34,8 @@ struct tcb {
 	int count;		// Number of threads
 	int step0, nsteps;	// Work allocated to this thread
 	int tsteps;		// Total amount of work - set only for thread 0
+	volatile guint64 range;	// Work-stealing deque: [low, high) in 2 halves
+	double busy, idle;	// Time spent working & waiting, in seconds
 	threaddata *tdata;	// Pointer to array header
 	void *data;		// Parameters & buffers structure for function
 };
@@ -41,14 +45,19 @@ struct threaddata {
 	volatile int done;	// Allocated amount of work
 	int total;		// Total amount of work
 	int count;		// Number of threads
-	int chunks;		// Number of chunks per thread
+	int chunks;		// Number of chunks per thread, or THREAD_STEAL
 	int silent;		// No progressbar & error window
 	thread_func what;	// Function to run
 	tcb *threads[1];	// Threads' TCBs
 };
 
+//	Chunks mode: threads take shrinking pieces of own work, then steal others'
+#define THREAD_STEAL (-2)
+
 //	Configure max number of threads to launch
 int maxthreads;
+//	Print threads' busy & idle times to stderr
+int thread_stats;
 
 //	Prepare memory structures for threads' use
 threaddata *talloc(int flags, int tmax, void *data, int dsize, ...);
@@ -62,11 +71,30 @@ int threads_running;
 
 //	Max threads to be used
 int helper_threads();
+//	Start up the pool of helper threads
+void init_threads();
 //	Estimate how many threads is enough for image
 int image_threads(int w, int h);
 //	Update progressbar from main thread
 int thread_progress(tcb *thread);
 
+//	Run a job on the background thread; FALSE if there is no such thread
+int thread_bg_run(thread_bgfunc func, void *data);
+//	Wait till background job, if any, is done
+void thread_bg_wait();
+//	Check if background job is still running
+int thread_bg_busy();
+//	Check if pool is busy with a job, so that new ones would run inline
+int thread_pool_busy();
+
+//	Lock & unlock the mutex guarding data passed between a job's threads
+void thread_lock();
+void thread_unlock();
+//	Wait, with the mutex locked, till some thread calls thread_wake()
+void thread_wait();
+//	Wake up all threads waiting in thread_wait()
+void thread_wake();
+
 //	Track a thread's progress
 static inline int thread_step(tcb *thread, int i, int tlim, int steps)
 {
@@ -102,7 +130,16 @@ int thread_xadd(volatile int *var, int n);
 #else /* Only one actual thread */
 
 #define helper_threads() 1
+#define init_threads()
 #define image_threads(w,h) 1
+#define thread_bg_run(F,D) FALSE
+#define thread_bg_wait()
+#define thread_bg_busy() FALSE
+#define thread_pool_busy() FALSE
+#define thread_lock()
+#define thread_unlock()
+#define thread_wait()
+#define thread_wake()
 
 static inline int thread_step(tcb *thread, int i, int tlim, int steps)
 {
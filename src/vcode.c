@@ -2138,6 +2138,13 @@ GtkWidget *canvasimg(void **r, int w, int h, int bkg)
 
 //	CANVAS widget
 
+/* Exposes come every frame while drawing, so the buffer is kept between them,
+ * unless it gets too big to sit idle */
+#define EXPOSE_KEEP (1024 * 1024) /* Pixels */
+
+static unsigned char *canvas_rgb;
+static int canvas_rgb_size;
+
 static gboolean expose_canvas_(GtkWidget *widget, GdkEventExpose *event,
 	gpointer user_data)
 {
@@ -2165,8 +2172,14 @@ static gboolean expose_canvas_(GtkWidget *widget, GdkEventExpose *event,
 #endif
 	wjcanvas_get_vport(widget, vport);
 
-	ctx.rgb = malloc(wh * 3);
-	for (i = 0; i < cnt; i++)
+	if (wh > canvas_rgb_size)
+	{
+		free(canvas_rgb);
+		canvas_rgb = malloc(wh * 3);
+		canvas_rgb_size = canvas_rgb ? wh : 0;
+	}
+	ctx.rgb = canvas_rgb;
+	if (ctx.rgb) for (i = 0; i < cnt; i++)
 	{
 		ctx.xy[2] = (ctx.xy[0] = vport[0] + r[i].x) + r[i].width;
 		ctx.xy[3] = (ctx.xy[1] = vport[1] + r[i].y) + r[i].height;
@@ -2180,7 +2193,12 @@ static gboolean expose_canvas_(GtkWidget *widget, GdkEventExpose *event,
 				GDK_RGB_DITHER_NONE, ctx.rgb,
 				(ctx.xy[2] - ctx.xy[0]) * 3);
 	}
-	free(ctx.rgb);
+	if (canvas_rgb_size > EXPOSE_KEEP)
+	{
+		free(canvas_rgb);
+		canvas_rgb = NULL;
+		canvas_rgb_size = 0;
+	}
 
 #if GTK_MAJOR_VERSION == 2
 	g_free(rects);
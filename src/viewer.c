@@ -380,7 +380,7 @@ size_t render_layers(unsigned char *rgb, int cxy[4], int pw, int zoom, int scale
 	int rxy[4], txy[4] = { cxy[2], cxy[3], cxy[0], cxy[1] };
 	image_info *image;
 	unsigned char *tmp, **img;
-	int i, j, ii, jj, ll, wx0, wy0, wx1, wy1, xpm, opac;
+	int i, j, ii, jj, ll, wx0, wy0, wx1, wy1, xpm, opac, ml, lw;
 	int dx, dy, ddx, ddy, mx, mw, my, mh;
 	int px = cxy[0], py = cxy[1];
 	size_t npix = 0, nrow = 0;
@@ -450,17 +450,26 @@ size_t render_layers(unsigned char *rgb, int cxy[4], int pw, int zoom, int scale
 		xpm = ll ? image->trans : -1; // above background
 		opac = (t->opacity * 255 + 50) / 100;
 		mw = rxy[2] - (mx = rxy[0]);
-		setup_row(&rs, mx, mw, zoom, scale, image->width, xpm, opac,
-			image->bpp, image->pal);
 		mh = rxy[3] - (my = rxy[1]);
 		tmp = rgb + (my - py) * pw + (mx - px) * 3;
 		ddx = floor_div(mx * zoom, scale) - i;
 		ddy = floor_div(my * zoom, scale) - j;
 
+		/* Draw zoomed-out RGB from mipmap, if layer is aligned to it */
+		img = image->img;
+		ml = xpm < 0 ? mip_level(zoom) : 0;
+		while (ml && ((i | j) & ((1 << ml) - 1))) ml--;
+		if (ml && !(img = mip_get(image, ml, ddx, ddy,
+			ddx + (mw - 1) * zoom + 1, ddy + (mh - 1) * zoom + 1)))
+			img = image->img , ml = 0;
+		lw = (image->width + (1 << ml) - 1) >> ml;
+		setup_row(&rs, mx, mw, zoom >> ml, scale, lw, xpm, opac,
+			image->bpp, image->pal);
+		ddx >>= ml; ddy >>= ml;
+
 		i = my % scale;
 		if (i < 0) i += scale;
 		mh = mh * zoom + i;
-		img = image->img;
 		for (j = -1; i < mh; i += zoom , tmp += pw)
 		{
 			if ((i / scale == j) && !async_bk)
@@ -469,7 +478,7 @@ size_t render_layers(unsigned char *rgb, int cxy[4], int pw, int zoom, int scale
 				continue;
 			}
 			j = i / scale;
-			render_row(&rs, tmp, img, ddx, ddy + j, NULL);
+			render_row(&rs, tmp, img, ddx, ddy + (j >> ml), NULL);
 		}
 	}
 
@@ -549,9 +558,7 @@ void view_render_rgb( unsigned char *rgb, int px, int py, int pw, int ph, double
 
 	if (ls.tdata && (ls.tdata != MEM_NONE)) // 2+ threads w/allocation
 	{
-		nt /= ls.tdata->count;
-		if (nt > MAX_TH_STRIPS) nt = MAX_TH_STRIPS;
-		ls.tdata->chunks = nt;
+		ls.tdata->chunks = THREAD_STEAL;
 		ls.tdata->silent = TRUE;
 		launch_threads(do_layers_render, ls.tdata, NULL, wh);
 		free(ls.tdata);
@@ -819,10 +826,15 @@ void lr_update_area(int lr, int x, int y, int w, int h)	// Update x,y,w,h area o
 {
 	int mx, my, zoom, scale, rxy[4];
 
+	mx = lr & (LR_ANIM - 1);
+	mip_update(mx == layer_selected ? &mem_image :
+		&layer_table[mx].image->image_, x, y, w, h);
+
 	if ((lr < LR_ANIM) && (show_layers_main || (lr == layer_selected)))
 	{
 		mx = x + layer_table_p[lr].x - layer_table_p[layer_selected].x;
 		my = y + layer_table_p[lr].y - layer_table_p[layer_selected].y;
+		if (lr != layer_selected) main_update_layers(mx, my, w, h);
 		main_update_area(mx, my, w, h);
 	}
 
@@ -835,13 +847,14 @@ void lr_update_area(int lr, int x, int y, int w, int h)	// Update x,y,w,h area o
 	if (vw_zoom < 1.0)
 	{
 		zoom = rint(1.0 / vw_zoom);
-		w += x;
-		h += y;
-		x = floor_div(x + zoom - 1, zoom);
-		y = floor_div(y + zoom - 1, zoom);
-		w = (w - x * zoom + zoom - 1) / zoom;
-		h = (h - y * zoom + zoom - 1) / zoom;
 		if ((w <= 0) || (h <= 0)) return;
+		/* Mipmapped pixels average whole blocks, so cover them all */
+		w = floor_div(x + w - 1, zoom) + 1;
+		h = floor_div(y + h - 1, zoom) + 1;
+		x = floor_div(x, zoom);
+		y = floor_div(y, zoom);
+		w -= x;
+		h -= y;
 	}
 	else
 	{